@@ -0,0 +1,138 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atmel_start.h>
+#include <MCI.h>
+#include <Cache.h>
+
+COMPILER_ALIGNED(4)
+static uint8_t cache_data[CACHE_BYTES];
+
+static struct cache_slot __attribute__((section(".dtcm"))) slots[CACHE_MAX_SLOTS];
+static uint32_t __attribute__((section(".dtcm"))) slot_count;
+// slots below this one are the pinned partition
+static uint32_t __attribute__((section(".dtcm"))) pin_count;
+static uint32_t __attribute__((section(".dtcm"))) lru_clock;
+
+struct cache_stats __attribute__((section(".dtcm"))) cache_stats;
+
+void cache_init(void) {
+	// The DTCM isn't zeroed at startup, and cache_clear() and friends walk
+	// slot_count slots whether or not a volume was ever set up.
+	memset(slots, 0, sizeof(slots));
+	slot_count = 0;
+	pin_count = 0;
+	lru_clock = 0;
+	memset(&cache_stats, 0, sizeof(cache_stats));
+}
+
+void cache_setup(uint32_t block_size) {
+	slot_count = CACHE_BYTES / block_size;
+	pin_count = CACHE_PIN_BYTES / block_size;
+	for(int i = 0; i < slot_count; i++) {
+		slots[i].data = cache_data + i * block_size;
+	}
+	cache_clear();
+}
+
+void cache_clear(void) {
+	memset(cache_data, 0, sizeof(cache_data));
+	for(int i = 0; i < slot_count; i++) {
+		slots[i].flags = 0;
+		slots[i].stamp = 0;
+	}
+	lru_clock = 0;
+	memset(&cache_stats, 0, sizeof(cache_stats));
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) struct cache_slot *cache_find(uint64_t blocknum) {
+	for(int i = 0; i < slot_count; i++) {
+		if ((slots[i].flags & CACHE_VALID) && slots[i].blocknum == blocknum)
+			return &(slots[i]);
+	}
+	return NULL;
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) void cache_touch(struct cache_slot *slot) {
+	slot->stamp = ++lru_clock;
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) void cache_demote(struct cache_slot *slot) {
+	// As old as the wraparound-safe comparison in cache_alloc() allows.
+	slot->stamp = lru_clock - 0x7fffffffUL;
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) struct cache_slot *cache_alloc(uint64_t blocknum, bool pinned) {
+	struct cache_slot *victim = NULL;
+	for(int i = 0; i < slot_count; i++) {
+		struct cache_slot *slot = &(slots[i]);
+		// The block could be anywhere, but a new one only goes in its own partition.
+		bool candidate = pinned?(i < pin_count):(i >= pin_count);
+		if (!(slot->flags & CACHE_VALID)) {
+			if (!candidate) continue;
+			// An empty slot is as good as it gets, but keep looking in case
+			// the block is already here.
+			if (victim == NULL || (victim->flags & CACHE_VALID))
+				victim = slot;
+			continue;
+		}
+		if (slot->blocknum == blocknum) {
+			cache_touch(slot);
+			return slot;
+		}
+		if (!candidate || (slot->flags & CACHE_DIRTY)) continue; // not ours, or can't evict it
+		if (victim == NULL || ((victim->flags & CACHE_VALID) && slot->stamp - victim->stamp > 0x80000000UL))
+			victim = slot; // slot is older than victim (wraparound-safe)
+	}
+	if (victim == NULL) return NULL;
+	if (victim->flags & CACHE_PREFETCH) cache_stats.prefetch_wasted++;
+	victim->blocknum = blocknum;
+	victim->flags = 0;
+	cache_touch(victim);
+	return victim;
+}
+
+uint32_t cache_dirty_count(void) {
+	uint32_t out = 0;
+	for(int i = 0; i < slot_count; i++) {
+		if (slots[i].flags & CACHE_DIRTY) out++;
+	}
+	return out;
+}
+
+// Card first (the bottom bit of the block number), then block number.
+static inline bool slot_before(struct cache_slot *a, struct cache_slot *b) {
+	if ((a->blocknum & 1) != (b->blocknum & 1)) return (a->blocknum & 1) < (b->blocknum & 1);
+	return a->blocknum < b->blocknum;
+}
+
+uint32_t cache_collect_dirty(struct cache_slot **list, uint32_t max) {
+	uint32_t count = 0;
+	for(int i = 0; i < slot_count && count < max; i++) {
+		if (!(slots[i].flags & CACHE_DIRTY)) continue;
+		// insertion sort - there's never more than a few hundred of these.
+		int j = count++;
+		while(j > 0 && slot_before(&(slots[i]), list[j - 1])) {
+			list[j] = list[j - 1];
+			j--;
+		}
+		list[j] = &(slots[i]);
+	}
+	return count;
+}
@@ -0,0 +1,91 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The block cache holds *decrypted* volume blocks in SRAM - blocks the host
+ * has read (so re-reads of the FAT and directories skip the card and the AES),
+ * blocks read ahead and, with write-back on, blocks waiting to be written.
+ * It's just the bookkeeping - Crypto.c decides what goes in and takes care of
+ * getting dirty blocks out to the cards.
+ *
+ * Since it's plaintext, it must be cleared any time the keys are.
+ */
+
+// How much SRAM to give the cache. The number of slots depends on the volume
+// block size.
+#define CACHE_BYTES (64UL * 1024)
+#define CACHE_MAX_SLOTS (CACHE_BYTES / SECTOR_SIZE)
+// This much of it is set aside for filesystem metadata (see Pin.h), so a
+// big copy can't push the FAT out.
+#define CACHE_PIN_BYTES (16UL * 1024)
+
+// slot flags
+#define CACHE_VALID (0x01)
+// The slot has data that hasn't been written to the card yet.
+#define CACHE_DIRTY (0x02)
+// The slot was filled by read-ahead and the host hasn't asked for it yet.
+#define CACHE_PREFETCH (0x04)
+
+struct cache_slot {
+	uint64_t blocknum;
+	uint8_t *data;
+	uint32_t stamp; // for LRU
+	uint8_t flags;
+};
+
+struct cache_stats {
+	uint32_t hits; // reads served from the cache
+	uint32_t misses; // reads that had to go to the cards
+	uint32_t prefetch_hits; // read-ahead blocks the host asked for
+	uint32_t prefetch_wasted; // read-ahead blocks evicted without being asked for
+};
+
+extern struct cache_stats cache_stats;
+
+// Start out empty, with no volume block size. Call this once at startup.
+void cache_init(void);
+
+// Throw away everything in the cache (zeroizing it) and set it up for the given
+// volume block size. Any dirty data is lost.
+void cache_setup(uint32_t block_size);
+
+// Same as above, but keep the block size.
+void cache_clear(void);
+
+// Returns the slot holding the given block, or NULL.
+struct cache_slot *cache_find(uint64_t blocknum);
+
+// Returns a slot for the given block - either the one it's already in, or
+// the least recently used clean slot in the pinned or the ordinary part of
+// the cache. Returns NULL if every slot there is dirty. A new slot comes back
+// with flags set to 0. Either way, it's been touched.
+struct cache_slot *cache_alloc(uint64_t blocknum, bool pinned);
+
+// Mark a slot as most recently used.
+void cache_touch(struct cache_slot *slot);
+
+// Mark a slot as least recently used, so it's the next to go.
+void cache_demote(struct cache_slot *slot);
+
+// How many dirty slots are there?
+uint32_t cache_dirty_count(void);
+
+// Fill list with (up to max) the dirty slots, sorted by card and then by block number.
+// That way, the blocks that are adjacent on each card come out next to each other.
+uint32_t cache_collect_dirty(struct cache_slot **list, uint32_t max);
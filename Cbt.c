@@ -0,0 +1,222 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atmel_start.h>
+#include <MCI.h>
+#include <Crypto.h>
+#include <Cbt.h>
+
+/*
+ * The checkpoint header sector (the rest of it is zero):
+ * 00-0B: magic value
+ * 0C: state - CLEAN or STALE
+ * 0D: region shift
+ * 10-13: region count, little-endian
+ * 14-1B: volume size in blocks, little-endian
+ * The live bitmap follows in sectors 1 to CBT_BYTES / SECTOR_SIZE, then the snapshot.
+ */
+static const char *HEADER_MAGIC = "OrthrusCBT01";
+#define HEADER_MAGIC_LENGTH (12)
+#define HEADER_STATE_POS (0x0c)
+#define HEADER_SHIFT_POS (0x0d)
+#define HEADER_REGIONS_POS (0x10)
+#define HEADER_VOLUME_SIZE_POS (0x14)
+
+#define STATE_CLEAN (1)
+#define STATE_STALE (2)
+
+#if CBT_META_SECTORS > META_SECTORS
+#error The checkpoint is too big for the metadata area
+#endif
+#if CBT_META_SECTORS * SECTOR_SIZE > STAGING_BYTES
+#error The checkpoint is too big for the staging buffer
+#endif
+
+#define BITMAP_SECTORS (CBT_BYTES / SECTOR_SIZE)
+#define LIVE_START (1)
+#define SNAPSHOT_START (1 + BITMAP_SECTORS)
+
+// What VENDOR_CBT_GET sends, all in one piece.
+COMPILER_ALIGNED(4)
+static struct {
+	struct cbt_info info;
+	uint8_t bits[CBT_BYTES];
+} snapshot;
+COMPILER_ALIGNED(4)
+static uint8_t live[CBT_BYTES];
+
+static bool mounted, persistent;
+static uint8_t region_shift;
+static uint32_t regions;
+// Every bit set in live is also set in the checkpoint, and the header says it's good.
+static bool on_card_clean;
+// The bitmaps have changed since the last checkpoint.
+static volatile bool changed;
+// Bumped by the USB interrupt whenever it moves bits between the bitmaps, so
+// a checkpoint that was copying them at the time knows it may have a mix.
+static volatile uint32_t generation;
+
+static inline uint32_t bitmap_bytes(void) {
+	return (regions + 7) / 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+	for(int i = 0; i < 4; i++)
+		p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// The checkpoint goes to and from the card through the volume code's staging
+// buffer. It's only ever touched from the main loop, same as this.
+static bool write_header(uint8_t state) {
+	memset(staging, 0, SECTOR_SIZE);
+	memcpy(staging, HEADER_MAGIC, HEADER_MAGIC_LENGTH);
+	staging[HEADER_STATE_POS] = state;
+	staging[HEADER_SHIFT_POS] = region_shift;
+	put_le32(staging + HEADER_REGIONS_POS, regions);
+	put_le32(staging + HEADER_VOLUME_SIZE_POS, (uint32_t)volume_size);
+	put_le32(staging + HEADER_VOLUME_SIZE_POS + 4, (uint32_t)(volume_size >> 32));
+	return writeMetaSectors(0, staging, 1);
+}
+
+// Read the checkpoint. If it's not one we can trust, returns false.
+static bool load(void) {
+	if (!readMetaSectors(0, staging, CBT_META_SECTORS)) return false;
+	// Anything written with some other key (or never written) fails here.
+	if (memcmp(staging, HEADER_MAGIC, HEADER_MAGIC_LENGTH)) return false;
+	if (staging[HEADER_STATE_POS] != STATE_CLEAN) return false;
+	if (staging[HEADER_SHIFT_POS] != region_shift) return false;
+	if (get_le32(staging + HEADER_REGIONS_POS) != regions) return false;
+	uint64_t size = get_le32(staging + HEADER_VOLUME_SIZE_POS) | ((uint64_t)get_le32(staging + HEADER_VOLUME_SIZE_POS + 4) << 32);
+	if (size != volume_size) return false;
+	memcpy(live, staging + LIVE_START * SECTOR_SIZE, CBT_BYTES);
+	memcpy(snapshot.bits, staging + SNAPSHOT_START * SECTOR_SIZE, CBT_BYTES);
+	return true;
+}
+
+void cbt_mount(void) {
+	cbt_unmount();
+	// The smallest power of two regions that are at least CBT_MIN_REGION and fit.
+	region_shift = 31 - __builtin_clz(CBT_MIN_REGION / volume_block_size);
+	while(((volume_size + (1ULL << region_shift) - 1) >> region_shift) > CBT_BITS)
+		region_shift++;
+	regions = (uint32_t)((volume_size + (1ULL << region_shift) - 1) >> region_shift);
+	persistent = meta_sectors >= CBT_META_SECTORS;
+	mounted = true;
+
+	if (persistent && load()) {
+		on_card_clean = true;
+		changed = false;
+		return;
+	}
+	// No idea what's been written, so it all has.
+	memset(live, 0, sizeof(live));
+	memset(snapshot.bits, 0, sizeof(snapshot.bits));
+	memset(live, 0xff, regions / 8);
+	if (regions % 8) live[regions / 8] = (1 << (regions % 8)) - 1;
+	on_card_clean = false;
+	changed = true;
+}
+
+void cbt_unmount(void) {
+	mounted = false;
+	persistent = false;
+	regions = 0;
+	memset(live, 0, sizeof(live));
+	memset(&snapshot, 0, sizeof(snapshot));
+}
+
+void cbt_note_write(uint64_t blocknum) {
+	if (!mounted) return;
+	uint64_t region = blocknum >> region_shift;
+	if (region >= regions) return;
+	uint8_t mask = 1 << (region & 7);
+	if (live[region >> 3] & mask) return; // the usual case
+	if (on_card_clean && persistent) {
+		// The checkpoint won't have this one. Say so before the data can get there.
+		if (write_header(STATE_STALE)) on_card_clean = false;
+	}
+	live[region >> 3] |= mask;
+	changed = true;
+}
+
+bool cbt_needs_checkpoint(void) {
+	return mounted && persistent && changed;
+}
+
+bool cbt_checkpoint(void) {
+	if (!mounted || !persistent) return true;
+	// Anything the USB interrupt changes from here on makes for another one.
+	changed = false;
+	uint32_t start_generation = generation;
+	// A good checkpoint half overwritten isn't one any more.
+	if (on_card_clean) {
+		if (!write_header(STATE_STALE)) goto err;
+		on_card_clean = false;
+	}
+	// Both bitmaps go in one command. They get encrypted where they are, so
+	// they're copied out first.
+	memcpy(staging, live, CBT_BYTES);
+	memcpy(staging + BITMAP_SECTORS * SECTOR_SIZE, snapshot.bits, CBT_BYTES);
+	if (!writeMetaSectors(LIVE_START, staging, 2 * BITMAP_SECTORS)) goto err;
+	// A snapshot or clear in the middle of all that may have left us with
+	// the snapshot bitmap from before and the live one from after. That's
+	// no checkpoint, so leave it stale and go around again.
+	if (generation != start_generation) goto err;
+	// The header goes last, so a checkpoint cut short stays stale.
+	if (!write_header(STATE_CLEAN)) goto err;
+	on_card_clean = true;
+	return true;
+err:
+	changed = true;
+	return false;
+}
+
+int32_t cbt_get(bool take_snapshot, uint8_t **buf, uint32_t *len) {
+	if (!mounted) return ERR_NOT_FOUND;
+	if (take_snapshot) {
+		// A write in the main loop can race this and set a bit that's just
+		// moved over. That only means the region gets copied twice.
+		uint32_t *from = (uint32_t*)live, *to = (uint32_t*)snapshot.bits;
+		for(uint32_t i = 0; i < (bitmap_bytes() + 3) / 4; i++) {
+			to[i] |= from[i];
+			from[i] = 0;
+		}
+		generation++;
+		changed = true;
+	}
+	snapshot.info.region_blocks = 1UL << region_shift;
+	snapshot.info.regions = regions;
+	snapshot.info.volume_block_size = volume_block_size;
+	snapshot.info.flags = persistent?CBT_FLAG_PERSISTENT:0;
+	*buf = (uint8_t*)&snapshot;
+	*len = sizeof(snapshot.info) + bitmap_bytes();
+	return ERR_NONE;
+}
+
+int32_t cbt_clear(void) {
+	if (!mounted) return ERR_NOT_FOUND;
+	memset(snapshot.bits, 0, sizeof(snapshot.bits));
+	generation++;
+	changed = true;
+	return ERR_NONE;
+}
@@ -0,0 +1,85 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Changed block tracking, so an incremental backup (see Raw.h) only has to
+ * copy the parts of the cards that were written since the last one. The
+ * volume is split into regions of at least CBT_MIN_REGION bytes - bigger if
+ * that would take more than CBT_BITS of them - and each write sets the bit
+ * for its region.
+ *
+ * There are two bitmaps. The live one collects writes. VENDOR_CBT_GET can
+ * first OR it into the snapshot and clear it, then returns the snapshot.
+ * Once the backup has the regions in the snapshot, VENDOR_CBT_CLEAR empties
+ * it. A backup that fails part way just doesn't clear it, and the next
+ * snapshot still has everything.
+ *
+ * Both bitmaps are checkpointed (encrypted, see Crypto.h) to the metadata
+ * area on card A once the host goes idle. Before the first write after a
+ * checkpoint sets a new bit, the checkpoint is marked as stale, so if the
+ * power goes before the next one, the next mount knows it can't be trusted.
+ * Without a trustworthy checkpoint - a fresh volume, a stale checkpoint or a
+ * volume too old to have a metadata area - every region starts out changed.
+ */
+
+#ifndef CBT_H_
+#define CBT_H_
+
+#define CBT_MIN_REGION (1024UL * 1024)
+// 16K regions. That's 1 MB regions for volumes up to 16 GB, and 8 MB ones
+// at 128 GB - still a lot less than copying the lot. Keep it small: both
+// bitmaps live in RAM, and the checkpoint goes through the staging buffer.
+#define CBT_BITS (16UL * 1024)
+#define CBT_BYTES (CBT_BITS / 8)
+
+// The checkpoint is a header sector and then the two bitmaps.
+#define CBT_META_SECTORS (1 + 2 * (CBT_BYTES / SECTOR_SIZE))
+
+// flags in cbt_info
+#define CBT_FLAG_PERSISTENT (0x00000001UL) // there's a metadata area to checkpoint to
+
+// What VENDOR_CBT_GET returns ahead of the snapshot bitmap - little-endian.
+// Region r is volume blocks r * region_blocks up to (r + 1) * region_blocks - 1,
+// and bit r is bit (r % 8) of byte r / 8.
+struct cbt_info {
+	uint32_t region_blocks; // a power of two
+	uint32_t regions;
+	uint32_t volume_block_size;
+	uint32_t flags;
+};
+
+// Set up for a freshly prepared volume, loading the checkpoint if there's a
+// good one.
+void cbt_mount(void);
+// Forget everything.
+void cbt_unmount(void);
+
+// A volume block is being written.
+void cbt_note_write(uint64_t blocknum);
+
+// Is there anything the checkpoint doesn't have yet?
+bool cbt_needs_checkpoint(void);
+// Write the bitmaps out to the metadata area.
+bool cbt_checkpoint(void);
+
+// The VENDOR_CBT_* handling, from the USB interrupt.
+int32_t cbt_get(bool snapshot, uint8_t **buf, uint32_t *len);
+int32_t cbt_clear(void);
+
+#endif /* CBT_H_ */
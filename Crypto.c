@@ -20,13 +20,40 @@
 #include <atmel_start.h>
 #include <AES.h>
 #include <MCI.h>
+#include <Crypto.h>
+#include <Cache.h>
+#include <Pin.h>
+#include <Cbt.h>
+#include <Profile.h>
+#include <Trace.h>
 
-static const char *MAGIC = "OrthrusVolumeV02";
+static const char *MAGIC = "OrthrusVolumeV03";
+// V02 volumes are identical, but only ever use a 32 bit block number in the tweak.
+static const char *MAGIC_V02 = "OrthrusVolumeV02";
 
 static uint8_t __attribute__((section(".dtcm"))) nonceA[BLOCKSIZE], nonceB[BLOCKSIZE];
 
 static uint8_t __attribute__((section(".dtcm"))) cardswap;
 
+uint64_t volume_size;
+uint32_t scratch_start, scratch_sectors;
+uint32_t meta_start, meta_sectors;
+uint32_t __attribute__((section(".dtcm"))) volume_block_size;
+// How many physical sectors make up one volume block
+static uint32_t __attribute__((section(".dtcm"))) sectors_per_block;
+
+#ifdef WRITE_BACK_CACHE
+bool write_cache_enabled = true;
+#else
+bool write_cache_enabled = false;
+#endif
+uint32_t batch_sectors = MAX_BATCH_SECTORS;
+
+// Dirty cache blocks are encrypted into here to go out to the cards in batches.
+COMPILER_ALIGNED(4)
+uint8_t staging[STAGING_BYTES];
+static struct cache_slot __attribute__((section(".dtcm"))) *dirty_list[CACHE_MAX_SLOTS];
+
 /*
  * The keyblock on each card looks like this:
  * 00-0F: magic value
@@ -34,7 +61,9 @@ static uint8_t __attribute__((section(".dtcm"))) cardswap;
  * 50-6F: key block
  * 70-7F: nonce for the *other* card (only 70-7b actually used)
  * 80: flag - 0 for "A", 1 for "B"
- * 81-1FF: unused
+ * 81: volume format flags (V03 only - see Crypto.h)
+ * 82-85: scratch sector count, big-endian (V03 only - 0 on older volumes)
+ * 86-1FF: unused
  *
  * To make the volume key, you shuffle the key blocks
  * from card A and B together (A first) and perform an AES CMAC over
@@ -42,6 +71,21 @@ static uint8_t __attribute__((section(".dtcm"))) cardswap;
  * the two CMAC outputs to form a 256 bit key. You then use that as the key
  * for an AES CMAC over the two halves of the volume ID, again concatenating
  * the results. The result of that is the volume key.
+ *
+ * The XEX tweak for each volume block is the nonce with bytes 12-15 replaced by
+ * the bottom 32 bits of the block number and bytes 8-11 XORed with the top 32 bits.
+ * For volumes under 2^32 blocks that's the same thing V02 did, so V02 volumes
+ * are still readable (they're just limited to 2^32 blocks).
+ *
+ * Volume blocks alternate between the cards, A first. Each volume block
+ * occupies sectors_per_block contiguous sectors on its card, and the first
+ * volume block's worth of sectors on each card is reserved for the keyblock.
+ * A 4Kn volume thus starts its data at sector 8, and gets one tweak per 4 KB.
+ * The last scratch sector count sectors of the smaller card (and the same
+ * sectors on the other one) are outside the volume, for the write benchmark.
+ * The end of that on card A is the metadata area. Its sectors use the A
+ * nonce with bytes 8-11 inverted and bytes 12-15 replaced by the sector's
+ * place in the area - no volume block number is big enough to collide.
  */
 #define MAGIC_POS (0)
 #define MAGIC_LENGTH (0x10)
@@ -52,6 +96,8 @@ static uint8_t __attribute__((section(".dtcm"))) cardswap;
 #define NONCE_POS (0x70)
 #define NONCE_LENGTH (BLOCKSIZE)
 #define FLAG_POS (0x80)
+#define FORMAT_FLAGS_POS (0x81)
+#define SCRATCH_POS (0x82)
 // 256 bits
 #define KEYSIZE (32)
 
@@ -59,17 +105,37 @@ bool prepVolume(void) {
 	uint8_t volid[VOL_ID_LENGTH], keyblock[2][KEY_BLOCK_LENGTH];
 	uint8_t blockbuf[SECTOR_SIZE];
 	if (!readPhysicalBlock(0, 0, blockbuf)) return false; // card A
-	if (memcmp(blockbuf, MAGIC, strlen(MAGIC))) return false; // Wrong magic
+	bool legacy = !memcmp(blockbuf, MAGIC_V02, strlen(MAGIC_V02));
+	if (!legacy && memcmp(blockbuf, MAGIC, strlen(MAGIC))) return false; // Wrong magic
 	cardswap = blockbuf[FLAG_POS] != 0; // we're swapping if A isn't A
 	memcpy(volid, blockbuf + VOL_ID_POS, sizeof(volid));
 	memcpy(cardswap?keyblock[1]:keyblock[0], blockbuf + KEY_BLOCK_POS, sizeof(keyblock[0]));
 	memcpy(cardswap?nonceB:nonceA, blockbuf + NONCE_POS, sizeof(nonceA));
+	// Both cards say what the format is. They'd better agree.
+	uint8_t format_flags = legacy?0:blockbuf[FORMAT_FLAGS_POS];
+	uint32_t scratch = 0;
+	if (!legacy) {
+		for(int i = 0; i < 4; i++)
+			scratch = (scratch << 8) | blockbuf[SCRATCH_POS + i];
+	}
 	
 	if (!readPhysicalBlock(1, 0, blockbuf)) return false; // card B
-	if (memcmp(blockbuf, MAGIC, strlen(MAGIC))) return false; // Wrong magic
+	if (memcmp(blockbuf, legacy?MAGIC_V02:MAGIC, strlen(MAGIC))) return false; // Wrong magic
 	if (memcmp(blockbuf + VOL_ID_POS, volid, sizeof(volid))) return false; // Wrong vol ID
 	if (!((blockbuf[FLAG_POS] != 0) ^ cardswap)) return false; // Must be one A, one B.
 
+	if (!legacy && blockbuf[FORMAT_FLAGS_POS] != format_flags) return false; // Mismatched format
+	if (format_flags & ~VOLUME_FLAG_4KN) return false; // Something we don't know how to do
+	if (!legacy) {
+		uint32_t scratch_b = 0;
+		for(int i = 0; i < 4; i++)
+			scratch_b = (scratch_b << 8) | blockbuf[SCRATCH_POS + i];
+		if (scratch_b != scratch) return false; // Mismatched format
+	}
+	// Check that before there's any key to leave lying around.
+	uint64_t block_count = (card_size[0] > card_size[1])?card_size[1]:card_size[0];
+	if (scratch > block_count / 2) return false; // nonsense
+
 	memcpy(cardswap?keyblock[0]:keyblock[1], blockbuf + KEY_BLOCK_POS, sizeof(keyblock[0]));
 	memcpy(cardswap?nonceA:nonceB, blockbuf + NONCE_POS, sizeof(nonceA));
 	memset(blockbuf, 0, KEYSIZE); // save RAM - use the block buf as temp
@@ -94,6 +160,28 @@ bool prepVolume(void) {
 	memset(key, 0, sizeof(key));
 	memset(blockbuf, 0, sizeof(blockbuf));
 	memset(volid, 0, sizeof(volid));
+
+	volume_block_size = (format_flags & VOLUME_FLAG_4KN)?(8 * SECTOR_SIZE):SECTOR_SIZE;
+	sectors_per_block = volume_block_size / SECTOR_SIZE;
+	scratch_sectors = scratch;
+	scratch_start = (uint32_t)(block_count - scratch);
+	volume_size = (((block_count - scratch) / sectors_per_block) - 1) << 1;
+	if (scratch >= 2 * META_SECTORS) {
+		scratch_sectors -= META_SECTORS;
+		meta_start = scratch_start + scratch_sectors;
+		meta_sectors = META_SECTORS;
+	} else {
+		meta_sectors = 0;
+	}
+
+	// A V02 volume never had more than 2^32 blocks, no matter what size the cards are.
+	if (legacy && volume_size > 0xffffffffULL)
+		volume_size = 0xffffffffULL;
+
+	// Anything cached belonged to whatever volume was here before.
+	cache_setup(volume_block_size);
+	pin_reset();
+	cbt_mount();
 	return true; // all set!
 }
 
@@ -109,7 +197,7 @@ bool prepVolume(void) {
  * initialized volume. This is by design - it very quickly trashes all of the
  * data on the volume (by changing the key out from under the data).
  */
-bool initVolume(void) {
+bool initVolume(uint8_t format_flags) {
 	uint8_t blockbuf[SECTOR_SIZE];
 	uint8_t ignore[SECTOR_SIZE]; // We're going to do a sacrificial read here before each write
 	
@@ -123,6 +211,9 @@ bool initVolume(void) {
 	rand_sync_read_buf8(&RAND_0, blockbuf + VOL_ID_POS, VOL_ID_LENGTH + KEY_BLOCK_LENGTH + NONCE_LENGTH);
 
 	blockbuf[FLAG_POS] = 0; // card A
+	blockbuf[FORMAT_FLAGS_POS] = format_flags;
+	for(int i = 0; i < 4; i++)
+		blockbuf[SCRATCH_POS + i] = (uint8_t)(SCRATCH_SECTORS >> (24 - 8 * i));
 	
 	// It's not clear why, but not performing this sacrificial read
 	// can cause the write to fail without error. redrum.
@@ -146,48 +237,246 @@ bool initVolume(void) {
 
 void unmountVolume(void) {
 	clearKeys();
+	cache_clear(); // it's plaintext
+	pin_reset();
 	memset(nonceA, 0, sizeof(nonceA));
 	memset(nonceB, 0, sizeof(nonceB));
+	scratch_sectors = 0;
+	meta_sectors = 0;
+	cbt_unmount();
+}
+
+// Which *PHYSICAL* card a volume block lives on - false for A or true for B
+static inline bool cardFor(uint64_t blocknum) {
+	return !(((blocknum & 0x1) == 0) ^ cardswap);
 }
 
 // return false for *PHYSICAL* card A or true for B
-// During the data transfer, we call process_xex_block() on each BLOCKSIZE bytes as we go.
-__attribute__((noinline)) __attribute__((section(".itcm"))) static bool setupBlockCrypto(uint32_t blocknum, enum aes_action mode) {
+// After this, processVolumeBlock() runs the data through XEX.
+__attribute__((noinline)) __attribute__((section(".itcm"))) static bool setupBlockCrypto(uint64_t blocknum, enum aes_action mode) {
+	PROFILE_START(t);
 	uint8_t cardA = (blocknum & 0x1) == 0;
 
-	uint8_t *nonce = cardA?nonceB:nonceA;
+	uint8_t nonce[BLOCKSIZE];
+	memcpy(nonce, cardA?nonceB:nonceA, sizeof(nonce));
+	nonce[8] ^= (uint8_t)(blocknum >> 56);
+	nonce[9] ^= (uint8_t)(blocknum >> 48);
+	nonce[10] ^= (uint8_t)(blocknum >> 40);
+	nonce[11] ^= (uint8_t)(blocknum >> 32);
 	nonce[12] = (uint8_t)(blocknum >> 24);
 	nonce[13] = (uint8_t)(blocknum >> 16);
 	nonce[14] = (uint8_t)(blocknum >> 8);
 	nonce[15] = (uint8_t)(blocknum >> 0);
-	init_xex(nonce, sizeof(nonceA), mode);
+	init_xex(nonce, sizeof(nonce), mode);
 
+	PROFILE_END(PROF_TWEAK, t);
 	return !(cardA ^ cardswap);
 }
 
-__attribute__((noinline)) __attribute__((section(".itcm"))) bool readVolumeBlock(uint32_t blocknum, uint8_t *buf) {
+// Run XEX over a whole volume block, after setupBlockCrypto().
+__attribute__((noinline)) __attribute__((section(".itcm"))) static void processVolumeBlock(uint8_t *buf) {
+	PROFILE_START(t);
+	TRACE_EVENT(TR_XEX_START, 0, volume_block_size / BLOCKSIZE);
+	for(uint32_t i = 0; i < volume_block_size; i += BLOCKSIZE)
+		process_xex_block(buf + i);
+	TRACE_EVENT(TR_XEX_END, 0, 0);
+	PROFILE_END(PROF_XEX, t);
+}
+
+static void setupMetaCrypto(uint32_t sector, enum aes_action mode) {
+	uint8_t nonce[BLOCKSIZE];
+	memcpy(nonce, nonceA, sizeof(nonce));
+	for(int i = 8; i < 12; i++)
+		nonce[i] ^= 0xff;
+	nonce[12] = (uint8_t)(sector >> 24);
+	nonce[13] = (uint8_t)(sector >> 16);
+	nonce[14] = (uint8_t)(sector >> 8);
+	nonce[15] = (uint8_t)(sector >> 0);
+	init_xex(nonce, sizeof(nonce), mode);
+}
+
+static void processMetaSectors(uint32_t sector, uint8_t *buf, uint16_t count, enum aes_action mode) {
+	for(uint16_t i = 0; i < count; i++) {
+		setupMetaCrypto(sector + i, mode);
+		for(uint32_t j = 0; j < SECTOR_SIZE; j += BLOCKSIZE)
+			process_xex_block(buf + i * SECTOR_SIZE + j);
+	}
+}
+
+// Card A is whichever one has the A flag.
+bool readMetaSectors(uint32_t sector, uint8_t *buf, uint16_t count) {
+	if ((uint64_t)sector + count > meta_sectors) return false;
+	if (!readPhysicalBlocks(cardswap != 0, meta_start + sector, buf, count)) return false;
+	processMetaSectors(sector, buf, count, AES_DECRYPT);
+	return true;
+}
+
+bool writeMetaSectors(uint32_t sector, uint8_t *buf, uint16_t count) {
+	if ((uint64_t)sector + count > meta_sectors) return false;
+	processMetaSectors(sector, buf, count, AES_ENCRYPT);
+	return writePhysicalBlocks(cardswap != 0, meta_start + sector, buf, count);
+}
+
+// The sector number on its card where a volume block starts.
+static inline uint32_t physBlock(uint64_t blocknum) {
+	return (uint32_t)(((blocknum >> 1) + 1) * sectors_per_block);
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) bool readVolumeBlock(uint64_t blocknum, uint8_t *buf) {
+	// Anything in the cache is newer than what's on the card.
+	struct cache_slot *slot = cache_find(blocknum);
+	if (slot != NULL) {
+		memcpy(buf, slot->data, volume_block_size);
+		cache_stats.hits++;
+		if (slot->flags & CACHE_PREFETCH) {
+			// Streamed data is rarely read twice. Let it go first.
+			slot->flags &= ~CACHE_PREFETCH;
+			cache_stats.prefetch_hits++;
+			cache_demote(slot);
+		} else {
+			cache_touch(slot);
+		}
+		pin_note_block(blocknum, buf, false);
+		return true;
+	}
+	cache_stats.misses++;
+
 	gpio_set_pin_level(LED_ACT, true);
 	bool card = setupBlockCrypto(blocknum, AES_DECRYPT);
-	uint32_t phys_blocknum = (blocknum >> 1) + 1;
-	if (!readPhysicalBlock(card, phys_blocknum, (uint8_t*)buf)) {
+	if (!readPhysicalBlocks(card, physBlock(blocknum), (uint8_t*)buf, sectors_per_block)) {
 		gpio_set_pin_level(LED_ACT, false);
 		gpio_set_pin_level(LED_ERR, true);
 		return false; // ERROR
 	}
-	for(int i = 0; i < SECTOR_SIZE; i += BLOCKSIZE)
-		process_xex_block((uint8_t*)buf + i);
+	processVolumeBlock((uint8_t*)buf);
 	gpio_set_pin_level(LED_ACT, false);
 	gpio_set_pin_level(LED_ERR, false);
+
+	pin_note_block(blocknum, buf, false);
+	// Keep a copy. FAT and directory blocks get read over and over.
+	slot = cache_alloc(blocknum, pin_wanted(blocknum));
+	if (slot != NULL) {
+		memcpy(slot->data, buf, volume_block_size);
+		slot->flags = CACHE_VALID;
+	}
 	return true;
 }
-	
-__attribute__((noinline)) __attribute__((section(".itcm"))) bool writeVolumeBlock(uint32_t blocknum, uint8_t *buf) {
+
+// How many volume blocks go in one multi-block card command.
+static inline uint32_t batchBlocks(void) {
+	uint32_t out = batch_sectors / sectors_per_block;
+	return out?out:1;
+}
+
+// One batch from each card.
+uint32_t prefetchLimit(void) {
+	return 2 * batchBlocks();
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) uint32_t prefetchVolume(uint64_t blocknum, uint32_t count) {
+	uint32_t done = 0;
+	if (blocknum >= volume_size) return 0;
+	if (count > volume_size - blocknum) count = volume_size - blocknum;
+
+	for(int parity = 0; parity < 2; parity++) {
+		uint64_t first = blocknum + parity;
+		// With an odd count, the second card has one block fewer to give -
+		// reading (count + 1) / 2 from it would go past the end of the volume.
+		uint32_t per_card = (count - parity + 1) / 2;
+		if (per_card > batchBlocks()) per_card = batchBlocks();
+		if (per_card == 0) break;
+		gpio_set_pin_level(LED_ACT, true);
+		bool ok = readPhysicalBlocks(cardFor(first), physBlock(first), staging, per_card * sectors_per_block);
+		gpio_set_pin_level(LED_ACT, false);
+		if (!ok) {
+			gpio_set_pin_level(LED_ERR, true);
+			return done;
+		}
+		for(uint32_t i = 0; i < per_card; i++) {
+			uint64_t this_block = first + 2 * i;
+			if (cache_find(this_block) != NULL) continue; // what's cached is at least as new
+			struct cache_slot *slot = cache_alloc(this_block, pin_wanted(this_block));
+			if (slot == NULL) return done; // cache is full of dirty blocks
+			setupBlockCrypto(this_block, AES_DECRYPT);
+			memcpy(slot->data, staging + i * volume_block_size, volume_block_size);
+			processVolumeBlock(slot->data);
+			slot->flags = CACHE_VALID | CACHE_PREFETCH;
+			done++;
+		}
+	}
+	return done;
+}
+
+// Encrypt and write out count cached volume blocks that are contiguous on one card
+// (so their block numbers go up by 2). They go out with a single multi-block write.
+__attribute__((noinline)) __attribute__((section(".itcm"))) static bool writeVolumeRun(struct cache_slot **run, uint32_t count) {
+	bool card = false;
+	gpio_set_pin_level(LED_ACT, true);
+	for(uint32_t i = 0; i < count; i++) {
+		uint8_t *out = staging + i * volume_block_size;
+		card = setupBlockCrypto(run[i]->blocknum, AES_ENCRYPT);
+		memcpy(out, run[i]->data, volume_block_size);
+		processVolumeBlock(out);
+	}
+	bool ok = writePhysicalBlocks(card, physBlock(run[0]->blocknum), staging, count * sectors_per_block);
+	gpio_set_pin_level(LED_ACT, false);
+	gpio_set_pin_level(LED_ERR, !ok);
+	return ok;
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) bool flushVolume(void) {
+	uint32_t count = cache_collect_dirty(dirty_list, CACHE_MAX_SLOTS);
+	uint32_t batch = batchBlocks();
+	bool ok = true;
+	TRACE_EVENT(TR_FLUSH_START, 0, count);
+	for(uint32_t i = 0; i < count; ) {
+		uint32_t run = 1;
+		while(i + run < count && run < batch && dirty_list[i + run]->blocknum == dirty_list[i + run - 1]->blocknum + 2)
+			run++;
+		if (!writeVolumeRun(dirty_list + i, run)) {
+			ok = false;
+			break;
+		}
+		for(uint32_t j = i; j < i + run; j++)
+			dirty_list[j]->flags &= ~CACHE_DIRTY;
+		i += run;
+	}
+	TRACE_EVENT(TR_FLUSH_END, 0, ok);
+	return ok;
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) bool writeVolumeBlock(uint64_t blocknum, uint8_t *buf, bool fua) {
+	struct cache_slot *slot;
+	pin_note_block(blocknum, buf, true); // before buf gets encrypted
+	cbt_note_write(blocknum);
+	if (write_cache_enabled && !fua) {
+		bool pinned = pin_wanted(blocknum);
+		slot = cache_alloc(blocknum, pinned);
+		if (slot == NULL) {
+			// Every slot is dirty. Make some room.
+			if (!flushVolume()) return false;
+			slot = cache_alloc(blocknum, pinned);
+		}
+		memcpy(slot->data, buf, volume_block_size);
+		slot->flags = CACHE_VALID | CACHE_DIRTY;
+		return true;
+	}
+
+	// Write-through. Keep any cached copy in step with the card.
+	slot = cache_find(blocknum);
+	if (slot != NULL) {
+		memcpy(slot->data, buf, volume_block_size);
+		slot->flags &= ~(CACHE_DIRTY | CACHE_PREFETCH);
+		cache_touch(slot);
+	}
+
 	gpio_set_pin_level(LED_ACT, true);
 	bool card = setupBlockCrypto(blocknum, AES_ENCRYPT);
-	uint32_t phys_blocknum = (blocknum >> 1) + 1;
-	for(int i = 0; i < SECTOR_SIZE; i += BLOCKSIZE)
-		process_xex_block(buf + i);
-	bool out = writePhysicalBlock(card, phys_blocknum, buf);
+	processVolumeBlock(buf);
+	bool out = writePhysicalBlocks(card, physBlock(blocknum), buf, sectors_per_block);
+	// The cached copy was updated ahead of the write (buf is ciphertext now).
+	// If the card didn't take it, the cache mustn't say otherwise.
+	if (!out && slot != NULL) slot->flags = 0;
 	gpio_set_pin_level(LED_ACT, false);
 	gpio_set_pin_level(LED_ERR, !out);
 	return out;
@@ -32,6 +32,51 @@
  * for an AES CMAC over the volume ID. The result of that is
  * the volume key.
  */
+// Volume format flags. These live in the keyblock and are fixed when the volume
+// is initialized.
+//
+// 4Kn volumes present 4096 byte logical blocks. Each one is 8 contiguous sectors
+// on one card with one XEX tweak, which cuts the per-block overhead 8x for hosts
+// that do page sized I/O.
+#define VOLUME_FLAG_4KN (0x01)
+
+// This is the largest volume_block_size there can be.
+#define MAX_VOLUME_BLOCK_SIZE (8 * SECTOR_SIZE)
+
+// Define this to make newly initialized volumes 4Kn volumes.
+//#define FORMAT_4KN
+
+#ifdef FORMAT_4KN
+#define INIT_VOLUME_FLAGS (VOLUME_FLAG_4KN)
+#else
+#define INIT_VOLUME_FLAGS (0)
+#endif
+
+// Newly initialized volumes leave this many sectors at the end of each card
+// out of the volume, as scratch space for the write benchmark (see Diag.h).
+// That's 1 MB, and a multiple of every volume block size.
+#define SCRATCH_SECTORS (2048UL)
+
+// These are set by prepVolume(). The volume size is in volume blocks, and can
+// exceed 2^32 with a pair of 1 TB+ cards.
+extern uint64_t volume_size;
+extern uint32_t volume_block_size;
+// The scratch space is the same sectors on both cards. Older volumes don't
+// have any (scratch_sectors is 0).
+extern uint32_t scratch_start, scratch_sectors;
+
+// The last META_SECTORS of the scratch space on card A are kept back as a
+// metadata area for the firmware's own use (see Cbt.h). meta_sectors is 0
+// if there's no room for one.
+#define META_SECTORS (128UL)
+extern uint32_t meta_start, meta_sectors;
+
+// Read or write count sectors of the metadata area, starting that many
+// sectors into it. They're encrypted with the volume key, under tweaks no volume block
+// uses. writeMetaSectors() trashes buf.
+bool readMetaSectors(uint32_t sector, uint8_t *buf, uint16_t count);
+bool writeMetaSectors(uint32_t sector, uint8_t *buf, uint16_t count);
+
 bool prepVolume(void);
 
 // call this to clear the keys and nonce when a volume goes offline
@@ -43,16 +88,50 @@ void unmountVolume(void);
  *
  * Each card gets the same volume ID, but unique key blocks and nonces (only the
  * first ten bytes of the 16 byte PRNG block are used for the nonce). Finally,
- * one card is marked as "A" and the other as "B".
+ * one card is marked as "A" and the other as "B". format_flags are
+ * the VOLUME_FLAG_ values the new volume will use.
  *
  * Note that this operation doesn't prevent you from initializing an already
  * initialized volume. This is by design - it very quickly trashes all of the
  * data on the volume (by changing the key out from under the data).
  */
-bool initVolume(void);
+bool initVolume(uint8_t format_flags);
+
+// Define this to have writes go into the block cache and get written out to
+// the cards later (on SYNCHRONIZE CACHE, FUA, when the host goes idle or on
+// card removal). This makes writes much faster, but pulling the cards without
+// ejecting first can lose writes the host thinks have been done.
+//#define WRITE_BACK_CACHE
+
+// Whether or not writes are being cached (reported to the host as WCE).
+extern bool write_cache_enabled;
+
+// The most sectors read ahead or written out with one multi-block command.
+// It can be turned down from MAX_BATCH_SECTORS, but a volume block always
+// goes in one piece.
+#define MAX_BATCH_SECTORS (32)
+extern uint32_t batch_sectors;
+
+// The buffer batches go through. The volume I/O methods only use it while
+// they run, so the rest of the main loop can borrow it in between.
+#define STAGING_BYTES (MAX_BATCH_SECTORS * SECTOR_SIZE)
+extern uint8_t staging[];
 
 // These methods are the volume I/O methods. They are synchronous.
-// Returns false on error.
-bool readVolumeBlock(uint32_t blocknum, uint8_t *buf);
+// buf is volume_block_size bytes. Returns false on error.
+// writeVolumeBlock() may trash the content of buf. If fua is set, or write
+// caching is off, the block is on the card when it returns.
+bool readVolumeBlock(uint64_t blocknum, uint8_t *buf);
 	
-bool writeVolumeBlock(uint32_t blocknum, uint8_t *buf);
\ No newline at end of file
+bool writeVolumeBlock(uint64_t blocknum, uint8_t *buf, bool fua);
+
+// Write any dirty cached blocks out to the cards.
+bool flushVolume(void);
+
+// Read count volume blocks starting at blocknum (which should be even, so it
+// covers whole stripes) into the cache ahead of the host asking for them. Each
+// card gets one multi-block read. Blocks already in the cache are left alone.
+// Returns the number of blocks added. No more than prefetchLimit() blocks are
+// read, however big count is.
+uint32_t prefetchVolume(uint64_t blocknum, uint32_t count);
+uint32_t prefetchLimit(void);
\ No newline at end of file
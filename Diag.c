@@ -0,0 +1,275 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atmel_start.h>
+#include <AES.h>
+#include <MCI.h>
+#include <Crypto.h>
+#include <usb_start.h>
+#include <Sched.h>
+#include <Trace.h>
+#include <Diag.h>
+
+#define SPC_RECEIVE_DIAGNOSTIC_RESULTS (0x1c)
+#define SPC_SEND_DIAGNOSTIC (0x1d)
+
+#define PAGE_HEADER (8)
+
+#define MIN(a,b) (((a)>(b))?(b):(a))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+struct bench {
+	uint64_t cycles;
+	uint32_t bytes;
+	uint32_t ops;
+};
+
+// The tests run start to finish in one go from the main loop, so they
+// borrow the volume code's staging buffer. readVolumeBlock() doesn't use it.
+#if DIAG_CHUNK_SECTORS * SECTOR_SIZE > STAGING_BYTES
+#error A benchmark chunk is bigger than the staging buffer
+#endif
+
+COMPILER_ALIGNED(4)
+static uint8_t params[PAGE_HEADER];
+COMPILER_ALIGNED(4)
+static uint8_t results[PAGE_HEADER + DIAG_RESULTS * DIAG_RECORD_SIZE] = {
+	DIAG_PAGE_BENCH, DIAG_STATUS_NONE, 0, PAGE_HEADER - 4 + DIAG_RESULTS * DIAG_RECORD_SIZE
+};
+static const uint8_t supported_pages[] = { DIAG_PAGE_SUPPORTED, 0, 0, 2, DIAG_PAGE_SUPPORTED, DIAG_PAGE_BENCH };
+
+static volatile bool pending;
+static uint8_t flags;
+static uint16_t sectors;
+static uint32_t rng;
+
+// xorshift - the AES's TRNG is too slow to call for every random sector.
+static inline uint32_t next_random(void) {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static inline void put32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void record(int index, enum diag_test test, uint8_t card, enum diag_result result, struct bench *b) {
+	uint8_t *p = results + PAGE_HEADER + index * DIAG_RECORD_SIZE;
+	p[0] = test;
+	p[1] = card;
+	p[2] = result;
+	p[3] = 0;
+	put32(p + 4, b->bytes);
+	put32(p + 8, b->ops);
+	put32(p + 12, (uint32_t)(b->cycles / TRACE_CPU_MHZ));
+	if (result == DIAG_FAILED) results[1] = DIAG_STATUS_FAILED;
+}
+
+static enum diag_result seq_transfer(bool card, bool write, uint32_t start, uint32_t count, struct bench *b) {
+	for(uint32_t done = 0; done < count; done += DIAG_CHUNK_SECTORS) {
+		uint16_t n = MIN(DIAG_CHUNK_SECTORS, count - done);
+		wdt_feed(&WDT_0);
+		uint32_t t = DWT->CYCCNT;
+		bool ok = write?writePhysicalBlocks(card, start + done, staging, n):readPhysicalBlocks(card, start + done, staging, n);
+		b->cycles += DWT->CYCCNT - t;
+		if (!ok) return DIAG_FAILED;
+		b->bytes += n * SECTOR_SIZE;
+		b->ops++;
+	}
+	return DIAG_OK;
+}
+
+static enum diag_result random_transfer(bool card, bool write, uint32_t start, uint32_t span, uint32_t count, struct bench *b) {
+	for(uint32_t i = 0; i < count; i++) {
+		uint32_t sector = start + (uint32_t)(((uint64_t)next_random() * span) >> 32);
+		wdt_feed(&WDT_0);
+		uint32_t t = DWT->CYCCNT;
+		bool ok = write?writePhysicalBlock(card, sector, staging):readPhysicalBlock(card, sector, staging);
+		b->cycles += DWT->CYCCNT - t;
+		if (!ok) return DIAG_FAILED;
+		b->bytes += SECTOR_SIZE;
+		b->ops++;
+	}
+	return DIAG_OK;
+}
+
+static void run_card_tests(bool card, bool writes) {
+	struct bench b;
+	uint32_t random_count = MAX(sectors / DIAG_RANDOM_RATIO, 1);
+	uint32_t span = (card_size[card] > 0xffffffffULL)?0xffffffffUL:(uint32_t)card_size[card];
+	int base = card * 4;
+
+	memset(&b, 0, sizeof(b));
+	record(base + DIAG_SEQ_READ, DIAG_SEQ_READ, card, seq_transfer(card, false, 0, sectors, &b), &b);
+	memset(&b, 0, sizeof(b));
+	record(base + DIAG_RANDOM_READ, DIAG_RANDOM_READ, card, random_transfer(card, false, 0, span, random_count, &b), &b);
+
+	memset(&b, 0, sizeof(b));
+	if (!writes) {
+		record(base + DIAG_SEQ_WRITE, DIAG_SEQ_WRITE, card, DIAG_SKIPPED, &b);
+		record(base + DIAG_RANDOM_WRITE, DIAG_RANDOM_WRITE, card, DIAG_SKIPPED, &b);
+		return;
+	}
+	// What gets written is whatever the reads left - ciphertext from the card.
+	record(base + DIAG_SEQ_WRITE, DIAG_SEQ_WRITE, card, seq_transfer(card, true, scratch_start, MIN(sectors, scratch_sectors), &b), &b);
+	memset(&b, 0, sizeof(b));
+	record(base + DIAG_RANDOM_WRITE, DIAG_RANDOM_WRITE, card, random_transfer(card, true, scratch_start, scratch_sectors, random_count, &b), &b);
+}
+
+static void run_xex_test(void) {
+	struct bench b;
+	uint8_t nonce[BLOCKSIZE];
+	memset(&b, 0, sizeof(b));
+	memset(nonce, 0, sizeof(nonce));
+	// Whatever key is loaded will do (even the blank one) - it's the speed we're after.
+	for(uint32_t i = 0; i < sectors; i++) {
+		if ((i % DIAG_CHUNK_SECTORS) == 0) wdt_feed(&WDT_0);
+		put32(nonce + 12, i);
+		uint8_t *block = staging + (i % DIAG_CHUNK_SECTORS) * SECTOR_SIZE;
+		uint32_t t = DWT->CYCCNT;
+		init_xex(nonce, sizeof(nonce), AES_ENCRYPT);
+		for(uint32_t j = 0; j < SECTOR_SIZE; j += BLOCKSIZE)
+			process_xex_block(block + j);
+		b.cycles += DWT->CYCCNT - t;
+		b.bytes += SECTOR_SIZE;
+		b.ops++;
+	}
+	record(2 * 4, DIAG_XEX, 0xff, DIAG_OK, &b);
+}
+
+static void run_volume_test(bool mounted) {
+	struct bench b;
+	memset(&b, 0, sizeof(b));
+	// There's no block size to speak of without a volume.
+	if (!mounted) {
+		record(2 * 4 + 1, DIAG_VOLUME_READ, 0xff, DIAG_SKIPPED, &b);
+		return;
+	}
+	uint32_t count = MAX((sectors * SECTOR_SIZE) / volume_block_size, 1);
+	if (volume_size < count) {
+		record(2 * 4 + 1, DIAG_VOLUME_READ, 0xff, DIAG_SKIPPED, &b);
+		return;
+	}
+	// Start somewhere random, so it's mostly cache misses.
+	uint64_t start = (((uint64_t)next_random() << 32) | next_random()) % (volume_size - count + 1);
+	enum diag_result result = DIAG_OK;
+	for(uint32_t i = 0; i < count; i++) {
+		if ((i % DIAG_CHUNK_SECTORS) == 0) wdt_feed(&WDT_0);
+		uint32_t t = DWT->CYCCNT;
+		bool ok = readVolumeBlock(start + i, staging);
+		b.cycles += DWT->CYCCNT - t;
+		if (!ok) {
+			result = DIAG_FAILED;
+			break;
+		}
+		b.bytes += volume_block_size;
+		b.ops++;
+	}
+	record(2 * 4 + 1, DIAG_VOLUME_READ, 0xff, result, &b);
+}
+
+void diag_task(void) {
+	if (!pending) return;
+	bool mounted = get_state() == READY;
+	bool writes = mounted && (flags & DIAG_FLAG_WRITE) && scratch_sectors >= DIAG_CHUNK_SECTORS;
+
+	// The benchmarks are timed with the cycle counter. Nothing else may have
+	// wanted it on.
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->LAR = 0xC5ACCE55;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	rng = rand_sync_read32(&RAND_0) | 1; // xorshift can't start from 0
+	memset(staging, 0, STAGING_BYTES);
+	results[1] = DIAG_STATUS_DONE; // record() changes this if anything fails
+	run_card_tests(false, writes);
+	run_card_tests(true, writes);
+	run_xex_test();
+	run_volume_test(mounted);
+	// The volume read left plaintext here. Don't let the next write test put it on a card.
+	memset(staging, 0, STAGING_BYTES);
+
+	pending = false;
+	mscdf_ext_complete((results[1] == DIAG_STATUS_DONE)?ERR_NONE:ERR_DIAG_FAILED, NULL, 0);
+}
+
+// Set up the results page and hand the work off to the main loop.
+static int32_t begin(uint8_t new_flags, uint16_t new_sectors) {
+	flags = new_flags;
+	sectors = new_sectors?new_sectors:DIAG_DEFAULT_SECTORS;
+	memset(results, 0, sizeof(results));
+	results[0] = DIAG_PAGE_BENCH;
+	results[1] = DIAG_STATUS_RUNNING;
+	results[2] = (sizeof(results) - 4) >> 8;
+	results[3] = sizeof(results) - 4;
+	results[4] = flags;
+	results[6] = sectors >> 8;
+	results[7] = sectors;
+	pending = true;
+	sched_post(EV_DIAG);
+	return ERR_SUSPEND;
+}
+
+int32_t diag_cmd(const uint8_t *cdb, uint8_t **buf, uint32_t *len) {
+	switch(cdb[0]) {
+		case SPC_SEND_DIAGNOSTIC: {
+			uint32_t param_len = (cdb[3] << 8) | cdb[4];
+			if (pending) return ERR_BUSY;
+			if (cdb[1] & 0xe0) return ERR_INVALID_ARG; // no self-test codes
+			if (cdb[1] & 0x04) { // SELFTEST
+				if (param_len) return ERR_INVALID_ARG;
+				return begin(0, 0);
+			}
+			if (param_len == 0) return ERR_NONE; // nothing to do
+			if (!(cdb[1] & 0x10) || param_len != sizeof(params)) return ERR_INVALID_ARG;
+			// Go get the page. diag_data_out() takes it from there.
+			*buf = params;
+			*len = sizeof(params);
+			return ERR_NONE;
+		}
+		case SPC_RECEIVE_DIAGNOSTIC_RESULTS: {
+			uint32_t alloc = (cdb[3] << 8) | cdb[4];
+			// Without PCV, it's whatever the last SEND DIAGNOSTIC made.
+			uint8_t page = (cdb[1] & 0x01)?cdb[2]:DIAG_PAGE_BENCH;
+			if (page == DIAG_PAGE_SUPPORTED) {
+				*buf = (uint8_t*)supported_pages;
+				*len = MIN(alloc, sizeof(supported_pages));
+			} else if (page == DIAG_PAGE_BENCH) {
+				*buf = results;
+				*len = MIN(alloc, sizeof(results));
+			} else {
+				return ERR_INVALID_ARG;
+			}
+			return ERR_NONE;
+		}
+		default:
+			return ERR_UNSUPPORTED_OP;
+	}
+}
+
+int32_t diag_data_out(const uint8_t *cdb, uint32_t len) {
+	if (cdb[0] != SPC_SEND_DIAGNOSTIC) return ERR_UNSUPPORTED_OP;
+	if (len != sizeof(params) || params[0] != DIAG_PAGE_BENCH || ((params[2] << 8) | params[3]) != 4)
+		return ERR_INVALID_ARG;
+	return begin(params[4], (params[6] << 8) | params[7]);
+}
@@ -0,0 +1,104 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * An on-device benchmark, for telling whether a slow Orthrus is down to the
+ * USB host, the AES or one of the cards. SEND DIAGNOSTIC runs it and RECEIVE
+ * DIAGNOSTIC RESULTS fetches the numbers. No data crosses USB while it runs,
+ * and nothing else runs either - the host is waiting for the SEND DIAGNOSTIC
+ * to finish.
+ *
+ * SEND DIAGNOSTIC with SELFTEST set runs the read tests at the default size.
+ * With PF set instead, the parameter list is a DIAG_PAGE_BENCH page:
+ *
+ * 0: DIAG_PAGE_BENCH
+ * 1: reserved
+ * 2-3: page length (4)
+ * 4: flags - DIAG_FLAG_WRITE adds the write tests
+ * 5: reserved
+ * 6-7: sectors per test (big-endian), 0 for the default
+ *
+ * Writes only ever go to the scratch space at the end of each card (see
+ * Crypto.h), so they need a mounted volume that has some.
+ *
+ * The results page (DIAG_PAGE_BENCH again) is the same header, with the
+ * status in byte 1 and the size actually used in 6-7, followed by
+ * DIAG_RESULTS records of:
+ *
+ * 0: test (enum diag_test)
+ * 1: physical card, or 0xff if it's not a card test
+ * 2: result (enum diag_result)
+ * 3: reserved
+ * 4-7: bytes moved
+ * 8-11: operations (card commands, or volume blocks)
+ * 12-15: microseconds
+ *
+ * host/orthrusctl bench is the other end of this.
+ */
+
+#ifndef DIAG_H_
+#define DIAG_H_
+
+#define DIAG_PAGE_SUPPORTED (0x00)
+#define DIAG_PAGE_BENCH (0x80)
+
+#define DIAG_FLAG_WRITE (0x01)
+
+// 1 MB
+#define DIAG_DEFAULT_SECTORS (2048)
+// The sequential tests move this many sectors per command.
+#define DIAG_CHUNK_SECTORS (32)
+// The random tests do one single-sector command for every this many sectors.
+#define DIAG_RANDOM_RATIO (16)
+
+enum diag_test {
+	DIAG_SEQ_READ, // multi-block reads, straight through
+	DIAG_RANDOM_READ, // single-sector reads anywhere on the card
+	DIAG_SEQ_WRITE, // multi-block writes to the scratch space
+	DIAG_RANDOM_WRITE, // single-sector writes in the scratch space
+	DIAG_XEX, // tweak setup and XEX over sector sized blocks, no card I/O
+	DIAG_VOLUME_READ, // readVolumeBlock() - cards, AES and cache together
+};
+
+enum diag_result {
+	DIAG_OK,
+	DIAG_FAILED,
+	DIAG_SKIPPED, // not asked for, or there's no volume
+};
+
+// The four card tests for each card, then XEX and the volume read.
+#define DIAG_RESULTS (4 * 2 + 2)
+#define DIAG_RECORD_SIZE (16)
+
+// results page status
+#define DIAG_STATUS_NONE (0) // never run
+#define DIAG_STATUS_DONE (1)
+#define DIAG_STATUS_FAILED (2) // at least one test failed
+#define DIAG_STATUS_RUNNING (3)
+
+// The MSCDF_CB_EXT_CMD and MSCDF_CB_EXT_DATA_OUT handling for SEND DIAGNOSTIC
+// and RECEIVE DIAGNOSTIC RESULTS. diag_cmd() returns ERR_UNSUPPORTED_OP for
+// anything else.
+int32_t diag_cmd(const uint8_t *cdb, uint8_t **buf, uint32_t *len);
+int32_t diag_data_out(const uint8_t *cdb, uint32_t len);
+
+// The EV_DIAG task. It runs the benchmark and completes the SEND DIAGNOSTIC.
+void diag_task(void);
+
+#endif /* DIAG_H_ */
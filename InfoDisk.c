@@ -0,0 +1,358 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atmel_start.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <MCI.h>
+#include <Crypto.h>
+#include <Cache.h>
+#include <Sched.h>
+#include <Profile.h>
+#include <Trace.h>
+#include <Stats.h>
+#include <Settings.h>
+#include <Vendor.h>
+#include <usb_start.h>
+#include <InfoDisk.h>
+
+#ifdef INFO_DISK
+
+extern volatile uint32_t millis; // from main.
+
+// The layout: boot sector, two FATs, one sector of root directory and then
+// a fixed run of clusters (one sector each) for each file.
+#define FAT_SECTORS INFO_FAT_SECTORS
+#define FAT1_START (1)
+#define FAT2_START (FAT1_START + FAT_SECTORS)
+#define ROOT_START (FAT2_START + FAT_SECTORS)
+#define ROOT_ENTRIES (INFO_SECTOR_SIZE / 32)
+#define DATA_START (ROOT_START + 1)
+
+#define FILE_SECTORS INFO_FILE_SECTORS
+#define FILE_MAX (FILE_SECTORS * INFO_SECTOR_SIZE)
+
+// 2017-01-01 00:00 - there's no clock to do any better.
+#define FAT_DATE ((37 << 9) | (1 << 5) | 1)
+
+enum info_file { F_README, F_STATS, F_LATENCY, F_CARDS, F_BUILD, INFO_FILES };
+_Static_assert(INFO_FILES <= INFO_MAX_FILES, "INFO_MAX_FILES is out of date");
+
+static const char file_names[INFO_FILES][11] = {
+	"README  TXT", "STATS   TXT", "LATENCY TXT", "CARDS   TXT", "BUILD   TXT"
+};
+
+static char files[INFO_MAX_FILES][FILE_MAX];
+static uint32_t file_len[INFO_FILES];
+static uint8_t fat[FAT_SECTORS * INFO_SECTOR_SIZE];
+static bool rendered;
+
+// The file being rendered.
+static enum info_file cur;
+
+// Append to the current file, turning \n into \r\n so Notepad copes. Anything
+// past FILE_MAX is lost.
+static void say(const char *fmt, ...) {
+	char line[128];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	for(char *p = line; *p != 0; p++) {
+		if (*p == '\n' && file_len[cur] < FILE_MAX) files[cur][file_len[cur]++] = '\r';
+		if (file_len[cur] < FILE_MAX) files[cur][file_len[cur]++] = *p;
+	}
+}
+
+// newlib-nano's printf doesn't do 64 bits.
+static void say_u64(const char *label, uint64_t v) {
+	if (v >= 1000000000ULL)
+		say("%s%lu%09lu\n", label, (unsigned long)(v / 1000000000ULL), (unsigned long)(v % 1000000000ULL));
+	else
+		say("%s%lu\n", label, (unsigned long)v);
+}
+
+#if defined(PROFILE) || defined(STATS_TIMING)
+static unsigned long cycles_to_us(uint64_t cycles) {
+	return (unsigned long)(cycles / TRACE_CPU_MHZ);
+}
+#endif
+
+static unsigned long per_mille(uint32_t part, uint32_t whole) {
+	return whole?(unsigned long)(((uint64_t)part * 1000) / whole):0;
+}
+
+#if defined(PROFILE) || defined(STATS_TIMING)
+// One line per non-empty power-of-two bucket (see Profile.h).
+static void say_histogram(const uint32_t *hist, int buckets, uint32_t max) {
+	for(int i = 0; i < buckets; i++) {
+		if (hist[i] == 0) continue;
+		say("  <= %10lu us  %10lu\n", cycles_to_us((i == 0)?0:((1ULL << i) - 1)), (unsigned long)hist[i]);
+	}
+	say("  max %10lu us\n", cycles_to_us(max));
+}
+#endif
+
+static void render_readme(void) {
+	say("Orthrus diagnostics\n\n");
+	say("These files are made up by the firmware from its own counters.\n");
+	say("There is no key material and none of the volume's data in them.\n\n");
+	say("They're a snapshot from when this disk was mounted. Eject it and\n");
+	say("open it again for fresh numbers.\n\n");
+	say("STATS.TXT    I/O, error, command and cache counters\n");
+	say("LATENCY.TXT  command service time histograms\n");
+	say("CARDS.TXT    what the cards said about themselves\n");
+	say("BUILD.TXT    how the firmware was built, and its settings\n");
+}
+
+static void render_stats(void) {
+	struct cache_stats c;
+	say("Up %lu s, counters zeroed %lu s ago\n", (unsigned long)(millis / 1000), (unsigned long)((millis - stats.reset_millis) / 1000));
+	say("Volume %s\n\n", (get_state() == READY)?"mounted":"not mounted");
+	for(int i = 0; i < 2; i++) {
+		struct card_stats *s = &(stats.card[i]);
+		say("Card %c\n", 'A' + i);
+		say_u64("  sectors read     ", s->sectors_read);
+		say_u64("  sectors written  ", s->sectors_written);
+		say("  errors           %lu\n", (unsigned long)s->errors);
+		say("  CRC errors       %lu\n", (unsigned long)s->crc_errors);
+		say("  selects          %lu\n\n", (unsigned long)s->selects);
+	}
+	say("Commands\n");
+	for(int i = 0; i < 256; i++) {
+		if (stats.opcodes[i]) say("  0x%02x  %lu\n", i, (unsigned long)stats.opcodes[i]);
+	}
+	say("\nService time (CBW to CSW)\n");
+#ifdef STATS_TIMING
+	say("  commands  %lu\n", (unsigned long)stats.service_count);
+	say("  average   %lu us\n", stats.service_count?cycles_to_us(stats.service_total / stats.service_count):0UL);
+	say("  50%%       %lu us\n", (unsigned long)stats_percentile(50));
+	say("  90%%       %lu us\n", (unsigned long)stats_percentile(90));
+	say("  99%%       %lu us\n", (unsigned long)stats_percentile(99));
+	say("  max       %lu us\n\n", cycles_to_us(stats.service_max));
+#else
+	say("  not kept - this firmware was built without STATS_TIMING\n\n");
+#endif
+	stats_cache_counts(&c);
+	say("Cache\n");
+	say("  hits               %lu\n", (unsigned long)c.hits);
+	say("  misses             %lu\n", (unsigned long)c.misses);
+	say("  hit rate           %lu.%lu%%\n", per_mille(c.hits, c.hits + c.misses) / 10, per_mille(c.hits, c.hits + c.misses) % 10);
+	say("  read-ahead used    %lu\n", (unsigned long)c.prefetch_hits);
+	say("  read-ahead wasted  %lu\n", (unsigned long)c.prefetch_wasted);
+	say("  cached dirty       %lu\n", (unsigned long)cache_dirty_count());
+}
+
+#ifdef PROFILE
+static const char * const stage_names[PROF_STAGES] = {
+	"card command", "card data", "XEX tweak", "XEX", "USB transfer", "event to task"
+};
+#endif
+
+static void render_latency(void) {
+	say("Command service time (CBW to CSW)\n");
+#ifdef STATS_TIMING
+	say_histogram(stats.service_hist, STATS_BUCKETS, stats.service_max);
+#else
+	say("This firmware was built without STATS_TIMING, so there are no service times.\n");
+#endif
+#ifdef PROFILE
+	for(int i = 0; i < PROF_STAGES; i++) {
+		say("\n%s\n", stage_names[i]);
+		say_histogram(profile_stats.hist[i], PROF_BUCKETS, profile_stats.max[i]);
+	}
+#else
+	say("\nThis firmware was built without PROFILE, so there are no per-stage times.\n");
+#endif
+}
+
+static void say_hex(const char *label, const uint8_t *buf, size_t len) {
+	for(size_t i = 0; i < len; i += 16) {
+		char line[16 * 2 + 1];
+		for(size_t j = 0; j < 16 && i + j < len; j++)
+			snprintf(line + j * 2, 3, "%02x", buf[i + j]);
+		say("  %-5s %s\n", (i == 0)?label:"", line);
+	}
+}
+
+// The speed class field is a code, not the class itself.
+static const uint8_t speed_classes[] = { 0, 2, 4, 6, 10 };
+
+static void render_cards(void) {
+	for(int i = 0; i < 2; i++) {
+		const uint8_t *cid = card_cid[i], *csd = card_csd[i], *ssr = card_ssr[i];
+		say("Card %c\n", 'A' + i);
+		if (card_size[i] == 0) {
+			say("  not seen since power up\n\n");
+			continue;
+		}
+		say("  manufacturer  0x%02x, OEM %c%c\n", cid[0], cid[1], cid[2]);
+		say("  product       %c%c%c%c%c rev %d.%d\n", cid[3], cid[4], cid[5], cid[6], cid[7], cid[8] >> 4, cid[8] & 0xf);
+		say("  serial        0x%02x%02x%02x%02x\n", cid[9], cid[10], cid[11], cid[12]);
+		say("  made          %d-%02d\n", 2000 + (((cid[13] & 0xf) << 4) | (cid[14] >> 4)), cid[14] & 0xf);
+		say("  CSD version   %d\n", (csd[0] >> 6) + 1);
+		say_u64("  sectors       ", card_size[i]);
+		say("  TRAN_SPEED    0x%02x\n", csd[3]);
+		say("  classes       0x%03x\n", (csd[4] << 4) | (csd[5] >> 4));
+		if (card_ssr_valid[i]) {
+			say("  speed class   %d\n", (ssr[8] < sizeof(speed_classes))?speed_classes[ssr[8]]:-1);
+			say("  UHS grade     %d\n", ssr[14] >> 4);
+			say("  video class   %d\n", ssr[15]);
+			say("  app class     %d\n", ssr[21] & 0xf);
+			say("  AU size code  %d\n", ssr[10] >> 4);
+		} else {
+			say("  no SD status\n");
+		}
+		say_hex("CID", cid, sizeof(card_cid[i]));
+		say_hex("CSD", csd, sizeof(card_csd[i]));
+		if (card_ssr_valid[i]) say_hex("SSR", ssr, sizeof(card_ssr[i]));
+		say("\n");
+	}
+}
+
+static void render_build(void) {
+	struct settings s;
+	say("Built %s %s\n", __DATE__, __TIME__);
+	say("Compiler %s\n", __VERSION__);
+	say("Vendor commands version %d\n", VENDOR_VERSION);
+	say("Options");
+#ifdef FORMAT_4KN
+	say(" FORMAT_4KN");
+#endif
+#ifdef WRITE_BACK_CACHE
+	say(" WRITE_BACK_CACHE");
+#endif
+#ifdef PROFILE
+	say(" PROFILE");
+#endif
+#ifdef TRACE
+	say(" TRACE");
+#endif
+#ifdef STATS_TIMING
+	say(" STATS_TIMING");
+#endif
+	say("\nCache %lu KB (%lu KB pinned)\n\n", (unsigned long)(CACHE_BYTES / 1024), (unsigned long)(CACHE_PIN_BYTES / 1024));
+	settings_get(&s);
+	say("Settings\n");
+	say("  card clock      %lu kHz\n", (unsigned long)(s.card_clock / 1000));
+	say("  read-ahead      %u blocks\n", s.prefetch_depth);
+	say("  write-back      %s\n", s.write_back?"on":"off");
+	say("  batch           %u sectors\n", s.batch_sectors);
+	say("  scheduling      %s\n", (s.sched_policy == SCHED_DISK_FIRST)?"disk-first":"rounds");
+}
+
+static void set_fat(uint32_t cluster, uint16_t value) {
+	uint8_t *p = fat + cluster + (cluster >> 1);
+	if (cluster & 1) {
+		p[0] = (p[0] & 0x0f) | (value << 4);
+		p[1] = value >> 4;
+	} else {
+		p[0] = value;
+		p[1] = (p[1] & 0xf0) | ((value >> 8) & 0x0f);
+	}
+}
+
+static uint16_t first_cluster(enum info_file f) {
+	return 2 + f * FILE_SECTORS;
+}
+
+static void render(void) {
+	static void (* const renderers[INFO_FILES])(void) = { render_readme, render_stats, render_latency, render_cards, render_build };
+	memset(files, 0, sizeof(files));
+	memset(fat, 0, sizeof(fat));
+	set_fat(0, 0xff8); // media descriptor
+	set_fat(1, 0xfff);
+	for(cur = 0; cur < INFO_FILES; cur++) {
+		file_len[cur] = 0;
+		renderers[cur]();
+		uint32_t clusters = (file_len[cur] + INFO_SECTOR_SIZE - 1) / INFO_SECTOR_SIZE;
+		for(uint32_t i = 0; i < clusters; i++)
+			set_fat(first_cluster(cur) + i, (i == clusters - 1)?0xfff:(first_cluster(cur) + i + 1));
+	}
+	rendered = true;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void boot_sector(uint8_t *buf) {
+	static const uint8_t jump[] = { 0xeb, 0x3c, 0x90 };
+	memcpy(buf, jump, sizeof(jump));
+	memcpy(buf + 3, "ORTHRUS ", 8);
+	put16(buf + 11, INFO_SECTOR_SIZE);
+	buf[13] = 1; // sectors per cluster
+	put16(buf + 14, 1); // reserved sectors
+	buf[16] = 2; // FATs
+	put16(buf + 17, ROOT_ENTRIES);
+	put16(buf + 19, INFO_DISK_SECTORS);
+	buf[21] = 0xf8; // fixed disk
+	put16(buf + 22, FAT_SECTORS);
+	put16(buf + 24, 32); // sectors per track
+	put16(buf + 26, 2); // heads
+	buf[36] = 0x80; // drive number
+	buf[38] = 0x29; // the next three fields are there
+	put32(buf + 39, 0x4f494e46UL); // volume serial
+	memcpy(buf + 43, "ORTHRUSINFO", 11);
+	memcpy(buf + 54, "FAT12   ", 8);
+	buf[510] = 0x55;
+	buf[511] = 0xaa;
+}
+
+static void dir_entry(uint8_t *p, const char *name, uint8_t attr, uint16_t cluster, uint32_t size) {
+	memcpy(p, name, 11);
+	p[11] = attr;
+	put16(p + 16, FAT_DATE); // created
+	put16(p + 18, FAT_DATE); // accessed
+	put16(p + 24, FAT_DATE); // modified
+	put16(p + 26, cluster);
+	put32(p + 28, size);
+}
+
+static void root_dir(uint8_t *buf) {
+	dir_entry(buf, "ORTHRUSINFO", 0x08, 0, 0); // volume label
+	for(int i = 0; i < INFO_FILES; i++)
+		dir_entry(buf + (i + 1) * 32, file_names[i], 0x01, file_len[i]?first_cluster(i):0, file_len[i]); // read-only
+}
+
+void info_disk_read(uint32_t sector, uint8_t *buf) {
+	// Whatever was in here before (likely a volume block) goes.
+	memset(buf, 0, INFO_SECTOR_SIZE);
+	if (sector == 0 || !rendered) render();
+
+	if (sector == 0) {
+		boot_sector(buf);
+	} else if (sector >= FAT1_START && sector < ROOT_START) {
+		memcpy(buf, fat + ((sector - FAT1_START) % FAT_SECTORS) * INFO_SECTOR_SIZE, INFO_SECTOR_SIZE);
+	} else if (sector == ROOT_START) {
+		root_dir(buf);
+	} else if (sector >= DATA_START) {
+		uint32_t file = (sector - DATA_START) / FILE_SECTORS;
+		uint32_t offset = ((sector - DATA_START) % FILE_SECTORS) * INFO_SECTOR_SIZE;
+		if (file < INFO_FILES) memcpy(buf, files[file] + offset, INFO_SECTOR_SIZE);
+	}
+}
+
+#endif
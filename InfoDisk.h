@@ -0,0 +1,68 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * A second, read-only LUN with a tiny FAT12 filesystem on it, made up on the
+ * fly. Its files are text renderings of the counters (Stats.h), the
+ * profiler histograms, what the cards said about themselves at init time
+ * and how the firmware was built - for when the host can open a file but
+ * can't run sg_logs or orthrusctl.
+ *
+ * Nothing in it comes from the cards or the AES at the time it's read, so
+ * there's no way for it to give up key material or volume data. It works
+ * whether there's a volume mounted or not.
+ *
+ * The files are rendered all at once whenever the boot sector is read (which
+ * is the first thing a host does when it mounts it), so the directory, the
+ * FAT and the file contents always agree. Eject and re-open it for fresh
+ * numbers.
+ */
+
+#ifndef INFO_DISK_H_
+#define INFO_DISK_H_
+
+//#define INFO_DISK
+
+// LUN 0 is the volume.
+#define INFO_LUN (1)
+
+#define INFO_SECTOR_SIZE (512)
+// 1 MB - any fewer than 4085 clusters makes it FAT12.
+#define INFO_DISK_SECTORS (2048)
+
+// The files are rendered into RAM, each into a fixed INFO_FILE_SECTORS
+// whether it uses them or not, and the FAT is kept there too.
+#define INFO_MAX_FILES (5)
+#define INFO_FILE_SECTORS (8)
+#define INFO_FAT_SECTORS (6) // 2048 12 bit entries
+#define INFO_DISK_RAM_BYTES ((INFO_MAX_FILES * INFO_FILE_SECTORS + INFO_FAT_SECTORS) * INFO_SECTOR_SIZE)
+
+// What a host will get for an INQUIRY on INFO_LUN.
+#define INFO_DISK_INQUIRY \
+	{ \
+		0x00, 0x80, 0x00, 0x01, 31, 0x00, 0x00, 0x00, \
+		'G', 'e', 'p', 'p', 'e', 't', 't', 'o', \
+		'O', 'r', 't', 'h', 'r', 'u', 's', ' ', 'I', 'n', 'f', 'o', ' ', ' ', ' ', ' ', \
+		'0', '0', '0', '1' \
+	}
+
+// Fill buf (INFO_SECTOR_SIZE bytes) with the given sector of the disk.
+void info_disk_read(uint32_t sector, uint8_t *buf);
+
+#endif /* INFO_DISK_H_ */
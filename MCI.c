@@ -19,15 +19,17 @@
 
 #include <atmel_start.h>
 #include <MCI.h>
+#include <Profile.h>
+#include <Trace.h>
+#include <Stats.h>
 
 extern uint32_t millis; // from main.
 
 #define INIT_TIMEOUT (1000UL)
 
-// 50 MHz - It's not strictly speaking kosher to go above 25
+// MCI_CLOCK is 50 MHz - It's not strictly speaking kosher to go above 25
 // without asking first, but almost no cards nowadays don't
 // support it.
-#define MCI_CLOCK (50000000UL)
 #define INIT_MCI_CLOCK (400000UL)
 
 // 4 bits wide
@@ -36,16 +38,44 @@ extern uint32_t millis; // from main.
 
 #define MCI_SLOT (0)
 
-uint32_t volume_size;
-uint32_t card_size[2];
+// This ends a multi-block read or write. It's an R1b response.
+#define CMD12_STOP_TRANSMISSION (12 | MCI_RESP_PRESENT | MCI_RESP_BUSY | MCI_RESP_CRC)
+
+uint64_t card_size[2];
+uint8_t card_cid[2][16];
+uint8_t card_csd[2][16];
+COMPILER_ALIGNED(4)
+uint8_t card_ssr[2][64];
+bool card_ssr_valid[2];
 uint16_t __attribute__((section(".dtcm"))) rca[2];
+static bool __attribute__((section(".dtcm"))) selected_slot;
+uint32_t mci_clock = MCI_CLOCK;
+static bool cards_up;
+
+// Point the MCI bus at one card or the other.
+static inline void select_slot(bool card) {
+	if (card != selected_slot) {
+		TRACE_EVENT(TR_CARD_SELECT, card, 0);
+		stats.card[card].selects++;
+	}
+	selected_slot = card;
+	gpio_set_pin_level(AB_SELECT, card);
+}
+
+// ACMD13 - SD_STATUS. The card has to be selected, and in 4 bit mode.
+static bool read_ssr(bool card) {
+	if (!mci_sync_send_cmd(&MCI_0, 55 | MCI_RESP_PRESENT | MCI_RESP_CRC, rca[card] << 16)) return false;
+	if (!mci_sync_adtc_start(&MCI_0, 13 | MCI_RESP_PRESENT | MCI_RESP_CRC | MCI_CMD_SINGLE_BLOCK, 0, sizeof(card_ssr[card]), 1, true)) return false;
+	if (!mci_sync_start_read_blocks(&MCI_0, card_ssr[card], 1)) return false;
+	return mci_sync_wait_end_of_read_blocks(&MCI_0);
+}
 
 // This initializes a single card. It'll be called twice, with the AB select line one way
 // then the other. This method assumes the cards have JUST been powered up.
 static bool do_card_init(bool card) {
 	uint32_t resp;
 	
-	gpio_set_pin_level(AB_SELECT, card); // Select the card
+	select_slot(card); // Select the card
 
 	if (mci_sync_select_device(&MCI_0, MCI_SLOT, INIT_MCI_CLOCK, INIT_MCI_BUS_WIDTH, false) != ERR_NONE) goto error;
 
@@ -77,7 +107,7 @@ static bool do_card_init(bool card) {
 
 	uint8_t resp_buf[16];
 	if (!mci_sync_send_cmd(&MCI_0, 2 | MCI_RESP_PRESENT | MCI_RESP_136, 0)) goto error;
-	mci_sync_get_response_128(&MCI_0, resp_buf); // What do we do with this?
+	mci_sync_get_response_128(&MCI_0, card_cid[card]);
 	
 	if (!mci_sync_send_cmd(&MCI_0, 3 | MCI_RESP_PRESENT | MCI_RESP_CRC, 0)) goto error;
 	resp = mci_sync_get_response(&MCI_0);
@@ -85,10 +115,11 @@ static bool do_card_init(bool card) {
 	
 	if (!mci_sync_send_cmd(&MCI_0, 9 | MCI_RESP_PRESENT | MCI_RESP_136 | MCI_RESP_CRC, rca[card] << 16)) goto error;
 	mci_sync_get_response_128(&MCI_0, resp_buf);
+	memcpy(card_csd[card], resp_buf, sizeof(card_csd[card]));
 	
-	card_size[card] = ((uint32_t)(resp_buf[7] & 0x3f)) << 16; // lop off the reserved bytes
-	card_size[card] |= ((uint32_t)resp_buf[8]) << 8;
-	card_size[card] |= ((uint32_t)resp_buf[9]) << 0;
+	card_size[card] = ((uint64_t)(resp_buf[7] & 0x3f)) << 16; // lop off the reserved bytes
+	card_size[card] |= ((uint64_t)resp_buf[8]) << 8;
+	card_size[card] |= ((uint64_t)resp_buf[9]) << 0;
 	card_size[card]++;
 	card_size[card] <<= 10;
 
@@ -107,7 +138,11 @@ static bool do_card_init(bool card) {
 	// Switch to high speed (50 MHz)
 	if (!mci_sync_send_cmd(&MCI_0, 6 | MCI_RESP_PRESENT | MCI_RESP_CRC, 0x80fffff1)) goto error;
 	// Leave us in high speed, 4 bit mode as a side effect.
-	if (mci_sync_select_device(&MCI_0, MCI_SLOT, MCI_CLOCK, MCI_BUS_WIDTH, true) != ERR_NONE) goto error;
+	if (mci_sync_select_device(&MCI_0, MCI_SLOT, mci_clock, MCI_BUS_WIDTH, true) != ERR_NONE) goto error;
+
+	// Not every card answers this properly, and we can live without it.
+	memset(card_ssr[card], 0, sizeof(card_ssr[card]));
+	card_ssr_valid[card] = read_ssr(card);
 
 	mci_sync_send_cmd(&MCI_0, 7, 0);
 	
@@ -129,10 +164,9 @@ bool init_cards() {
 	if (!do_card_init(true)) goto error; // card B
 	
 	// The last card init step left us in 4 bit mode as a side effect
-		
-	uint32_t block_count = (card_size[0] > card_size[1])?card_size[1]:card_size[0];
-	volume_size = (block_count - 1) << 1;
+	// The volume geometry depends on the volume format, so prepVolume() works that out.
 
+	cards_up = true;
 	return true;
 	
 error:
@@ -143,40 +177,105 @@ error:
 
 // Call this when a card is detected as removed. It will power down the slots.
 bool shutdown_cards() {
+	cards_up = false;
 	gpio_set_pin_level(CARD_EN, true); // disable the card bus
 	gpio_set_pin_level(CARD_PWR, true); // turn off the power
 	return true;
 }
 
-// These two methods read or write a block from the given physical card slot
-// slot A is false, slot "B" is true. buf points to a SECTOR_SIZE length buffer.
-// blocknum is the block number on that card - not the volume block
-bool readPhysicalBlock(bool card, uint32_t blocknum, uint8_t *buf) {
-	gpio_set_pin_level(AB_SELECT, card);
+void set_mci_clock(uint32_t hz) {
+	mci_clock = hz;
+	// Both cards are already in high speed mode. Running them slower than that is fine.
+	if (cards_up) mci_sync_select_device(&MCI_0, MCI_SLOT, mci_clock, MCI_BUS_WIDTH, true);
+}
+
+// Count a failed transfer. The driver has already looked at the status
+// register by the time it gives up, and a data CRC error clears when it's
+// read, so this only reliably catches response CRC errors.
+static void note_error(bool card) {
+	if (HSMCI->HSMCI_SR & (HSMCI_SR_RCRCE | HSMCI_SR_DCRCE))
+		stats.card[card].crc_errors++;
+}
+
+static bool readBlocks(bool card, uint32_t blocknum, uint8_t *buf, uint16_t count) {
+	PROFILE_START(t);
+	select_slot(card);
+	TRACE_EVENT(TR_CARD_READ_START, card, count);
 
 	if (!mci_sync_send_cmd(&MCI_0, 7 | MCI_RESP_PRESENT | MCI_RESP_BUSY | MCI_RESP_CRC, rca[card] << 16)) goto err;
 
-	if (!mci_sync_adtc_start(&MCI_0, 17 | MCI_RESP_PRESENT | MCI_RESP_CRC | MCI_CMD_SINGLE_BLOCK, blocknum, SECTOR_SIZE, 1, true)) goto err;
-	if (!mci_sync_start_read_blocks(&MCI_0, buf, 1)) goto err;
+	if (count == 1) {
+		if (!mci_sync_adtc_start(&MCI_0, 17 | MCI_RESP_PRESENT | MCI_RESP_CRC | MCI_CMD_SINGLE_BLOCK, blocknum, SECTOR_SIZE, 1, true)) goto err;
+	} else {
+		if (!mci_sync_adtc_start(&MCI_0, 18 | MCI_RESP_PRESENT | MCI_RESP_CRC | MCI_CMD_MULTI_BLOCK, blocknum, SECTOR_SIZE, count, true)) goto err;
+	}
+	PROFILE_LAP(PROF_CARD_CMD, t);
+	if (!mci_sync_start_read_blocks(&MCI_0, buf, count)) goto err;
 	if (!mci_sync_wait_end_of_read_blocks(&MCI_0)) goto err;
+	if (count != 1 && !mci_sync_adtc_stop(&MCI_0, CMD12_STOP_TRANSMISSION, 0)) goto err;
+	PROFILE_END(PROF_CARD_DATA, t);
 	
 	mci_sync_send_cmd(&MCI_0, 7, 0); // force de-select
+	TRACE_EVENT(TR_CARD_READ_END, card, 1);
 	return true;
 err:
+	TRACE_EVENT(TR_CARD_READ_END, card, 0);
 	return false;
 }
 
-bool writePhysicalBlock(bool card, uint32_t blocknum, uint8_t *buf) {
-	gpio_set_pin_level(AB_SELECT, card);
+static bool writeBlocks(bool card, uint32_t blocknum, uint8_t *buf, uint16_t count) {
+	PROFILE_START(t);
+	select_slot(card);
+	TRACE_EVENT(TR_CARD_WRITE_START, card, count);
 
 	if (!mci_sync_send_cmd(&MCI_0, 7 | MCI_RESP_PRESENT | MCI_RESP_BUSY | MCI_RESP_CRC, rca[card] << 16)) goto err;
 	
-	if (!mci_sync_adtc_start(&MCI_0, 24 | MCI_CMD_WRITE | MCI_RESP_PRESENT | MCI_RESP_CRC | MCI_CMD_SINGLE_BLOCK, blocknum, SECTOR_SIZE, 1, true)) goto err;
-	if (!mci_sync_start_write_blocks(&MCI_0, buf, 1)) goto err;
+	if (count == 1) {
+		if (!mci_sync_adtc_start(&MCI_0, 24 | MCI_CMD_WRITE | MCI_RESP_PRESENT | MCI_RESP_CRC | MCI_CMD_SINGLE_BLOCK, blocknum, SECTOR_SIZE, 1, true)) goto err;
+	} else {
+		if (!mci_sync_adtc_start(&MCI_0, 25 | MCI_CMD_WRITE | MCI_RESP_PRESENT | MCI_RESP_CRC | MCI_CMD_MULTI_BLOCK, blocknum, SECTOR_SIZE, count, true)) goto err;
+	}
+	PROFILE_LAP(PROF_CARD_CMD, t);
+	if (!mci_sync_start_write_blocks(&MCI_0, buf, count)) goto err;
 	if (!mci_sync_wait_end_of_write_blocks(&MCI_0)) goto err;
+	if (count != 1 && !mci_sync_adtc_stop(&MCI_0, CMD12_STOP_TRANSMISSION, 0)) goto err;
+	PROFILE_END(PROF_CARD_DATA, t);
 
 	mci_sync_send_cmd(&MCI_0, 7, 0); // force de-select
+	TRACE_EVENT(TR_CARD_WRITE_END, card, 1);
 	return true;
 err:
+	TRACE_EVENT(TR_CARD_WRITE_END, card, 0);
+	return false;
+}
+
+// These two methods read or write blocks from the given physical card slot
+// slot A is false, slot "B" is true. buf points to a count * SECTOR_SIZE length buffer.
+// blocknum is the block number on that card - not the volume block
+bool readPhysicalBlocks(bool card, uint32_t blocknum, uint8_t *buf, uint16_t count) {
+	if (readBlocks(card, blocknum, buf, count)) {
+		stats.card[card].sectors_read += count;
+		return true;
+	}
+	note_error(card);
+	stats.card[card].errors++;
+	return false;
+}
+
+bool writePhysicalBlocks(bool card, uint32_t blocknum, uint8_t *buf, uint16_t count) {
+	if (writeBlocks(card, blocknum, buf, count)) {
+		stats.card[card].sectors_written += count;
+		return true;
+	}
+	note_error(card);
+	stats.card[card].errors++;
 	return false;
 }
+
+bool readPhysicalBlock(bool card, uint32_t blocknum, uint8_t *buf) {
+	return readPhysicalBlocks(card, blocknum, buf, 1);
+}
+
+bool writePhysicalBlock(bool card, uint32_t blocknum, uint8_t *buf) {
+	return writePhysicalBlocks(card, blocknum, buf, 1);
+}
@@ -20,7 +20,17 @@
 // This is the size of a disk block in bytes.
 #define SECTOR_SIZE (512)
 
-extern uint32_t volume_size;
+// The size of each card in SECTOR_SIZE blocks. These are set by init_cards().
+// A maximal SDXC card is 2^32 blocks, which just overflows 32 bits.
+extern uint64_t card_size[2];
+
+// The CID and CSD registers as each card sent them (most significant byte
+// first), and its 64 byte SD Status, if it would give it up. These are also
+// set by init_cards() - they're just for show.
+extern uint8_t card_cid[2][16];
+extern uint8_t card_csd[2][16];
+extern uint8_t card_ssr[2][64];
+extern bool card_ssr_valid[2];
 
 // Call this when two cards are freshly inserted. It will power up the cards and try
 // to prepare each for I/O. The caller needs to initialize the crypto themselves if this
@@ -30,8 +40,20 @@ bool init_cards();
 // Call this when a card is detected as removed. It will power down the slots.
 bool shutdown_cards();
 
+// The card bus clock (in Hz) once the cards are set up - MCI_CLOCK unless it's
+// been turned down. Changing it takes effect right away if the cards are up.
+#define MCI_CLOCK (50000000UL)
+#define MIN_MCI_CLOCK (400000UL)
+extern uint32_t mci_clock;
+void set_mci_clock(uint32_t hz);
+
 // These two methods read or write a block from the given physical card slot
 // slot "A" is false, slot "B" is true. buf points to a SECTOR_SIZE length buffer.
 // blocknum is the block number on that card - not the volume block
 bool readPhysicalBlock(bool card, uint32_t blocknum, uint8_t *buf);
 bool writePhysicalBlock(bool card, uint32_t blocknum, uint8_t *buf);
+
+// These are the same, but transfer count contiguous blocks with a single
+// multi-block command. buf points to count * SECTOR_SIZE bytes.
+bool readPhysicalBlocks(bool card, uint32_t blocknum, uint8_t *buf, uint16_t count);
+bool writePhysicalBlocks(bool card, uint32_t blocknum, uint8_t *buf, uint16_t count);
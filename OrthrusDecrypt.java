@@ -52,10 +52,12 @@ public class OrthrusDecrypt {
 	private static final String CMAC_ALG_NAME = "AESCMAC";
 
 	private static class Keyblock {
-		public static final byte[] MAGIC;
+		public static final byte[] MAGIC, MAGIC_V02;
 		static {
 			try {
-				MAGIC = "OrthrusVolumeV02".getBytes("US-ASCII");
+				MAGIC = "OrthrusVolumeV03".getBytes("US-ASCII");
+				// V02 is the same format, but limited to 2^32 blocks.
+				MAGIC_V02 = "OrthrusVolumeV02".getBytes("US-ASCII");
 			}
 			catch(IOException ex) {
 				throw new RuntimeException("This should never be possible.");
@@ -68,6 +70,9 @@ public class OrthrusDecrypt {
 		 * 0x50-0x6f: Key data
 		 * 0x70-0x7f: Nonce
 		 * 0x80: Card mark - 0 for A, 1 for B
+		 * 0x81: Format flags (V03 only) - 0x01 for 4096 byte volume blocks
+		 * 0x82-0x85: Scratch sector count (V03 only) - sectors at the end of each card
+		 *            that aren't part of the volume
 		 */
 		public Keyblock(byte[] diskblock) {
 			if (diskblock.length != SECTORSIZE)
@@ -75,7 +80,8 @@ public class OrthrusDecrypt {
 			ByteBuffer buf = ByteBuffer.wrap(diskblock);
 			byte[] magic = new byte[MAGIC.length];
 			buf.get(magic);
-			if (!Arrays.equals(MAGIC, magic)) throw new IllegalArgumentException("Bad magic.");
+			boolean legacy = Arrays.equals(MAGIC_V02, magic);
+			if (!Arrays.equals(MAGIC, magic) && !legacy) throw new IllegalArgumentException("Bad magic.");
 			volid = new byte[0x40];
 			buf.get(volid);
 			keydata = new byte[0x20];
@@ -84,9 +90,18 @@ public class OrthrusDecrypt {
 			buf.get(nonce);
 			byte flag = buf.get();
 			cardA = flag == 0;
+			formatFlags = legacy?0:buf.get();
+			if ((formatFlags & ~FLAG_4KN) != 0) throw new IllegalArgumentException("Unknown format flags.");
+			scratchSectors = legacy?0:(buf.getInt() & 0xffffffffL);
 		}
+		private static final int FLAG_4KN = 0x01;
 		private byte[] volid, keydata, nonce;
 		private boolean cardA;
+		private int formatFlags;
+		private long scratchSectors;
+		// The size of a volume block. Each one is this many contiguous bytes on one card.
+		public int getVolumeBlockSize() { return ((formatFlags & FLAG_4KN) != 0)?(8 * SECTORSIZE):SECTORSIZE; }
+		public long getScratchSectors() { return scratchSectors; }
 		public byte[] getVolumeID() { return volid; }
 		public byte[] getKeyData() { return keydata; }
 		public byte[] getNonce() { return nonce; }
@@ -163,6 +178,23 @@ public class OrthrusDecrypt {
 				}
 				if (!Arrays.equals(keyblock1.getVolumeID(), keyblock2.getVolumeID()))
 					throw new IllegalArgumentException("Cards have different volume IDs.");
+				if (keyblock1.getVolumeBlockSize() != keyblock2.getVolumeBlockSize())
+					throw new IllegalArgumentException("Cards have different volume formats.");
+				int volumeBlockSize = keyblock1.getVolumeBlockSize();
+				if (keyblock1.getScratchSectors() != keyblock2.getScratchSectors())
+					throw new IllegalArgumentException("Cards have different scratch space.");
+				// The volume ends before the scratch space at the end of the smaller card. Devices
+				// don't have a length, so for those just go until one runs out.
+				long volumeBlocks = Long.MAX_VALUE;
+				if (card1.length() > 0 && card2.length() > 0) {
+					long cardSectors = Math.min(card1.length(), card2.length()) / SECTORSIZE;
+					volumeBlocks = (((cardSectors - keyblock1.getScratchSectors()) / (volumeBlockSize / SECTORSIZE)) - 1) * 2;
+				}
+				// The whole first volume block on each card is reserved for the keyblock.
+				for(int skip = SECTORSIZE; skip < volumeBlockSize; skip += SECTORSIZE) {
+					if (stream1.read(blockbuf) != blockbuf.length || stream2.read(blockbuf) != blockbuf.length)
+						throw new IllegalArgumentException("Cards too short.");
+				}
 
 				InputStream streamA, streamB;
 				Keyblock keyblockA, keyblockB;
@@ -231,9 +263,9 @@ public class OrthrusDecrypt {
 				tweakCipher.init(Cipher.ENCRYPT_MODE, volumeKey);
 				Cipher dataCipher = Cipher.getInstance("AES/ECB/NoPadding");
 				dataCipher.init(Cipher.DECRYPT_MODE, volumeKey);
-				for(int block = 0; true; block++) {
+				for(long block = 0; block < volumeBlocks; block++) {
 					// Read the next block from the correct card.
-					byte[] ciphertext = new byte[SECTORSIZE];
+					byte[] ciphertext = new byte[volumeBlockSize];
 					boolean cardA = ((block & 1) == 0);
 					InputStream stream;
 					if (cardA)
@@ -245,15 +277,21 @@ public class OrthrusDecrypt {
 					// create the individual nonce for this block.
 					byte[] nonce = new byte[BLOCKSIZE];
 					System.arraycopy((cardA?keyblockB:keyblockA).getNonce(), 0, nonce, 0, keyblockA.getNonce().length); // pick the nonce from the other card
-					// Overwrite the last 4 bytes with the logical block number.
+					// XOR the top 32 bits of the logical block number into bytes 8-11
+					// (a no-op below 2^32 blocks, which is all a V02 volume can have)...
+					nonce[nonce.length - 8] ^= (byte)(block >> 56);
+					nonce[nonce.length - 7] ^= (byte)(block >> 48);
+					nonce[nonce.length - 6] ^= (byte)(block >> 40);
+					nonce[nonce.length - 5] ^= (byte)(block >> 32);
+					// ...and overwrite the last 4 bytes with the bottom 32 bits.
 					nonce[nonce.length - 4] = (byte)(block >> 24);
 					nonce[nonce.length - 3] = (byte)(block >> 16);
 					nonce[nonce.length - 2] = (byte)(block >> 8);
 					nonce[nonce.length - 1] = (byte)(block >> 0);
 					byte[] tweak = tweakCipher.doFinal(nonce);
 
-					byte[] plaintext = new byte[SECTORSIZE];
-					for(int pos = 0; pos < SECTORSIZE; pos += 16) {
+					byte[] plaintext = new byte[volumeBlockSize];
+					for(int pos = 0; pos < volumeBlockSize; pos += 16) {
 						byte[] subBlock = Arrays.copyOfRange(ciphertext, pos, pos + 16);
 						for(int i = 0; i < subBlock.length; i++) subBlock[i] ^= tweak[i];
 						subBlock = dataCipher.doFinal(subBlock);
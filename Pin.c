@@ -0,0 +1,215 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atmel_start.h>
+#include <MCI.h>
+#include <Crypto.h>
+#include <Pin.h>
+
+// What we're waiting to see, in the order we expect to see it.
+enum pin_states { WANT_MBR, WANT_GPT_HEADER, WANT_GPT_ENTRIES, WANT_BOOT, WANT_EXFAT_ROOT, PIN_DONE };
+
+#define NO_BLOCK (0xffffffffffffffffULL)
+
+struct pin_extent {
+	uint64_t first, last; // volume blocks, inclusive
+};
+
+static struct pin_extent __attribute__((section(".dtcm"))) extents[PIN_MAX_EXTENTS];
+static uint32_t __attribute__((section(".dtcm"))) extent_count;
+static uint32_t __attribute__((section(".dtcm"))) boot_extents; // how many came from the boot sector
+
+static enum pin_states __attribute__((section(".dtcm"))) state;
+// The block each stage looked at (or is waiting for), so we notice when the host rewrites it.
+static uint64_t __attribute__((section(".dtcm"))) stage_block[PIN_DONE];
+
+static uint32_t __attribute__((section(".dtcm"))) gpt_entry_size;
+static uint64_t __attribute__((section(".dtcm"))) exfat_heap; // bytes from the start of the volume
+static uint32_t __attribute__((section(".dtcm"))) exfat_cluster; // bytes
+
+// The Microsoft basic data partition type GUID, as it's laid out on disk.
+static const uint8_t basic_data_guid[16] = { 0xa2, 0xa0, 0xd0, 0xeb, 0xe5, 0xb9, 0x33, 0x44,
+	0x87, 0xc0, 0x68, 0xb6, 0xb7, 0x26, 0x99, 0xc7 };
+
+static inline uint16_t le16(uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t le32(uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t le64(uint8_t *p) {
+	return le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+// Go back to the given stage, forgetting everything we learned from it and after.
+static void pin_rewind(enum pin_states to) {
+	for(int i = to + 1; i < PIN_DONE; i++)
+		stage_block[i] = NO_BLOCK;
+	extent_count = (to == WANT_EXFAT_ROOT)?boot_extents:0;
+	state = to;
+}
+
+void pin_reset(void) {
+	memset(extents, 0, sizeof(extents));
+	boot_extents = 0;
+	stage_block[WANT_MBR] = 0;
+	pin_rewind(WANT_MBR);
+}
+
+static void advance(enum pin_states to, uint64_t blocknum) {
+	state = to;
+	stage_block[to] = blocknum;
+}
+
+static void add_extent(uint64_t offset, uint64_t length) {
+	if (length == 0 || extent_count >= PIN_MAX_EXTENTS) return;
+	extents[extent_count].first = offset / volume_block_size;
+	extents[extent_count].last = (offset + length - 1) / volume_block_size;
+	extent_count++;
+}
+
+static bool is_exfat(uint8_t *buf) {
+	return !memcmp(buf + 3, "EXFAT   ", 8);
+}
+
+static bool is_fat(uint8_t *buf) {
+	return !memcmp(buf + 54, "FAT", 3) || !memcmp(buf + 82, "FAT32", 5);
+}
+
+static void parse_boot(uint8_t *buf) {
+	uint64_t base = stage_block[WANT_BOOT] * volume_block_size;
+	state = PIN_DONE; // unless we find something better to do
+	if (le16(buf + 510) != 0xaa55) return;
+
+	if (is_exfat(buf)) {
+		if (buf[108] < 9 || buf[108] > 12 || buf[109] > 25 - buf[108]) return; // nonsense
+		uint32_t bps = 1UL << buf[108];
+		exfat_cluster = bps << buf[109];
+		exfat_heap = base + (uint64_t)le32(buf + 88) * bps;
+		add_extent(base + (uint64_t)le32(buf + 80) * bps, (uint64_t)le32(buf + 84) * bps); // the FAT
+		uint64_t root = exfat_heap + (uint64_t)(le32(buf + 96) - 2) * exfat_cluster;
+		add_extent(root, exfat_cluster); // the first cluster of the root directory
+		boot_extents = extent_count;
+		// The allocation bitmap is described in the root directory.
+		advance(WANT_EXFAT_ROOT, root / volume_block_size);
+		return;
+	}
+
+	if (!is_fat(buf)) return;
+	uint32_t bps = le16(buf + 11);
+	uint32_t spc = buf[13];
+	uint32_t fats = buf[16];
+	uint32_t root_entries = le16(buf + 17);
+	uint32_t fat_size = le16(buf + 22);
+	if (fat_size == 0) fat_size = le32(buf + 36); // FAT32
+	if (bps < 512 || bps > 4096 || (bps & (bps - 1)) || spc == 0 || fats == 0) return; // nonsense
+
+	uint64_t fat = base + (uint64_t)le16(buf + 14) * bps;
+	uint64_t data = fat + (uint64_t)fats * fat_size * bps;
+	add_extent(fat, (uint64_t)fat_size * bps); // the host only reads the first copy
+	if (root_entries != 0) {
+		add_extent(data, root_entries * 32); // FAT12/16 fixed root directory
+	} else {
+		add_extent(data + (uint64_t)(le32(buf + 44) - 2) * spc * bps, spc * bps); // FAT32 root cluster
+	}
+	boot_extents = extent_count;
+}
+
+static void parse(uint8_t *buf) {
+	switch(state) {
+		case WANT_MBR:
+			state = PIN_DONE;
+			if (le16(buf + 510) != 0xaa55) return;
+			if (is_exfat(buf) || is_fat(buf)) {
+				// No partition table - the filesystem starts right here.
+				advance(WANT_BOOT, 0);
+				parse_boot(buf);
+				return;
+			}
+			for(int i = 0; i < 4; i++) {
+				uint8_t *entry = buf + 446 + 16 * i;
+				if (entry[4] == 0xee) {
+					advance(WANT_GPT_HEADER, 1); // protective MBR
+					return;
+				} else if (entry[4] != 0) {
+					advance(WANT_BOOT, le32(entry + 8));
+					return;
+				}
+			}
+			return;
+		case WANT_GPT_HEADER:
+			state = PIN_DONE;
+			if (memcmp(buf, "EFI PART", 8)) return;
+			gpt_entry_size = le32(buf + 84);
+			if (gpt_entry_size < 128 || gpt_entry_size > volume_block_size) return;
+			advance(WANT_GPT_ENTRIES, le64(buf + 72));
+			return;
+		case WANT_GPT_ENTRIES:
+			state = PIN_DONE;
+			// Only the first block's worth. The partition we want is almost always first.
+			for(uint32_t i = 0; i + gpt_entry_size <= volume_block_size; i += gpt_entry_size) {
+				if (!memcmp(buf + i, basic_data_guid, sizeof(basic_data_guid))) {
+					advance(WANT_BOOT, le64(buf + i + 32));
+					return;
+				}
+			}
+			return;
+		case WANT_BOOT:
+			parse_boot(buf);
+			return;
+		case WANT_EXFAT_ROOT:
+			state = PIN_DONE;
+			for(uint32_t i = 0; i < volume_block_size; i += 32) {
+				if (buf[i] == 0) return; // end of directory
+				if (buf[i] == 0x81) {
+					// Allocation bitmap entry
+					add_extent(exfat_heap + (uint64_t)(le32(buf + i + 20) - 2) * exfat_cluster, le64(buf + i + 24));
+					return;
+				}
+			}
+			return;
+		case PIN_DONE:
+			return;
+	}
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) void pin_note_block(uint64_t blocknum, uint8_t *buf, bool write) {
+	if (write) {
+		// If the host rewrites something we got the layout from, start over from there.
+		for(int i = WANT_MBR; i < PIN_DONE; i++) {
+			if (stage_block[i] == blocknum && (i <= state)) {
+				pin_rewind(i);
+				parse(buf);
+				return;
+			}
+		}
+		return;
+	}
+	if (state != PIN_DONE && stage_block[state] == blocknum)
+		parse(buf);
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) bool pin_wanted(uint64_t blocknum) {
+	for(uint32_t i = 0; i < extent_count; i++) {
+		if (blocknum >= extents[i].first && blocknum <= extents[i].last) return true;
+	}
+	return false;
+}
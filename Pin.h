@@ -0,0 +1,43 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Filesystem-aware cache pinning. As the host reads the partition table and
+ * the boot sector of the first FAT or exFAT partition, we work out where the
+ * FAT, the exFAT allocation bitmap and the root directory are. Blocks in
+ * those ranges go in the pinned part of the block cache, where ordinary
+ * reads and writes can't evict them.
+ *
+ * We only ever look at blocks the host asks for anyway, so this costs
+ * no extra card I/O.
+ */
+
+// How many metadata ranges to keep track of.
+#define PIN_MAX_EXTENTS (4)
+
+// Forget everything and start over looking for the partition table.
+void pin_reset(void);
+
+// Let the pinning code see a (decrypted) block the host read or wrote. If it's
+// one of the blocks that describe the layout, the pinned ranges are worked
+// out again from it.
+void pin_note_block(uint64_t blocknum, uint8_t *buf, bool write);
+
+// Does this block belong in the pinned part of the cache?
+bool pin_wanted(uint64_t blocknum);
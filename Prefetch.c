@@ -0,0 +1,120 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atmel_start.h>
+#include <MCI.h>
+#include <Crypto.h>
+#include <Cache.h>
+#include <Prefetch.h>
+#include <Trace.h>
+
+// How many read-ahead blocks have to be accounted for before we
+// reconsider the depth.
+#define ADAPT_INTERVAL (32)
+
+// The USB interrupt leaves the latest READ command here.
+volatile static uint64_t note_addr;
+volatile static uint32_t note_blocks;
+volatile static bool note_pending;
+
+static uint64_t __attribute__((section(".dtcm"))) stream_next; // where a sequential read would start
+static bool __attribute__((section(".dtcm"))) streaming;
+static uint64_t __attribute__((section(".dtcm"))) fetch_next; // first block not yet read ahead
+static uint32_t __attribute__((section(".dtcm"))) depth;
+static uint32_t __attribute__((section(".dtcm"))) last_hits, last_wasted;
+uint32_t prefetch_max_depth = PREFETCH_MAX_DEPTH;
+
+void prefetch_reset(void) {
+	note_pending = false;
+	streaming = false;
+	stream_next = 0;
+	fetch_next = 0;
+	depth = PREFETCH_MIN_DEPTH;
+	last_hits = last_wasted = 0;
+}
+
+void prefetch_note_read(uint64_t addr, uint32_t nblocks) {
+	note_addr = addr;
+	note_blocks = nblocks;
+	note_pending = true;
+}
+
+// Look at how the read-ahead has been doing since last time. If the host is
+// reading nearly all of it, go further. If a lot of it is getting thrown away,
+// back off.
+static void adapt_depth(void) {
+	uint32_t hits = cache_stats.prefetch_hits - last_hits;
+	uint32_t wasted = cache_stats.prefetch_wasted - last_wasted;
+	uint32_t total = hits + wasted;
+	if (total < ADAPT_INTERVAL) return;
+	last_hits = cache_stats.prefetch_hits;
+	last_wasted = cache_stats.prefetch_wasted;
+
+	// Never let the window take up more than half the cache.
+	uint32_t max_depth = CACHE_BYTES / volume_block_size / 2;
+	if (max_depth > prefetch_max_depth) max_depth = prefetch_max_depth;
+
+	if (wasted * 8 < total) {
+		if (depth * 2 <= max_depth) depth *= 2;
+	} else if (wasted * 2 > total) {
+		if (depth / 2 >= PREFETCH_MIN_DEPTH) depth /= 2;
+	}
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) bool prefetch_task(uint64_t host_next) {
+	if (note_pending) {
+		CRITICAL_SECTION_ENTER();
+		uint64_t addr = note_addr;
+		uint32_t nblocks = note_blocks;
+		note_pending = false;
+		CRITICAL_SECTION_LEAVE();
+		if (addr == stream_next && addr != 0) {
+			streaming = true;
+		} else {
+			// Random access - drop the stream. Whatever we already fetched will
+			// age out of the cache on its own.
+			streaming = false;
+			fetch_next = 0;
+		}
+		stream_next = addr + nblocks;
+	}
+	if (!streaming || prefetch_max_depth == 0) return false;
+
+	adapt_depth();
+	if (depth > prefetch_max_depth) depth = prefetch_max_depth; // it was turned down
+
+	uint64_t start = fetch_next;
+	if (start < host_next) start = host_next;
+	start &= ~((uint64_t)1); // whole stripes only
+	uint64_t end = host_next + depth;
+	if (end > volume_size) end = volume_size;
+	if (start >= end) return false; // far enough ahead already
+	uint32_t count = (end - start > PREFETCH_STEP)?PREFETCH_STEP:(uint32_t)(end - start);
+	count = (count + 1) & ~1;
+	// Ask for more than one read's worth and the rest would never get read.
+	if (count > prefetchLimit()) count = prefetchLimit();
+
+	TRACE_EVENT(TR_PREFETCH_START, 0, count);
+	uint32_t added = prefetchVolume(start, count);
+	TRACE_EVENT(TR_PREFETCH_END, 0, added);
+	(void)added;
+	// Even if the cache filled up, don't keep banging on the same blocks.
+	fetch_next = start + count;
+	return true;
+}
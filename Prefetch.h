@@ -0,0 +1,50 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Sequential read-ahead. When the host reads a run of blocks and then asks
+ * for the ones right after it, we assume it's streaming and start pulling
+ * the next few stripes into the block cache while the card would otherwise
+ * sit idle. How far ahead we go depends on how much of it the host actually
+ * ends up reading.
+ */
+
+// Read-ahead window limits, in volume blocks. These are always even so that
+// a window covers both cards.
+#define PREFETCH_MIN_DEPTH (8)
+#define PREFETCH_MAX_DEPTH (64)
+// The depth never goes past this. It's PREFETCH_MAX_DEPTH unless it's been
+// tuned, and 0 turns read-ahead off.
+extern uint32_t prefetch_max_depth;
+
+// The most blocks to fetch on each call to prefetch_task(). That's what the
+// USB side might end up waiting on.
+#define PREFETCH_STEP (8)
+
+// Tell the read-ahead engine about a new READ command. This is called from
+// the USB interrupt, so it doesn't do any work.
+void prefetch_note_read(uint64_t addr, uint32_t nblocks);
+
+// Do a bit of read-ahead if there's a stream going. host_next is the next
+// block the host is going to want. Call this from the main loop when the
+// card isn't otherwise needed. Returns true if there may be more to do.
+bool prefetch_task(uint64_t host_next);
+
+// Forget about any stream (the cache is going away).
+void prefetch_reset(void);
@@ -0,0 +1,83 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * A profiler for the hot paths, using the DWT cycle counter. Each stage gets
+ * a histogram of how many cycles it took, in power-of-two buckets - bucket n
+ * counts durations from 2^(n-1) up to 2^n - 1 cycles (bucket 0 is zero). At
+ * 300 MHz, bucket 32 is about 14 seconds, so nothing falls off the end.
+ *
+ * Recording is a couple of loads and stores, but it's still not free, so it
+ * all compiles away unless PROFILE is defined.
+ */
+
+//#define PROFILE
+
+enum profile_stage {
+	PROF_CARD_CMD, // selecting the card and sending the read/write command
+	PROF_CARD_DATA, // moving the data (and stopping a multi-block transfer)
+	PROF_TWEAK, // XEX tweak setup for a block
+	PROF_XEX, // running XEX over a block
+	PROF_USB, // a USB data transfer, from start to completion interrupt
+	PROF_LOOP, // from an event being posted to its task running
+	PROF_STAGES
+};
+
+#define PROF_BUCKETS (33)
+
+#ifdef PROFILE
+
+struct profile_stats {
+	uint32_t hist[PROF_STAGES][PROF_BUCKETS];
+	uint32_t max[PROF_STAGES];
+};
+
+extern struct profile_stats profile_stats;
+
+// Turn on the cycle counter and clear the histograms.
+void profile_init(void);
+void profile_reset(void);
+
+static inline uint32_t profile_cycles(void) {
+	return DWT->CYCCNT;
+}
+
+static inline void profile_record(enum profile_stage stage, uint32_t start) {
+	uint32_t cycles = profile_cycles() - start;
+	profile_stats.hist[stage][cycles?(32 - __builtin_clz(cycles)):0]++;
+	if (cycles > profile_stats.max[stage]) profile_stats.max[stage] = cycles;
+}
+
+// Start timing into a new local
+#define PROFILE_START(v) uint32_t v = profile_cycles()
+// Start timing into an existing variable
+#define PROFILE_MARK(v) ((v) = profile_cycles())
+// Record the time since v was marked
+#define PROFILE_END(stage, v) profile_record((stage), (v))
+// Record the time since v was marked and mark it again
+#define PROFILE_LAP(stage, v) do { profile_record((stage), (v)); (v) = profile_cycles(); } while(0)
+
+#else
+
+#define PROFILE_START(v) do { } while(0)
+#define PROFILE_MARK(v) do { } while(0)
+#define PROFILE_END(stage, v) do { } while(0)
+#define PROFILE_LAP(stage, v) do { } while(0)
+
+#endif
@@ -0,0 +1,136 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atmel_start.h>
+#include <MCI.h>
+#include <Crypto.h>
+#include <Cache.h>
+#include <Sched.h>
+#include <usb_start.h>
+#include <Raw.h>
+
+extern volatile uint32_t millis; // from main.
+
+enum raw_states { CLOSED, WAITING, OPEN };
+
+static volatile enum raw_states raw_state;
+static uint32_t wait_start;
+
+// The read the EV_RAW task is to do.
+static volatile bool pending;
+// Whether the EV_RAW task should clean up after a session.
+static volatile bool wipe;
+static bool read_card;
+static uint32_t read_sector;
+static uint16_t read_count;
+
+COMPILER_ALIGNED(4)
+static struct raw_info info;
+
+static void fill_info(void) {
+	info.card_sectors[0] = card_size[0];
+	info.card_sectors[1] = card_size[1];
+	info.max_sectors = RAW_MAX_SECTORS;
+	info.reserved = 0;
+}
+
+int32_t raw_open(uint8_t **buf, uint32_t *len) {
+	if (raw_state == WAITING || pending) return ERR_BUSY;
+	if (get_state() != READY) return ERR_NOT_FOUND;
+	if (raw_state == OPEN) {
+		// Nothing to wait for this time.
+		fill_info();
+		*buf = (uint8_t*)&info;
+		*len = sizeof(info);
+		return ERR_NONE;
+	}
+	wait_start = millis;
+	raw_state = WAITING;
+	return ERR_SUSPEND;
+}
+
+int32_t raw_close(void) {
+	if (raw_state == WAITING || pending) return ERR_BUSY;
+	raw_state = CLOSED;
+	// The main loop might be using staging right now. Let it get to this.
+	wipe = true;
+	sched_post(EV_RAW);
+	return ERR_NONE;
+}
+
+int32_t raw_read(uint64_t arg, uint32_t len) {
+	if (raw_state != OPEN) return ERR_DENIED;
+	if (pending) return ERR_BUSY;
+	if (get_state() != READY) return ERR_NOT_FOUND;
+	if ((arg >> 33) != 0 || len == 0 || (len % SECTOR_SIZE) != 0 || len > RAW_MAX_SECTORS * SECTOR_SIZE) return ERR_INVALID_ARG;
+	bool card = (arg >> 32) & 1;
+	uint32_t sector = (uint32_t)arg;
+	uint16_t count = len / SECTOR_SIZE;
+	if ((uint64_t)sector + count > card_size[card]) return ERR_BAD_ADDRESS;
+	read_card = card;
+	read_sector = sector;
+	read_count = count;
+	pending = true;
+	sched_post(EV_RAW);
+	return ERR_SUSPEND;
+}
+
+bool raw_button(void) {
+	if (raw_state != WAITING) return false;
+	raw_state = OPEN;
+	fill_info();
+	mscdf_ext_complete(ERR_NONE, (uint8_t*)&info, sizeof(info));
+	return true;
+}
+
+bool raw_waiting(void) {
+	return raw_state == WAITING;
+}
+
+void raw_tick(void) {
+	if (raw_state != WAITING || millis - wait_start < RAW_OPEN_TIMEOUT) return;
+	raw_state = CLOSED;
+	mscdf_ext_complete(ERR_DENIED, NULL, 0);
+}
+
+void raw_revoke(void) {
+	if (raw_state == WAITING) mscdf_ext_complete(ERR_NOT_FOUND, NULL, 0);
+	raw_state = CLOSED;
+	wipe = false;
+	// Sector 0 of either card is half the key.
+	memset(staging, 0, STAGING_BYTES);
+}
+
+void raw_task(void) {
+	if (wipe) {
+		wipe = false;
+		// Sector 0 of either card is half the key.
+		memset(staging, 0, STAGING_BYTES);
+	}
+	if (!pending) return;
+	// The host is after what's on the cards, so get the write-back cache there first.
+	bool ok = (cache_dirty_count() == 0) || flushVolume();
+	// That was the last use of staging until the host has the data. See disk_task().
+	if (ok) ok = readPhysicalBlocks(read_card, read_sector, staging, read_count);
+	pending = false;
+	if (ok)
+		mscdf_ext_complete(ERR_NONE, staging, read_count * SECTOR_SIZE);
+	else
+		mscdf_ext_complete(ERR_IO, NULL, 0);
+}
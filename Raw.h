@@ -0,0 +1,77 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Raw card reads for backups. The host gets each card's sectors exactly as
+ * they are - ciphertext, keyblock and all - with multi-block reads and no
+ * AES work, so a backup runs at card speed and never leaves the device
+ * decrypted. OrthrusDecrypt (or a pair of fresh cards) takes it from there.
+ *
+ * The keyblocks are the volume key, though, so an image of both cards is as
+ * good as the cards themselves. Reading them takes someone at the device:
+ * VENDOR_RAW_OPEN waits (up to RAW_OPEN_TIMEOUT) for a press of the button,
+ * and the session lasts until VENDOR_RAW_CLOSE or the cards come out.
+ *
+ * host/orthrusctl backup is the other end of this.
+ */
+
+#ifndef RAW_H_
+#define RAW_H_
+
+// How long VENDOR_RAW_OPEN waits for the button, in ms. Keep it well under
+// the host's command timeout.
+#define RAW_OPEN_TIMEOUT (20000UL)
+
+// The most sectors one VENDOR_RAW_READ can move. The read goes into the
+// volume code's staging buffer, so it's the same as a batch.
+#define RAW_MAX_SECTORS (MAX_BATCH_SECTORS)
+
+// What VENDOR_RAW_OPEN returns - little-endian, like the rest of the vendor
+// structures.
+struct raw_info {
+	uint64_t card_sectors[2]; // physical card A, then B
+	uint32_t max_sectors; // RAW_MAX_SECTORS
+	uint32_t reserved;
+};
+
+// The VENDOR_RAW_* handling, from the USB interrupt. raw_open() returns
+// ERR_SUSPEND while it waits for the button. The argument to a read is the
+// card (bit 32) and the starting sector (bits 0-31), and the data length is
+// the number of sectors to read times SECTOR_SIZE.
+int32_t raw_open(uint8_t **buf, uint32_t *len);
+int32_t raw_close(void);
+int32_t raw_read(uint64_t arg, uint32_t len);
+
+// The button was just pressed. Returns true if that was what raw_open() was
+// waiting for, in which case it shouldn't do anything else.
+bool raw_button(void);
+
+// True while raw_open() is waiting for the button.
+bool raw_waiting(void);
+
+// Call this from the tick task to give up on the button eventually.
+void raw_tick(void);
+
+// The cards are gone. So is any session.
+void raw_revoke(void);
+
+// The EV_RAW task.
+void raw_task(void);
+
+#endif /* RAW_H_ */
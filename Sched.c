@@ -0,0 +1,89 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atmel_start.h>
+#include <Sched.h>
+#include <Profile.h>
+
+static volatile uint32_t __attribute__((section(".dtcm"))) pending;
+static sched_task_t __attribute__((section(".dtcm"))) tasks[EV_COUNT];
+#ifdef PROFILE
+static uint32_t __attribute__((section(".dtcm"))) posted_at[EV_COUNT];
+#endif
+
+void sched_register(enum sched_event ev, sched_task_t task) {
+	tasks[ev] = task;
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) void sched_post(enum sched_event ev) {
+	// This can interrupt itself (or the swap below), so it has to be atomic.
+	uint32_t val;
+	do {
+		val = __LDREXW(&pending);
+	} while (__STREXW(val | (1UL << ev), &pending));
+#ifdef PROFILE
+	if (!(val & (1UL << ev))) PROFILE_MARK(posted_at[ev]); // time from the first post
+#endif
+}
+
+enum sched_policy sched_policy = SCHED_ROUNDS;
+
+// Take one event if it's pending.
+static inline bool take_event(enum sched_event ev) {
+	uint32_t val;
+	do {
+		val = __LDREXW(&pending);
+	} while (__STREXW(val & ~(1UL << ev), &pending));
+	return (val & (1UL << ev)) != 0;
+}
+
+// Take everything that's pending, leaving nothing behind.
+static inline uint32_t take_pending(void) {
+	uint32_t val;
+	do {
+		val = __LDREXW(&pending);
+	} while (__STREXW(0, &pending));
+	return val;
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) void sched_run(void) {
+	while(1) {
+		uint32_t round = take_pending();
+		if (round == 0) {
+			// With interrupts masked, anything that comes in between the check and
+			// the WFI still wakes us up - it just gets handled after we're awake.
+			__disable_irq();
+			if (pending == 0) __WFI();
+			__enable_irq();
+			continue;
+		}
+		for(int ev = 0; ev < EV_COUNT; ev++) {
+			if ((round & (1UL << ev)) && tasks[ev] != NULL) {
+				PROFILE_END(PROF_LOOP, posted_at[ev]);
+				tasks[ev]();
+			}
+			// The disk doesn't have to wait for the rest of the pass. Everything
+			// else still gets its turn, so this can't starve the watchdog.
+			if (sched_policy == SCHED_DISK_FIRST && ev != EV_DISK && tasks[EV_DISK] != NULL && take_event(EV_DISK)) {
+				PROFILE_END(PROF_LOOP, posted_at[EV_DISK]);
+				tasks[EV_DISK]();
+			}
+		}
+	}
+}
@@ -0,0 +1,60 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * A tiny cooperative scheduler. Interrupt handlers (and tasks) post events,
+ * and the main loop runs the task registered for each one. When nothing is
+ * pending, we sleep until the next interrupt.
+ *
+ * Each pass takes everything pending at that moment and runs it in priority
+ * order. Anything posted during the pass waits for the next one, so a busy
+ * high priority task can't starve the ones below it (the watchdog depends on
+ * that).
+ */
+
+// Highest priority first.
+enum sched_event {
+	EV_DISK, // USB transfer completions and new commands
+	EV_DIAG, // SEND DIAGNOSTIC wants the benchmark run
+	EV_SETTINGS, // new settings to put into effect
+	EV_RAW, // a raw card read for a backup
+	EV_CARDS, // a card detect switch changed
+	EV_BUTTON, // the button changed
+	EV_TICK, // the millisecond timer
+	EV_WATCHDOG, // time to prove we're still alive
+	EV_COUNT
+};
+
+typedef void (*sched_task_t)(void);
+
+enum sched_policy {
+	SCHED_ROUNDS, // each pass runs everything that was pending at its start, in order
+	SCHED_DISK_FIRST, // same, but a pending EV_DISK also runs between the other tasks
+	SCHED_POLICIES
+};
+
+extern enum sched_policy sched_policy;
+
+void sched_register(enum sched_event ev, sched_task_t task);
+
+// Safe to call from interrupt context.
+void sched_post(enum sched_event ev);
+
+// Dispatch events forever.
+void sched_run(void) __attribute__((noreturn));
@@ -0,0 +1,177 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atmel_start.h>
+#include <MCI.h>
+#include <Crypto.h>
+#include <Prefetch.h>
+#include <Sched.h>
+#include <usb_start.h>
+#include <Settings.h>
+
+// While the user signature is open, it shows up at the start of flash.
+#define USER_SIGNATURE ((volatile uint32_t *)0x00400000)
+#define USER_SIGNATURE_WORDS (512 / 4)
+
+// The most read-ahead that makes any sense (prefetch_task() won't use more
+// than half the cache anyway).
+#define MAX_PREFETCH_DEPTH_SETTING (256)
+
+// What the EV_SETTINGS task is to do.
+COMPILER_ALIGNED(4)
+static struct settings next;
+static volatile bool pending;
+static bool save_next;
+
+static uint32_t crc32(const uint8_t *buf, size_t len) {
+	uint32_t crc = 0xffffffffUL;
+	for(size_t i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for(int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1)?0xedb88320UL:0);
+	}
+	return ~crc;
+}
+
+static void defaults(struct settings *s) {
+	memset(s, 0, sizeof(*s));
+	s->magic = SETTINGS_MAGIC;
+	s->version = SETTINGS_VERSION;
+	s->size = sizeof(*s);
+	s->card_clock = MCI_CLOCK;
+	s->prefetch_depth = PREFETCH_MAX_DEPTH;
+#ifdef WRITE_BACK_CACHE
+	s->write_back = 1;
+#endif
+	s->batch_sectors = MAX_BATCH_SECTORS;
+	s->sched_policy = SCHED_ROUNDS;
+	s->check = crc32((uint8_t*)s, offsetof(struct settings, check));
+}
+
+static bool valid(const struct settings *s) {
+	if (s->magic != SETTINGS_MAGIC || s->version != SETTINGS_VERSION || s->size != sizeof(*s)) return false;
+	if (s->card_clock < MIN_MCI_CLOCK || s->card_clock > MCI_CLOCK) return false;
+	if (s->prefetch_depth != 0 && (s->prefetch_depth < PREFETCH_MIN_DEPTH || s->prefetch_depth > MAX_PREFETCH_DEPTH_SETTING)) return false;
+	if (s->write_back > 1) return false;
+	if (s->batch_sectors < 1 || s->batch_sectors > MAX_BATCH_SECTORS) return false;
+	if (s->sched_policy >= SCHED_POLICIES) return false;
+	return true;
+}
+
+// Returns false, having changed nothing, if the write-back cache can't be emptied.
+static bool apply(const struct settings *s) {
+	// Once it's off, the host will think writes go straight to the cards. Make it so,
+	// or leave it on - the blocks that didn't make it are still only in the cache.
+	if (write_cache_enabled && !s->write_back && !flushVolume()) return false;
+	prefetch_max_depth = s->prefetch_depth;
+	batch_sectors = s->batch_sectors;
+	sched_policy = s->sched_policy;
+	write_cache_enabled = s->write_back != 0;
+	if (s->card_clock != mci_clock) set_mci_clock(s->card_clock);
+	return true;
+}
+
+// The flash can't be read while the user signature is open or being written,
+// so these run from ITCM with interrupts off (the handlers are in flash) and
+// can't call anything that isn't.
+__attribute__((noinline)) __attribute__((section(".itcm"))) static void read_signature(struct settings *out) {
+	uint32_t *words = (uint32_t*)out;
+	__disable_irq();
+	EFC->EEFC_FCR = (EEFC_FCR_FKEY_PASSWD | EEFC_FCR_FCMD_STUS);
+	while ((EFC->EEFC_FSR & EEFC_FSR_FRDY) == EEFC_FSR_FRDY); // FRDY *clears* once it's readable
+	for(uint32_t i = 0; i < sizeof(*out) / 4; i++)
+		words[i] = USER_SIGNATURE[i];
+	EFC->EEFC_FCR = (EEFC_FCR_FKEY_PASSWD | EEFC_FCR_FCMD_SPUS);
+	while ((EFC->EEFC_FSR & EEFC_FSR_FRDY) != EEFC_FSR_FRDY);
+	__enable_irq();
+}
+
+// Erase the user signature, then write in (unless it's NULL).
+__attribute__((noinline)) __attribute__((section(".itcm"))) static bool write_signature(const struct settings *in) {
+	const uint32_t *words = (const uint32_t*)in;
+	uint32_t status;
+	__disable_irq();
+	EFC->EEFC_FCR = (EEFC_FCR_FKEY_PASSWD | EEFC_FCR_FCMD_EUS);
+	do {
+		status = EFC->EEFC_FSR; // reading it clears the error bits, so keep the last one
+	} while (!(status & EEFC_FSR_FRDY));
+	if (in != NULL && !(status & (EEFC_FSR_FCMDE | EEFC_FSR_FLOCKE))) {
+		// Fill the page latch (any flash address will do), then write it to the signature.
+		for(uint32_t i = 0; i < USER_SIGNATURE_WORDS; i++)
+			USER_SIGNATURE[i] = (i < sizeof(*in) / 4)?words[i]:0xffffffffUL;
+		__DSB();
+		EFC->EEFC_FCR = (EEFC_FCR_FKEY_PASSWD | EEFC_FCR_FCMD_WUS);
+		do {
+			status = EFC->EEFC_FSR;
+		} while (!(status & EEFC_FSR_FRDY));
+	}
+	__enable_irq();
+	return !(status & (EEFC_FSR_FCMDE | EEFC_FSR_FLOCKE));
+}
+
+void settings_init(void) {
+	struct settings saved;
+	read_signature(&saved);
+	// A blank signature is all ones, which won't pass.
+	if (valid(&saved) && saved.check == crc32((uint8_t*)&saved, offsetof(struct settings, check)))
+		apply(&saved);
+}
+
+void settings_get(struct settings *out) {
+	defaults(out);
+	out->card_clock = mci_clock;
+	out->prefetch_depth = prefetch_max_depth;
+	out->write_back = write_cache_enabled?1:0;
+	out->batch_sectors = batch_sectors;
+	out->sched_policy = sched_policy;
+	out->check = crc32((uint8_t*)out, offsetof(struct settings, check));
+}
+
+int32_t settings_set(const struct settings *in, bool save) {
+	if (pending) return ERR_BUSY;
+	if (!valid(in)) return ERR_INVALID_ARG;
+	memcpy(&next, in, sizeof(next));
+	next.check = crc32((uint8_t*)&next, offsetof(struct settings, check));
+	save_next = save;
+	pending = true;
+	sched_post(EV_SETTINGS);
+	return ERR_SUSPEND;
+}
+
+int32_t settings_defaults(bool save) {
+	if (pending) return ERR_BUSY;
+	defaults(&next);
+	save_next = save;
+	pending = true;
+	sched_post(EV_SETTINGS);
+	return ERR_SUSPEND;
+}
+
+void settings_task(void) {
+	if (!pending) return;
+	bool ok = apply(&next);
+	if (ok && save_next) {
+		// Saving the defaults just means forgetting what was saved.
+		struct settings def;
+		defaults(&def);
+		ok = write_signature(memcmp(&next, &def, sizeof(def))?&next:NULL);
+	}
+	pending = false;
+	mscdf_ext_complete(ok?ERR_NONE:ERR_IO, NULL, 0);
+}
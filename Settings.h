@@ -0,0 +1,67 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Performance knobs that can be changed without reflashing. The host reads
+ * and sets them with vendor commands (see Vendor.h), and they can be saved
+ * in the flash user signature, which survives a reset (and the security bit).
+ * At startup, saved settings replace the compiled-in defaults.
+ */
+
+#ifndef SETTINGS_H_
+#define SETTINGS_H_
+
+#define SETTINGS_MAGIC (0x5445534fUL) // "OSET"
+#define SETTINGS_VERSION (1)
+
+// This is exactly what the vendor commands move, and what's in flash - all
+// little-endian. If it changes, so does host/vendor.h
+struct settings {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size; // sizeof(struct settings)
+	uint32_t card_clock; // Hz - the most the card bus runs at
+	uint16_t prefetch_depth; // the most volume blocks to read ahead, 0 for none
+	uint8_t write_back; // 1 to cache writes
+	uint8_t batch_sectors; // the most sectors in one multi-block command
+	uint8_t sched_policy; // enum sched_policy
+	uint8_t reserved[3];
+	uint32_t check; // CRC-32 of everything above
+};
+
+// Load the saved settings, if there are any, and put them into effect.
+void settings_init(void);
+
+// What's in effect right now.
+void settings_get(struct settings *out);
+
+// Check a new set of settings and, if they're all sane, have the EV_SETTINGS
+// task put them into effect (and save them if save is set). Returns
+// ERR_SUSPEND if it's going to happen, which the task completes through
+// mscdf_ext_complete().
+int32_t settings_set(const struct settings *in, bool save);
+
+// The same, but back to the compiled-in defaults. If save is set, the saved
+// copy is erased.
+int32_t settings_defaults(bool save);
+
+// The EV_SETTINGS task.
+void settings_task(void);
+
+#endif /* SETTINGS_H_ */
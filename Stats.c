@@ -0,0 +1,179 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atmel_start.h>
+#include <MCI.h>
+#include <Cache.h>
+#include <Trace.h>
+#include <Stats.h>
+
+#define SPC_LOG_SELECT (0x4c)
+#define SPC_LOG_SENSE (0x4d)
+
+extern volatile uint32_t millis; // from main.
+
+struct stats __attribute__((section(".dtcm"))) stats;
+
+// cache_stats as of the last reset. The cache zeroes its own counters
+// whenever it's cleared, so the pages report the difference from this.
+static struct cache_stats cache_base;
+
+// Big enough for every opcode to have a count.
+COMPILER_ALIGNED(4)
+static uint8_t log_buf[4 + 256 * 8];
+
+static const uint8_t supported_pages[] = { LOG_PAGE_SUPPORTED, LOG_PAGE_CARDS, LOG_PAGE_OPCODES, LOG_PAGE_SERVICE, LOG_PAGE_CACHE };
+
+void stats_reset(void) {
+	memset(&stats, 0, sizeof(stats));
+	stats.reset_millis = millis;
+	cache_base = cache_stats;
+}
+
+void stats_init(void) {
+#ifdef STATS_TIMING
+	// It may already be on for the profiler or the trace.
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->LAR = 0xC5ACCE55;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+	stats_reset();
+}
+
+static inline uint32_t since(uint32_t now, uint32_t base) {
+	return (now >= base)?(now - base):now; // the cache was cleared in between
+}
+
+static inline uint32_t cycles_to_us(uint64_t cycles) {
+	return (uint32_t)(cycles / TRACE_CPU_MHZ);
+}
+
+// Append a counter parameter (big-endian, like everything in SCSI) and return the new end.
+static uint8_t *put_param(uint8_t *p, uint16_t code, uint64_t value, uint8_t size) {
+	*p++ = code >> 8;
+	*p++ = code;
+	*p++ = 0x00; // a plain counter
+	*p++ = size;
+	for(int i = size - 1; i >= 0; i--)
+		*p++ = (uint8_t)(value >> (i * 8));
+	return p;
+}
+
+uint32_t stats_percentile(uint32_t pct) {
+	if (stats.service_count == 0) return 0;
+	uint64_t want = ((uint64_t)stats.service_count * pct + 99) / 100;
+	uint64_t seen = 0;
+	for(int i = 0; i < STATS_BUCKETS; i++) {
+		seen += stats.service_hist[i];
+		if (seen >= want) {
+			uint64_t top = (i == 0)?0:((1ULL << i) - 1);
+			if (top > stats.service_max) top = stats.service_max;
+			return cycles_to_us(top);
+		}
+	}
+	return cycles_to_us(stats.service_max);
+}
+
+static uint32_t per_mille(uint32_t part, uint32_t whole) {
+	return whole?(uint32_t)(((uint64_t)part * 1000) / whole):0;
+}
+
+void stats_cache_counts(struct cache_stats *out) {
+	out->hits = since(cache_stats.hits, cache_base.hits);
+	out->misses = since(cache_stats.misses, cache_base.misses);
+	out->prefetch_hits = since(cache_stats.prefetch_hits, cache_base.prefetch_hits);
+	out->prefetch_wasted = since(cache_stats.prefetch_wasted, cache_base.prefetch_wasted);
+}
+
+// Fills log_buf with the given page and returns its length, or 0 if there's no such page.
+static uint32_t build_page(uint8_t page) {
+	uint8_t *p = log_buf + 4;
+	switch(page) {
+		case LOG_PAGE_SUPPORTED:
+			memcpy(p, supported_pages, sizeof(supported_pages));
+			p += sizeof(supported_pages);
+			break;
+		case LOG_PAGE_CARDS:
+			for(int i = 0; i < 2; i++) {
+				struct card_stats *c = &(stats.card[i]);
+				p = put_param(p, (i << 8) | 0, c->sectors_read, 8);
+				p = put_param(p, (i << 8) | 1, c->sectors_written, 8);
+				p = put_param(p, (i << 8) | 3, c->errors, 4);
+				p = put_param(p, (i << 8) | 4, c->crc_errors, 4);
+				p = put_param(p, (i << 8) | 5, c->selects, 4);
+			}
+			// so the host can work out throughput
+			p = put_param(p, 0x8000, millis - stats.reset_millis, 4);
+			break;
+		case LOG_PAGE_OPCODES:
+			for(int i = 0; i < 256; i++) {
+				if (stats.opcodes[i]) p = put_param(p, i, stats.opcodes[i], 4);
+			}
+			break;
+		case LOG_PAGE_SERVICE:
+			p = put_param(p, 0, stats.service_count, 4);
+			p = put_param(p, 1, stats.service_count?cycles_to_us(stats.service_total / stats.service_count):0, 4);
+			p = put_param(p, 2, stats_percentile(50), 4);
+			p = put_param(p, 3, stats_percentile(90), 4);
+			p = put_param(p, 4, stats_percentile(99), 4);
+			p = put_param(p, 5, cycles_to_us(stats.service_max), 4);
+			break;
+		case LOG_PAGE_CACHE: {
+			struct cache_stats c;
+			stats_cache_counts(&c);
+			p = put_param(p, 0, c.hits, 4);
+			p = put_param(p, 1, c.misses, 4);
+			p = put_param(p, 2, c.prefetch_hits, 4);
+			p = put_param(p, 3, c.prefetch_wasted, 4);
+			p = put_param(p, 4, per_mille(c.hits, c.hits + c.misses), 4);
+			p = put_param(p, 5, per_mille(c.prefetch_hits, c.prefetch_hits + c.prefetch_wasted), 4);
+			break;
+		}
+		default:
+			return 0;
+	}
+	uint32_t page_len = p - (log_buf + 4);
+	log_buf[0] = page;
+	log_buf[1] = 0; // no subpages
+	log_buf[2] = page_len >> 8;
+	log_buf[3] = page_len;
+	return page_len + 4;
+}
+
+int32_t stats_log_cmd(const uint8_t *cdb, uint8_t **buf, uint32_t *len) {
+	switch(cdb[0]) {
+		case SPC_LOG_SENSE: {
+			// Nothing is saved, and there are no subpages or parameter pointers.
+			if ((cdb[1] & 0x03) || cdb[3] || cdb[5] || cdb[6]) return ERR_INVALID_ARG;
+			uint32_t alloc = (cdb[7] << 8) | cdb[8];
+			uint32_t page_len = build_page(cdb[2] & 0x3f);
+			if (page_len == 0) return ERR_INVALID_ARG;
+			*buf = log_buf;
+			*len = (page_len < alloc)?page_len:alloc;
+			return ERR_NONE;
+		}
+		case SPC_LOG_SELECT:
+			// We don't take any parameters. PCR (parameter code reset) zeroes everything.
+			if ((cdb[1] & 0x01) || cdb[7] || cdb[8]) return ERR_INVALID_ARG;
+			if (cdb[1] & 0x02) stats_reset();
+			return ERR_NONE;
+		default:
+			return ERR_UNSUPPORTED_OP;
+	}
+}
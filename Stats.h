@@ -0,0 +1,103 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Running counters for keeping an eye on a device in the field. Unlike the
+ * profiler and the trace, these are always on - each one is an increment or
+ * two in the hot path. The host reads them as vendor LOG SENSE pages (so
+ * sg_logs works, as does orthrusctl stats), and LOG SELECT with PCR set
+ * zeroes them.
+ *
+ * The service times are the exception. They need the DWT cycle counter, and
+ * that means turning on the debug trace block, so they're only kept if
+ * STATS_TIMING is defined. Otherwise the service page is all zeroes.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+//#define STATS_TIMING
+
+// The vendor log pages. If these change, so does host/vendor.h
+#define LOG_PAGE_SUPPORTED (0x00)
+#define LOG_PAGE_CARDS (0x30) // per-card I/O, errors and selects
+#define LOG_PAGE_OPCODES (0x31) // command counts - the parameter code is the opcode
+#define LOG_PAGE_SERVICE (0x32) // CBW to CSW times
+#define LOG_PAGE_CACHE (0x33) // cache and read-ahead
+
+#define STATS_BUCKETS (33)
+
+struct card_stats {
+	uint64_t sectors_read;
+	uint64_t sectors_written;
+	uint32_t errors; // transfers that failed
+	uint32_t crc_errors; // failures with a command or data CRC error
+	uint32_t selects; // times the bus was switched over to this card
+};
+
+struct stats {
+	struct card_stats card[2];
+	uint32_t opcodes[256];
+	// service time histogram, in the same power-of-two cycle buckets as Profile.h
+	uint32_t service_hist[STATS_BUCKETS];
+	uint64_t service_total;
+	uint32_t service_count;
+	uint32_t service_max;
+	uint32_t service_start; // when the current command arrived
+	uint32_t reset_millis; // when the counters were last zeroed
+};
+
+extern struct stats stats;
+
+// Zero everything, and turn on the cycle counter for STATS_TIMING.
+void stats_init(void);
+void stats_reset(void);
+
+// A CBW arrived.
+static inline void stats_command(uint8_t opcode) {
+	stats.opcodes[opcode]++;
+#ifdef STATS_TIMING
+	stats.service_start = DWT->CYCCNT;
+#endif
+}
+
+// Its CSW is on the way.
+static inline void stats_status(void) {
+#ifdef STATS_TIMING
+	uint32_t cycles = DWT->CYCCNT - stats.service_start;
+	stats.service_hist[cycles?(32 - __builtin_clz(cycles)):0]++;
+	stats.service_total += cycles;
+	stats.service_count++;
+	if (cycles > stats.service_max) stats.service_max = cycles;
+#endif
+}
+
+// The smallest histogram bucket boundary (in microseconds) with at least pct
+// percent of the commands at or below it.
+uint32_t stats_percentile(uint32_t pct);
+
+// The cache counters since the last reset.
+struct cache_stats;
+void stats_cache_counts(struct cache_stats *out);
+
+// The MSCDF_CB_EXT_CMD handling for LOG SENSE and LOG SELECT. Returns
+// ERR_UNSUPPORTED_OP for anything else.
+int32_t stats_log_cmd(const uint8_t *cdb, uint8_t **buf, uint32_t *len);
+
+#endif /* STATS_H_ */
@@ -0,0 +1,43 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atmel_start.h>
+#include <Trace.h>
+
+#ifdef TRACE
+
+COMPILER_ALIGNED(4)
+struct trace_dump __attribute__((section(".dtcm"))) trace_dump;
+volatile bool trace_frozen;
+
+void trace_init(void) {
+	// The cycle counter is the clock. It may already be on for the profiler.
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->LAR = 0xC5ACCE55;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	memset(&trace_dump, 0, sizeof(trace_dump));
+	trace_dump.magic = TRACE_MAGIC;
+	trace_dump.version = TRACE_VERSION;
+	trace_dump.cpu_mhz = TRACE_CPU_MHZ;
+	trace_dump.count = TRACE_EVENTS;
+	trace_frozen = false;
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Event trace. Every interesting thing that happens on the way from a CBW to
+ * the CSW drops a timestamped 8 byte record into a ring in DTCM. The host
+ * can pull the whole ring out with a vendor command (see Vendor.h) and turn
+ * it into a timeline with host/orthrusctl.
+ *
+ * Recording is safe from any context - the ring index is claimed with
+ * LDREX/STREX, so an interrupt can't land on top of the record it interrupted.
+ * Like the profiler, it all compiles away unless TRACE is defined.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+//#define TRACE
+
+// This has to be a power of 2.
+#define TRACE_EVENTS (1024)
+
+// The core clock, so the host can turn cycle counts into time.
+#define TRACE_CPU_MHZ (300)
+
+#define TRACE_MAGIC (0x4352544fUL) // "OTRC"
+#define TRACE_VERSION (1)
+
+// If these change, so does host/trace.h
+enum trace_event {
+	TR_NONE, // an empty slot
+	TR_CBW, // aux: opcode, arg: low 16 bits of the tag
+	TR_CSW, // aux: status
+	TR_USB_START, // aux: 1 for IN (to the host), 0 for OUT
+	TR_USB_DONE,
+	TR_CARD_SELECT, // aux: physical card (the AB_SELECT pin changed)
+	TR_CARD_READ_START, // aux: physical card, arg: sector count
+	TR_CARD_READ_END, // aux: physical card, arg: 1 for success
+	TR_CARD_WRITE_START, // aux: physical card, arg: sector count
+	TR_CARD_WRITE_END, // aux: physical card, arg: 1 for success
+	TR_XEX_START, // arg: number of AES blocks
+	TR_XEX_END,
+	TR_FLUSH_START, // arg: dirty block count
+	TR_FLUSH_END, // arg: 1 for success
+	TR_PREFETCH_START, // arg: block count
+	TR_PREFETCH_END, // arg: blocks added
+	TR_EVENT_COUNT
+};
+
+struct trace_record {
+	uint32_t cycles;
+	uint8_t event;
+	uint8_t aux;
+	uint16_t arg;
+};
+
+// This is exactly what the dump command sends - all little-endian.
+struct trace_dump {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t cpu_mhz;
+	uint32_t count; // how many records follow
+	uint32_t next; // total records ever written - the oldest is at next % count once it wraps
+	struct trace_record records[TRACE_EVENTS];
+};
+
+#ifdef TRACE
+
+extern struct trace_dump trace_dump;
+extern volatile bool trace_frozen;
+
+void trace_init(void);
+
+static inline void trace(enum trace_event event, uint8_t aux, uint16_t arg) {
+	if (trace_frozen) return;
+	uint32_t idx;
+	do {
+		idx = __LDREXW(&trace_dump.next);
+	} while (__STREXW(idx + 1, &trace_dump.next));
+	struct trace_record *rec = &(trace_dump.records[idx & (TRACE_EVENTS - 1)]);
+	rec->cycles = DWT->CYCCNT;
+	rec->event = event;
+	rec->aux = aux;
+	rec->arg = arg;
+}
+
+#define TRACE_EVENT(event, aux, arg) trace((event), (aux), (arg))
+
+#else
+
+#define TRACE_EVENT(event, aux, arg) do { } while(0)
+
+#endif
+
+#endif
@@ -48,7 +48,24 @@ the contents of the two key blocks on the cards.
 // perform a multiply-by-two over GF(128).
 #define RB (0x87)
 
-uint8_t tweak[BLOCKSIZE], key[KEYSIZE], dec_key[KEYSIZE], mode;
+uint8_t key[KEYSIZE], dec_key[KEYSIZE], mode;
+// The tweak for the current block, and the one after it. The DMA pipeline
+// still needs the current one after it's started on the next.
+static uint8_t tweak_buf[2][BLOCKSIZE];
+static uint8_t *tweak = tweak_buf[0], *next_tweak = tweak_buf[1];
+
+#ifdef DMA_AES
+// The DMA channels. CH2 loads the tweak into AES.STATE. CH3 loads the key,
+// then the data, then takes the result back out. CH0 and CH1 are for the
+// card (see sd.c).
+#define DMA_TWEAK (DMA.CH2)
+#define DMA_KEY (DMA.CH3)
+#define DMA_DATA_IN (DMA.CH3)
+#define DMA_DATA_OUT (DMA.CH3)
+
+// Where the block being worked on came from and goes back to.
+static uint8_t *xex_data;
+#endif
 
 void init_aes(void) {
 	clearKeys();
@@ -68,8 +85,8 @@ void clearKeys(void) {
 // the decryption key from the encryption key
 // by processing a dummy block.
 void generateDecryptKey(void) {
-	// Encrypt mode
-	AES.CTRL &= ~(AES_DECRYPT_bm);
+	// Encrypt mode, with plain loads
+	AES.CTRL = 0;
 	// Note that this presumes BLOCKSIZE == KEYSIZE. Look for
 	// similar constructions throughout this file if you upgrade
 	// to, say, AES-256, with better hardware.
@@ -91,11 +108,11 @@ void generateDecryptKey(void) {
 /*
  * Do a single encryption.
  */
-static void encrypt_ECB(uint8_t *block) {
-	// encrypt mode
-	AES.CTRL &= ~(AES_DECRYPT_bm);
+static void encrypt_ECB_key(const uint8_t *k, uint8_t *block) {
+	// encrypt mode, with plain loads - no XOR or auto start left over from XEX
+	AES.CTRL = 0;
 	for(int i = 0; i < BLOCKSIZE; i++) {
-		AES.KEY = key[i];
+		AES.KEY = k[i];
 		AES.STATE = block[i];
 	}
 	// GO!
@@ -108,13 +125,17 @@ static void encrypt_ECB(uint8_t *block) {
 	}
 }
 
+static void encrypt_ECB(uint8_t *block) {
+	encrypt_ECB_key(key, block);
+}
+
 // mode_in is zero for encrypt, non-zero for decrypt
 void init_xex(uint8_t *nonce, size_t nonce_len, uint8_t mode_in) {
 	// Save the mode for later.
 	mode = mode_in;
 	// Clear it out
-	memset(tweak, 0, sizeof(tweak));
-	memcpy(tweak, nonce, MIN(nonce_len, sizeof(tweak)));
+	memset(tweak, 0, BLOCKSIZE);
+	memcpy(tweak, nonce, MIN(nonce_len, BLOCKSIZE));
 	encrypt_ECB(tweak); // encrypt the tweak. We're now ready to go.
 }
 
@@ -139,6 +160,79 @@ static void galois_mult(uint8_t *block, size_t block_len) {
 		block[block_len - 1] ^= RB;
 }
 
+#ifdef DMA_AES
+
+// Move one BLOCKSIZE block with a DMA channel. One side of it is always an
+// AES register, and so is fixed.
+static void dma_block(DMA_CH_t *ch, const volatile void *src, uint8_t src_dir, volatile void *dest, uint8_t dest_dir) {
+	uint16_t src_addr = (uint16_t)src, dest_addr = (uint16_t)dest;
+	ch->CTRLB = DMA_CH_TRNIF_bm | DMA_CH_ERRIF_bm; // clear the flags from last time
+	ch->ADDRCTRL = DMA_CH_SRCRELOAD_NONE_gc | src_dir | DMA_CH_DESTRELOAD_NONE_gc | dest_dir;
+	ch->TRIGSRC = DMA_CH_TRIGSRC_OFF_gc;
+	ch->TRFCNT = BLOCKSIZE;
+	ch->SRCADDR0 = (uint8_t)src_addr;
+	ch->SRCADDR1 = (uint8_t)(src_addr >> 8);
+	ch->SRCADDR2 = 0;
+	ch->DESTADDR0 = (uint8_t)dest_addr;
+	ch->DESTADDR1 = (uint8_t)(dest_addr >> 8);
+	ch->DESTADDR2 = 0;
+	ch->CTRLA = DMA_CH_ENABLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
+	ch->CTRLA |= DMA_CH_TRFREQ_bm; // GO! The whole block goes on the one request.
+}
+
+static inline void dma_wait(DMA_CH_t *ch) {
+	while(!(ch->CTRLB & DMA_CH_TRNIF_bm)) ;
+}
+
+/*
+ * XEX is E(data ^ tweak) ^ tweak. The tweak and key are loaded as is, then
+ * with AES_XOR the data is XORed into the state on top of the tweak, and
+ * AES_AUTO starts the AES when the last byte lands. When it's done, the
+ * tweak is XORed in again the same way and the result read back out. The
+ * CPU never touches any of it - all it does is make the next tweak.
+ */
+void process_xex_start(uint8_t *data) {
+	uint8_t dir = mode?AES_DECRYPT_bm:0;
+
+	AES.CTRL = dir;
+	dma_block(&DMA_TWEAK, tweak, DMA_CH_SRCDIR_INC_gc, &AES.STATE, DMA_CH_DESTDIR_FIXED_gc);
+	dma_block(&DMA_KEY, mode?dec_key:key, DMA_CH_SRCDIR_INC_gc, &AES.KEY, DMA_CH_DESTDIR_FIXED_gc);
+	dma_wait(&DMA_TWEAK);
+	dma_wait(&DMA_KEY);
+
+	AES.CTRL = dir | AES_XOR_bm | AES_AUTO_bm;
+	dma_block(&DMA_DATA_IN, data, DMA_CH_SRCDIR_INC_gc, &AES.STATE, DMA_CH_DESTDIR_FIXED_gc);
+	xex_data = data;
+
+	// Now make the next tweak block while that's going on.
+	memcpy(next_tweak, tweak, BLOCKSIZE);
+	galois_mult(next_tweak, BLOCKSIZE);
+}
+
+void process_xex_finish(void) {
+	while(!(AES.STATUS & AES_SRIF_bm)) ; // wait for it
+
+	// No auto start this time - this is just the XOR.
+	AES.CTRL = AES_XOR_bm;
+	dma_block(&DMA_TWEAK, tweak, DMA_CH_SRCDIR_INC_gc, &AES.STATE, DMA_CH_DESTDIR_FIXED_gc);
+	dma_wait(&DMA_TWEAK);
+	dma_block(&DMA_DATA_OUT, &AES.STATE, DMA_CH_SRCDIR_FIXED_gc, xex_data, DMA_CH_DESTDIR_INC_gc);
+	dma_wait(&DMA_DATA_OUT);
+	// Plain loads again for encrypt_ECB().
+	AES.CTRL = 0;
+
+	uint8_t *t = tweak;
+	tweak = next_tweak;
+	next_tweak = t;
+}
+
+void process_xex_block(uint8_t *data) {
+	process_xex_start(data);
+	process_xex_finish();
+}
+
+#else
+
 void process_xex_block(uint8_t *data) {
 	if (mode) {
 		AES.CTRL |= AES_DECRYPT_bm;
@@ -158,9 +252,17 @@ void process_xex_block(uint8_t *data) {
 		data[i] = AES.STATE ^ tweak[i];
 	}
 	// now make the next tweak block.
-	galois_mult(tweak, sizeof(tweak));
+	galois_mult(tweak, BLOCKSIZE);
 }
 
+// Without the DMA, there's nothing to overlap.
+void process_xex_start(uint8_t *data) {
+	process_xex_block(data);
+}
+
+void process_xex_finish(void) { }
+
+#endif
 
 // perform an AES CMAC signature on the given buffer.
 void CMAC(uint8_t *buf, size_t buf_length, uint8_t *sigbuf) {
@@ -200,3 +302,28 @@ void CMAC(uint8_t *buf, size_t buf_length, uint8_t *sigbuf) {
 	encrypt_ECB(sigbuf); // Now roll THAT and the result is the answer.
 }
 
+// The same thing a block at a time, with its own key.
+void CMAC_start(struct cmac_ctx *ctx, const uint8_t *k) {
+	memcpy(ctx->key, k, KEYSIZE);
+	memset(ctx->sig, 0, BLOCKSIZE);
+}
+
+void CMAC_update(struct cmac_ctx *ctx, const uint8_t *block) {
+	for(int i = 0; i < BLOCKSIZE; i++)
+		ctx->sig[i] ^= block[i];
+	encrypt_ECB_key(ctx->key, ctx->sig);
+}
+
+void CMAC_finish(struct cmac_ctx *ctx, const uint8_t *block, uint8_t *sigbuf) {
+	uint8_t kn[BLOCKSIZE];
+	memset(kn, 0, BLOCKSIZE);
+	encrypt_ECB_key(ctx->key, kn);
+	// The last block is whole, so that's K1.
+	galois_mult(kn, sizeof(kn));
+	for(int i = 0; i < BLOCKSIZE; i++)
+		ctx->sig[i] ^= block[i] ^ kn[i];
+	encrypt_ECB_key(ctx->key, ctx->sig);
+	memcpy(sigbuf, ctx->sig, BLOCKSIZE);
+	memset(kn, 0, sizeof(kn));
+	memset(ctx, 0, sizeof(*ctx));
+}
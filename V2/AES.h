@@ -62,6 +62,22 @@ void init_xex(uint8_t *nonce, size_t nonce_len, uint8_t mode_in);
 // Call this with BLOCKSIZE bytes at a time.
 void process_xex_block(uint8_t *data);
 
+// The same thing in two halves. process_xex_start() gets the AES going on
+// the block, and process_xex_finish() waits for it and leaves the result
+// where the data was. In between, the CPU is free to move the next (or last)
+// block to or from the card. With DMA_AES off, it all happens in the first half.
+void process_xex_start(uint8_t *data);
+void process_xex_finish(void);
+
 // Perform an AES CMAC on the given buffer (call setKey() first).
 void CMAC(uint8_t *buf, size_t buf_length, uint8_t *sigbuf);
 
+// An AES CMAC over whole blocks, fed one block at a time, with a key of its
+// own - so the volume key stays put. Give CMAC_finish() the last block.
+struct cmac_ctx {
+	uint8_t key[KEYSIZE];
+	uint8_t sig[BLOCKSIZE];
+};
+void CMAC_start(struct cmac_ctx *ctx, const uint8_t *k);
+void CMAC_update(struct cmac_ctx *ctx, const uint8_t *block);
+void CMAC_finish(struct cmac_ctx *ctx, const uint8_t *block, uint8_t *sigbuf);
@@ -34,11 +34,9 @@
 #include "SCSI.h"
 #include "AES.h"
 #include "sd.h"
+#include "entropy.h"
 #include "Descriptors.h"
 
-// 10 microseconds => 100 kHz sampling for the entropy source
-#define DELAY_US_TIME (10)
-
 // To turn 32 MHz prescaled by 1024 into a 1 ms timer,
 // we count 31 1/4 counts per interrupt. We do this
 // by counting to 31 3 times, and then 32 once.
@@ -64,40 +62,6 @@ uint8_t force_attention, unit_active;
 static int32_t debounce_start; // signed and large so we can use -1 to disable
 static uint8_t button_state;
 
-/*
- * Read 8 bits from the RNG at a sample rate of 100 kHz.
- */
-static uint8_t randomByte(void) {
-	uint8_t out = 0;
-	for(int i = 0; i < 8; i++) {
-		_delay_us(DELAY_US_TIME);
-		out <<= 1;
-		out |= RNG_STATE?0:1; // why the hell not?
-	}
-	return out;
-}
-
-/*
- * This method generates 16 bytes at a time of pseudo-random data.
- * We use AES CMAC to whiten the raw data from the entropy source.
- * We gather ENTROPY_EXPANSION + 1 16 byte blocks for this purpose.
- * One is used as the AES CMAC key and the rest are used as the data.
- * The result is a block of 16 PRNG bytes for the key generator.
- */
-void fillRandomBuffer(uint8_t *buf) {
-	uint8_t keyblock[KEYSIZE];
-	for (int i = 0; i < sizeof(keyblock); i++) {
-		keyblock[i] = randomByte();
-	}
-	setKey(keyblock);
-
-	uint8_t ent_block[BLOCKSIZE * ENTROPY_EXPANSION];
-	for (int i = 0; i < sizeof(ent_block); i++) {
-		ent_block[i] = randomByte();
-	}
-	CMAC(ent_block, sizeof(ent_block), buf);
-}
-
 /*
  * The keyblock on each card looks like this:
  * 00-0F: magic value
@@ -153,35 +117,34 @@ uint8_t prepVolume(void) {
 uint8_t initVolume(void) {
 	uint8_t blockbuf[128];
 
-	RNG_POWER_ON;
-	randomByte(); // throw the first one away... just in case of startup delay.
-
 	// Magic
 	memcpy_P(blockbuf, MAGIC, strlen_P(MAGIC));
 
+	// The random parts have been collecting since the button went down.
+
 	// volume ID
-	fillRandomBuffer(blockbuf + 16);
-	fillRandomBuffer(blockbuf + 32);
+	if (entropy_get(blockbuf + 16)) goto fail;
+	if (entropy_get(blockbuf + 32)) goto fail;
 
 	// key block A
-	fillRandomBuffer(blockbuf + 48);
-	fillRandomBuffer(blockbuf + 64);
+	if (entropy_get(blockbuf + 48)) goto fail;
+	if (entropy_get(blockbuf + 64)) goto fail;
 
 	// nonce block A
-	fillRandomBuffer(blockbuf + 80);
+	if (entropy_get(blockbuf + 80)) goto fail;
 
 	blockbuf[96] = 0; // card A
-	if (writeKeyBlock(0, blockbuf, sizeof(blockbuf))) return 1;
+	if (writeKeyBlock(0, blockbuf, sizeof(blockbuf))) goto fail;
 
 	// key block B
-	fillRandomBuffer(blockbuf + 48);
-	fillRandomBuffer(blockbuf + 64);
+	if (entropy_get(blockbuf + 48)) goto fail;
+	if (entropy_get(blockbuf + 64)) goto fail;
 
 	// nonce block B
-	fillRandomBuffer(blockbuf + 80);
+	if (entropy_get(blockbuf + 80)) goto fail;
 
 	// And we're done here.
-	RNG_POWER_OFF;
+	entropy_stop();
 
 	blockbuf[96] = 1; // card B
 	if (writeKeyBlock(1, blockbuf, sizeof(blockbuf))) return 1;
@@ -190,6 +153,11 @@ uint8_t initVolume(void) {
 	// means setting the AES key to the volume key and setting
 	// cardswap appropriately (to zero, since we did the order right).
 	return prepVolume();
+
+fail:
+	entropy_stop();
+	memset(blockbuf, 0, sizeof(blockbuf));
+	return 1;
 }
 
 // return 0 for *PHYSICAL* card A or 1 for B
@@ -332,13 +300,13 @@ USB_ClassInfo_MS_Device_t Disk_MS_Interface =
                                         {
                                                 .Address           = MASS_STORAGE_IN_EPADDR,
                                                 .Size              = MASS_STORAGE_IO_EPSIZE,
-                                                .Banks             = 1,
+                                                .Banks             = 2,
                                         },
                                 .DataOUTEndpoint           =
                                         {
                                                 .Address           = MASS_STORAGE_OUT_EPADDR,
                                                 .Size              = MASS_STORAGE_IO_EPSIZE,
-                                                .Banks             = 1,
+                                                .Banks             = 2,
                                         },
                                 .TotalLUNs                 = 1,
                         },
@@ -394,7 +362,11 @@ void __ATTR_NORETURN__ main(void) {
 	CLK.USBCTRL = CLK_USBSRC_PLL_gc | CLK_USBSEN_bm; // USB is clocked from the PLL.
 
 	// turn off the bits of the chip we don't need.
-	PR.PRGEN = PR_RTC_bm | PR_EBI_bm | PR_EVSYS_bm | PR_DMA_bm; // EBI is probably moot for this chip variant.
+	PR.PRGEN = PR_RTC_bm | PR_EBI_bm | PR_EVSYS_bm // EBI is probably moot for this chip variant.
+#ifndef USE_DMA
+		| PR_DMA_bm
+#endif
+		;
 	PR.PRPA = PR_DAC_bm | PR_ADC_bm | PR_AC_bm; // all analog stuff off.
 	PR.PRPB = PR_DAC_bm | PR_ADC_bm | PR_AC_bm; // all analog stuff off.
 
@@ -413,9 +385,17 @@ void __ATTR_NORETURN__ main(void) {
 #endif
 		;
 
-	PR.PRPD = PR_TWI_bm | PR_USART0_bm | PR_USART1_bm | PR_SPI_bm | PR_HIRES_bm | PR_TC1_bm | PR_TC0_bm;
+	PR.PRPD = PR_TWI_bm | PR_USART0_bm | PR_USART1_bm | PR_SPI_bm | PR_HIRES_bm | PR_TC1_bm; // TCD0 samples the RNG
 	PR.PRPF = PR_TWI_bm | PR_USART0_bm | PR_USART1_bm | PR_SPI_bm | PR_HIRES_bm | PR_TC1_bm | PR_TC0_bm;
 
+#ifdef USE_DMA
+	DMA.CTRL = DMA_RESET_bm;
+	while(DMA.CTRL & DMA_RESET_bm) ;
+	// Fixed priority, CH0 first. That's the card receive channel, and if it
+	// doesn't keep up, the USART overruns.
+	DMA.CTRL = DMA_ENABLE_bm | DMA_PRIMODE_CH0123_gc;
+#endif
+
 	init_ports();
 	init_spi();
 	init_timer();
@@ -463,6 +443,7 @@ void __ATTR_NORETURN__ main(void) {
 			} else {
 				CARD_POWER_OFF;
 				clearKeys();
+				entropy_stop(); // if the button was down, it doesn't matter now
 				unit_active = 0;
 				force_attention = 1;
 				// lights out!
@@ -487,6 +468,9 @@ void __ATTR_NORETURN__ main(void) {
 				ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
 					button_started = milli_timer;
 				}
+				// Start gathering the entropy for the new keys now, in case
+				// they hold it down long enough.
+				entropy_start();
 				// forceably unmount.
 				LED_OFF(LED_RDY_bm);
 				unit_active = 0;
@@ -498,6 +482,7 @@ void __ATTR_NORETURN__ main(void) {
 				// LEDs back the way they were. If it went off, then
 				// when we formatted the disk we marked the button as
 				// being in an ignored state. We can now undo that.
+				entropy_stop();
 				if (!ignoring_button) {
 					unit_active = 1;
 					force_attention = 1;
@@ -509,6 +494,7 @@ void __ATTR_NORETURN__ main(void) {
 			}
 		}
 		if (button_state && !ignoring_button) {
+			entropy_task();
 			// The button is down and we're not ignoring it.
 			// If the timer is done, then blow up the world.
 			uint16_t now;
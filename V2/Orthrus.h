@@ -56,6 +56,16 @@ In addition, USARTE0 is the diag port (currently unused).
 // unless you don't). This is only supported on PINSWAP hardware.
 //#define USART_SPI
 
+// Feed the AES with the DMA controller, using the AES XOR and auto start
+// modes to do the XEX whitening, instead of a byte at a time with the CPU.
+// That leaves the CPU free to talk to the card while a block is in the AES.
+#define DMA_AES
+
+// Move the card data with the DMA controller too, so the card can be clocking
+// in (or out) the next 16 bytes while the CPU and AES work on the last ones
+// and the endpoint drains. This needs USART_SPI.
+//#define DMA_SPI
+
 // Turn on the diagnostic output port. Currently, it doesn't do anything anyway, though.
 //#define DEBUG
 
@@ -63,15 +73,24 @@ In addition, USARTE0 is the diag port (currently unused).
 // this value is actually less because we also pull a random key
 // block for the CMAC key. Since the key and block are the same size,
 // we can just subtract 1 from the value we want. More bits ostensibly
-// dilute whatever biases there are in the RNG, but take more RAM and
+// dilute whatever biases there are in the RNG, but take more
 // time. 8 way expansions means the whole key generation process
-// takes at least 80 ms (probably more because of AES etc).
+// takes at least 80 ms of sampling, but that happens in the background
+// while the button is held down (see entropy.h).
 #define ENTROPY_EXPANSION (8 - 1)
 
 #if !defined(PINSWAP) && defined(USART_SPI)
 #error USART in SPI master mode requires PINSWAP hardware.
 #endif
 
+#if defined(DMA_SPI) && !defined(USART_SPI)
+#error DMA card transfers require USART_SPI.
+#endif
+
+#if defined(DMA_AES) || defined(DMA_SPI)
+#define USE_DMA
+#endif
+
 #include <avr/io.h>
 
 #define RNGPWR_bm (1<<0)
@@ -325,7 +325,7 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
 	TotalBlocks  = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
 
 	/* Check if the block address is outside the maximum allowable value for the LUN */
-	if (BlockAddress >= volume_size)
+	if (BlockAddress >= volume_size || TotalBlocks > volume_size - BlockAddress)
 	{
 		/* Block address is invalid, update SENSE key and return command fail */
 		SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
@@ -343,7 +343,7 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
 
 		for(int i = 0; i < TotalBlocks; i++) {
 			if (MSInterfaceInfo->State.IsMassStoreReset)
-                          return false;
+				return false;
 			volumeReadBlock(BlockAddress + i);
 		}
 		/* If the endpoint is full, send its contents to the host */
@@ -354,14 +354,12 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
 		/* Wait until endpoint is ready before continuing */
 		if (Endpoint_WaitUntilReady())
 			return false;
+		/* volumeWriteBlock() hands each bank back as soon as it's read it */
 		for(int i = 0; i < TotalBlocks; i++) {
 			if (MSInterfaceInfo->State.IsMassStoreReset)
-                          return false;
+				return false;
 			volumeWriteBlock(BlockAddress + i);
 		}
-		/* If the endpoint is full, send its contents to the host */
-	        if (!(Endpoint_IsReadWriteAllowed()))
-			Endpoint_ClearOUT();
 	}
 
 	/* Update the bytes transferred counter and succeed the command */
@@ -0,0 +1,177 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "Orthrus.h"
+#include "AES.h"
+#include "entropy.h"
+
+// 32 MHz / 320 => 100 kHz sampling for the entropy source
+#define SAMPLE_PERIOD (320)
+
+/*
+ * The health test cutoffs, for a false alarm rate of 2^-20 and assuming
+ * only 0.5 bits of min-entropy per sample (which is being careful):
+ * RCT: 1 + ceil(20 / 0.5)
+ * APT: 1 + CRITBINOM(1024, 2^-0.5, 1 - 2^-20), with a 1024 sample window
+ */
+#define RCT_CUTOFF (41)
+#define APT_WINDOW (1024)
+#define APT_CUTOFF (793)
+
+// SP 800-90B wants the tests run over this many samples before any get used.
+#define STARTUP_SAMPLES (APT_WINDOW)
+
+// The raw blocks, filled by the interrupt and emptied by entropy_task().
+static uint8_t raw[2][BLOCKSIZE];
+static volatile uint8_t raw_full[2];
+static uint8_t raw_fill, raw_take, raw_pos, raw_bits, raw_byte;
+
+// Health test state.
+static volatile uint8_t failed;
+static uint16_t startup;
+static uint8_t rct_last, rct_count;
+static uint8_t apt_first;
+static uint16_t apt_seen, apt_count;
+
+// The whitened output.
+static struct cmac_ctx cmac;
+static uint8_t cmac_stage; // 0 is the key block, then the data blocks
+static uint8_t pool[ENTROPY_POOL_BLOCKS][BLOCKSIZE];
+static uint8_t pool_take, pool_count;
+
+static uint8_t running;
+
+ISR(TCD0_OVF_vect) {
+	uint8_t bit = RNG_STATE?0:1; // why the hell not?
+
+	// Repetition count test
+	if (bit == rct_last) {
+		if (++rct_count >= RCT_CUTOFF) failed = 1;
+	} else {
+		rct_last = bit;
+		rct_count = 1;
+	}
+	// Adaptive proportion test
+	if (apt_seen == 0) {
+		apt_first = bit;
+		apt_count = 1;
+	} else if (bit == apt_first) {
+		if (++apt_count >= APT_CUTOFF) failed = 1;
+	}
+	if (++apt_seen >= APT_WINDOW) apt_seen = 0;
+
+	if (failed) {
+		TCD0.CTRLA = TC_CLKSEL_OFF_gc; // that's it until the next start
+		return;
+	}
+	if (startup) {
+		startup--;
+		return;
+	}
+	// If the whitening hasn't caught up, this sample just gets dropped.
+	if (raw_full[raw_fill]) return;
+	raw_byte = (raw_byte << 1) | bit;
+	if (++raw_bits < 8) return;
+	raw_bits = 0;
+	raw[raw_fill][raw_pos] = raw_byte;
+	if (++raw_pos < BLOCKSIZE) return;
+	raw_pos = 0;
+	raw_full[raw_fill] = 1;
+	raw_fill ^= 1;
+}
+
+static void wipe(void) {
+	memset(raw, 0, sizeof(raw));
+	memset(pool, 0, sizeof(pool));
+	memset(&cmac, 0, sizeof(cmac));
+	raw_full[0] = raw_full[1] = 0;
+	raw_fill = raw_take = raw_pos = raw_bits = raw_byte = 0;
+	cmac_stage = 0;
+	pool_take = pool_count = 0;
+}
+
+void entropy_start(void) {
+	TCD0.CTRLA = TC_CLKSEL_OFF_gc;
+	wipe();
+	failed = 0;
+	startup = STARTUP_SAMPLES;
+	rct_last = 0xff; // neither a 0 nor a 1
+	rct_count = 0;
+	apt_seen = 0;
+	RNG_POWER_ON;
+	running = 1;
+
+	TCD0.CNT = 0;
+	TCD0.PER = SAMPLE_PERIOD - 1;
+	TCD0.INTCTRLA = TC_OVFINTLVL_LO_gc;
+	TCD0.CTRLA = TC_CLKSEL_DIV1_gc;
+}
+
+void entropy_stop(void) {
+	TCD0.CTRLA = TC_CLKSEL_OFF_gc;
+	TCD0.INTCTRLA = TC_OVFINTLVL_OFF_gc;
+	RNG_POWER_OFF;
+	running = 0;
+	wipe();
+}
+
+void entropy_task(void) {
+	if (!running || failed) return;
+	if (pool_count == ENTROPY_POOL_BLOCKS) {
+		// Full up. No sense sampling for nothing.
+		TCD0.CTRLA = TC_CLKSEL_OFF_gc;
+		return;
+	}
+	if (!raw_full[raw_take]) return;
+	uint8_t *block = raw[raw_take];
+	if (cmac_stage == 0) {
+		CMAC_start(&cmac, block);
+	} else if (cmac_stage < ENTROPY_EXPANSION) {
+		CMAC_update(&cmac, block);
+	} else {
+		uint8_t slot = (pool_take + pool_count) % ENTROPY_POOL_BLOCKS;
+		CMAC_finish(&cmac, block, pool[slot]);
+		pool_count++;
+	}
+	if (++cmac_stage > ENTROPY_EXPANSION) cmac_stage = 0;
+	memset(block, 0, BLOCKSIZE);
+	raw_full[raw_take] = 0;
+	raw_take ^= 1;
+}
+
+uint8_t entropy_get(uint8_t *buf) {
+	if (!running) entropy_start();
+	while(!pool_count) {
+		if (failed) return 1;
+		TCD0.CTRLA = TC_CLKSEL_DIV1_gc; // in case the pool filled up before
+		entropy_task();
+	}
+	if (failed) return 1;
+	memcpy(buf, pool[pool_take], BLOCKSIZE);
+	memset(pool[pool_take], 0, BLOCKSIZE);
+	pool_take = (pool_take + 1) % ENTROPY_POOL_BLOCKS;
+	pool_count--;
+	return 0;
+}
@@ -0,0 +1,52 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Background entropy collection for initVolume().
+ *
+ * A timer interrupt samples the RNG pin at 100 kHz, starting the moment the
+ * button goes down. Every sample goes through the SP 800-90B repetition
+ * count and adaptive proportion tests, and once the startup window has
+ * passed the bits are packed into raw blocks. entropy_task() whitens those
+ * as they come in with an incremental AES CMAC - ENTROPY_EXPANSION + 1 raw
+ * blocks per output block, one as the CMAC key and the rest as the data -
+ * so by the time the button has been held for 5 seconds, the key material
+ * is sitting there waiting.
+ *
+ * If either health test fails, collection stops and entropy_get() fails
+ * until the next entropy_start().
+ */
+
+#include <stdint.h>
+
+// How many whitened blocks to keep ready. initVolume() needs 8.
+#define ENTROPY_POOL_BLOCKS (8)
+
+// Power up the RNG and start sampling. Anything collected before is wiped.
+void entropy_start(void);
+
+// Stop sampling, power the RNG down and wipe everything.
+void entropy_stop(void);
+
+// Call this from the main loop. It whitens whatever raw blocks are ready.
+void entropy_task(void);
+
+// Get BLOCKSIZE whitened bytes, waiting for them if need be. Returns
+// non-zero if the health tests have failed.
+uint8_t entropy_get(uint8_t *buf);
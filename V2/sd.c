@@ -268,47 +268,254 @@ uint8_t init(void) {
 	return prepVolume(); // try to initialize the crypto
 }
 
-uint8_t volumeReadBlock(uint32_t blocknum) {
-	uint8_t card = setupBlockCrypto(blocknum, 1);
-	uint32_t phys_block = (blocknum >> 1) + 1;
+#define CHUNKS (VIRTUAL_MEMORY_BLOCK_SIZE / BLOCKSIZE)
+#define CHUNKS_PER_PACKET (MASS_STORAGE_IO_EPSIZE / BLOCKSIZE)
+
+#ifdef DMA_SPI
+
+// The card channels. Receive has to be the higher priority (see main()).
+#define DMA_SPI_RX (DMA.CH0)
+#define DMA_SPI_TX (DMA.CH1)
+
+// What we clock out while reading.
+static const uint8_t idle_byte = 0xff;
+
+// Set up a channel to move BLOCKSIZE bytes, one per trigger from the USART.
+static void spi_dma_setup(DMA_CH_t *ch, uint8_t addrctrl, uint8_t trigsrc, const volatile void *src, volatile void *dest) {
+	uint16_t src_addr = (uint16_t)src, dest_addr = (uint16_t)dest;
+	ch->CTRLB = DMA_CH_TRNIF_bm | DMA_CH_ERRIF_bm; // clear the flags from last time
+	ch->ADDRCTRL = addrctrl;
+	ch->TRIGSRC = trigsrc;
+	ch->TRFCNT = BLOCKSIZE;
+	ch->SRCADDR0 = (uint8_t)src_addr;
+	ch->SRCADDR1 = (uint8_t)(src_addr >> 8);
+	ch->SRCADDR2 = 0;
+	ch->DESTADDR0 = (uint8_t)dest_addr;
+	ch->DESTADDR1 = (uint8_t)(dest_addr >> 8);
+	ch->DESTADDR2 = 0;
+	ch->CTRLA = DMA_CH_ENABLE_bm | DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
+}
 
-	if (!CD_STATE) return 1; // fail
-	ASSERT_CARD(card);
-	LED_ON(LED_ACT_bm);
+static inline void spi_dma_wait(DMA_CH_t *ch) {
+	while(!(ch->CTRLB & DMA_CH_TRNIF_bm)) ;
+}
 
-	if (waitForIdle(RW_TIMEOUT)) goto fail;
+// Start clocking the next BLOCKSIZE bytes from the card into buf.
+static void spi_dma_read(uint8_t *buf) {
+	spi_dma_setup(&DMA_SPI_RX, DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_FIXED_gc | DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_INC_gc,
+		DMA_CH_TRIGSRC_USARTC0_RXC_gc, &USARTC0.DATA, buf);
+	// This one starts right away - the transmit buffer is empty.
+	spi_dma_setup(&DMA_SPI_TX, DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_FIXED_gc | DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_FIXED_gc,
+		DMA_CH_TRIGSRC_USARTC0_DRE_gc, &idle_byte, &USARTC0.DATA);
+}
 
-	if (sendCommand_R1(17, phys_block) != R1_READY_STATE) goto fail;
+// Start sending BLOCKSIZE bytes from buf to the card. Nobody collects
+// what comes back - spi_dma_write_done() throws it away.
+static void spi_dma_write(uint8_t *buf) {
+	USARTC0.STATUS = USART_TXCIF_bm; // so spi_dma_write_done() sees the end of this one
+	spi_dma_setup(&DMA_SPI_TX, DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_INC_gc | DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_FIXED_gc,
+		DMA_CH_TRIGSRC_USARTC0_DRE_gc, buf, &USARTC0.DATA);
+}
 
-	if (waitForStart(RW_TIMEOUT)) goto fail;
+static void spi_drain(void) {
+	while(USARTC0.STATUS & USART_RXCIF_bm)
+		USARTC0.DATA; // dummy read
+}
+
+static void spi_dma_write_done(void) {
+	spi_dma_wait(&DMA_SPI_TX);
+	while(!(USARTC0.STATUS & USART_TXCIF_bm)) ; // wait for the last byte to go
+	spi_drain();
+}
 
-	for(int i = 0; i < VIRTUAL_MEMORY_BLOCK_SIZE / MASS_STORAGE_IO_EPSIZE; i++) {
-		if (!(Endpoint_IsReadWriteAllowed())) {
-			/* Clear the current endpoint bank */
-			Endpoint_ClearIN();
+// Stop whatever's going on. The buffers are on the stack, so this can't be skipped.
+static void spi_dma_abort(void) {
+	DMA_SPI_RX.CTRLA = 0;
+	DMA_SPI_TX.CTRLA = 0;
+	while((DMA_SPI_RX.CTRLB | DMA_SPI_TX.CTRLB) & DMA_CH_CHBUSY_bm) ;
+	while(!(USARTC0.STATUS & USART_TXCIF_bm)) ;
+	spi_drain();
+}
+
+// Read the 512 bytes of a data block from the selected card, decrypt it and
+// write it to the endpoint. The card clocks in the next chunk while the last
+// one goes through the AES, and the next packet fills while the last is written.
+static uint8_t readBlockData(void) {
+	uint8_t packets[2][MASS_STORAGE_IO_EPSIZE];
+	spi_dma_read(packets[0]);
+	for(int c = 0; c < CHUNKS; c++) {
+		uint8_t *packet = packets[(c / CHUNKS_PER_PACKET) & 1];
+		uint8_t *data = packet + (c % CHUNKS_PER_PACKET) * BLOCKSIZE;
+		spi_dma_wait(&DMA_SPI_RX);
+		if (c + 1 < CHUNKS)
+			spi_dma_read(packets[((c + 1) / CHUNKS_PER_PACKET) & 1] + ((c + 1) % CHUNKS_PER_PACKET) * BLOCKSIZE);
+		process_xex_block(data);
+		if (c % CHUNKS_PER_PACKET != CHUNKS_PER_PACKET - 1) continue;
+		/* Wait for a free bank - with two of them, there usually is one */
+		if (Endpoint_WaitUntilReady())
+			goto fail;
+		Endpoint_Write_Stream_LE(packet, MASS_STORAGE_IO_EPSIZE, NULL);
+		Endpoint_ClearIN(); // the USB engine sends this bank while we fill the other
+	}
+	return 0;
+fail:
+	spi_dma_abort();
+	return 1;
+}
 
+// Read 512 bytes from the endpoint, encrypt them and send them to the selected
+// card. Each chunk goes out while the next one is in the AES.
+static uint8_t writeBlockData(void) {
+	uint8_t packets[2][MASS_STORAGE_IO_EPSIZE];
+	for(int c = 0; c < CHUNKS; c++) {
+		uint8_t *packet = packets[(c / CHUNKS_PER_PACKET) & 1];
+		uint8_t *data = packet + (c % CHUNKS_PER_PACKET) * BLOCKSIZE;
+		if (c % CHUNKS_PER_PACKET == 0) {
 			/* Wait until the host has sent another packet */
 			if (Endpoint_WaitUntilReady())
 				goto fail;
+			Endpoint_Read_Stream_LE(packet, MASS_STORAGE_IO_EPSIZE, NULL);
+			Endpoint_ClearOUT(); // the host can fill this bank again while we work
 		}
-		for(int j = 0; j < MASS_STORAGE_IO_EPSIZE / BLOCKSIZE; j++) {
-			uint8_t data[BLOCKSIZE];
-			for(int k = 0; k < BLOCKSIZE; k++) {
+		process_xex_block(data);
+		if (c != 0) spi_dma_wait(&DMA_SPI_TX);
+		spi_dma_write(data);
+	}
+	spi_dma_write_done();
+	return 0;
+fail:
+	spi_dma_abort();
+	return 1;
+}
+
+#else
+
+// Start a byte on its way to (and another from) the card...
+static inline void spi_start(uint8_t data) ATTR_ALWAYS_INLINE;
+static inline void spi_start(uint8_t data) {
+#ifdef USART_SPI
+	while(!(USARTC0.STATUS & USART_DREIF_bm)) ; // wait for ready
+	USARTC0.DATA = data;
+#else
+	SPIC.DATA = data;
+#endif
+}
+
+// ...and, after doing something useful in the meantime, collect it.
+static inline uint8_t spi_finish(void) ATTR_ALWAYS_INLINE;
+static inline uint8_t spi_finish(void) {
 #ifdef USART_SPI
-				while(!(USARTC0.STATUS & USART_DREIF_bm)); // wait for ready
-				USARTC0.DATA = 0xff;
-				while(!(USARTC0.STATUS & USART_RXCIF_bm)); // wait to read
-				data[k] = USARTC0.DATA;
+	while(!(USARTC0.STATUS & USART_RXCIF_bm)) ; // wait to read
+	return USARTC0.DATA;
 #else
-				SPIC.DATA = 0xff; // run the clock
-				while(!(SPIC.STATUS & SPI_IF_bm)) ; // wait for it
-				data[k] = SPIC.DATA;
+	while(!(SPIC.STATUS & SPI_IF_bm)) ; // wait for it
+	return SPIC.DATA;
 #endif
+}
+
+/*
+ * The sector goes through in BLOCKSIZE chunks, three at a time: while chunk c
+ * comes in, chunk c - 1 has the AES to itself and chunk c - 2 goes out. Each
+ * byte going out is moved while a byte coming in is still on the wire. Chunk
+ * c - 2 is in chunks[(c + 1) % 3].
+ *
+ * From c = 1 to c = CHUNKS, chunk c - 1 is still in the AES, so giving up
+ * early has to wait for it first. Otherwise the DMA would go on writing into
+ * a stack buffer that's gone, and AES.CTRL would be left in XOR/AUTO.
+ */
+
+// Read the 512 bytes of a data block from the selected card, decrypt it and
+// write it to the endpoint.
+static uint8_t readBlockData(void) {
+	uint8_t chunks[3][BLOCKSIZE];
+	for(int c = 0; c < CHUNKS + 2; c++) {
+		uint8_t *in = chunks[c % 3], *out = chunks[(c + 1) % 3];
+		int out_c = c - 2;
+		if (out_c >= 0 && out_c % CHUNKS_PER_PACKET == 0) {
+			/* Wait for a free bank - with two of them, there usually is one */
+			if (Endpoint_WaitUntilReady()) {
+				if (c >= 1 && c <= CHUNKS) process_xex_finish();
+				return 1;
+			}
+		}
+		if (c < CHUNKS) {
+			for(int k = 0; k < BLOCKSIZE; k++) {
+				spi_start(0xff); // run the clock
+				if (out_c >= 0) Endpoint_Write_8(out[k]);
+				in[k] = spi_finish();
 			}
-			process_xex_block(data);
-			Endpoint_Write_Stream_LE(data, sizeof(data), NULL);
+		} else {
+			for(int k = 0; k < BLOCKSIZE; k++)
+				Endpoint_Write_8(out[k]);
 		}
+		if (out_c >= 0 && out_c % CHUNKS_PER_PACKET == CHUNKS_PER_PACKET - 1)
+			Endpoint_ClearIN(); // the USB engine sends this bank while we fill the other
+		if (c >= 1 && c <= CHUNKS) process_xex_finish();
+		if (c < CHUNKS) process_xex_start(in);
 	}
+	return 0;
+}
+
+// Read 512 bytes from the endpoint, encrypt them and send them to the selected card.
+static uint8_t writeBlockData(void) {
+	uint8_t chunks[3][BLOCKSIZE];
+	for(int c = 0; c < CHUNKS + 2; c++) {
+		uint8_t *in = chunks[c % 3], *out = chunks[(c + 1) % 3];
+		int out_c = c - 2;
+		if (c < CHUNKS && c % CHUNKS_PER_PACKET == 0) {
+			/* Wait until the host has sent another packet */
+			if (Endpoint_WaitUntilReady()) {
+				if (c >= 1) process_xex_finish();
+				return 1;
+			}
+		}
+		if (out_c < 0) {
+			for(int k = 0; k < BLOCKSIZE; k++)
+				in[k] = Endpoint_Read_8();
+		} else if (c < CHUNKS) {
+			for(int k = 0; k < BLOCKSIZE; k++) {
+				spi_start(out[k]);
+				in[k] = Endpoint_Read_8();
+				spi_finish(); // nothing worth having comes back
+			}
+		} else {
+			for(int k = 0; k < BLOCKSIZE; k++) {
+				spi_start(out[k]);
+				spi_finish();
+			}
+		}
+		if (c < CHUNKS && c % CHUNKS_PER_PACKET == CHUNKS_PER_PACKET - 1)
+			Endpoint_ClearOUT(); // the host can fill this bank again while we work
+		if (c >= 1 && c <= CHUNKS) process_xex_finish();
+		if (c < CHUNKS) process_xex_start(in);
+	}
+	return 0;
+}
+
+#endif
+
+/*
+ * Consecutive volume blocks alternate between the cards, so a run of blocks
+ * on one card is never more than one block long. Each block is its own
+ * CMD17 or CMD24 - keeping a CMD18 or CMD25 open on each card and switching
+ * !CS between them in the middle of it isn't something the spec allows for.
+ */
+
+uint8_t volumeReadBlock(uint32_t blocknum) {
+	uint8_t card = setupBlockCrypto(blocknum, 1);
+	uint32_t phys_block = (blocknum >> 1) + 1;
+
+	if (!CD_STATE) return 1; // fail
+	ASSERT_CARD(card);
+	LED_ON(LED_ACT_bm);
+
+	if (waitForIdle(RW_TIMEOUT)) goto fail;
+
+	if (sendCommand_R1(17, phys_block) != R1_READY_STATE) goto fail;
+
+	if (waitForStart(RW_TIMEOUT)) goto fail;
+
+	if (readBlockData()) goto fail;
 
 	SPI_byte(0xff); // CRC
 	SPI_byte(0xff); // CRC
@@ -339,37 +546,7 @@ uint8_t volumeWriteBlock(uint32_t blocknum) {
 
 	if (waitForIdle(RW_TIMEOUT)) goto fail;
 	SPI_byte(0xfe);
-	for(int i = 0; i < VIRTUAL_MEMORY_BLOCK_SIZE / MASS_STORAGE_IO_EPSIZE; i++) {
-		if (!(Endpoint_IsReadWriteAllowed())) {
-			/* Clear the current endpoint bank */
-			Endpoint_ClearOUT();
-
-			/* Wait until the host has sent another packet */
-			if (Endpoint_WaitUntilReady())
-				goto fail;
-		}
-		for(int j = 0; j < MASS_STORAGE_IO_EPSIZE / BLOCKSIZE; j++) {
-			uint8_t data[BLOCKSIZE];
-			Endpoint_Read_Stream_LE(data, sizeof(data), NULL);
-			process_xex_block(data);
-			for(int k = 0; k < sizeof(data); k++) {
-#ifdef USART_SPI
-				while(!(USARTC0.STATUS & USART_DREIF_bm)) ; // wait for ready
-				USARTC0.DATA = data[k];
-#else
-				if (i != 0 || j != 0 || k != 0)
-					while(!(SPIC.STATUS & SPI_IF_bm)) ; // wait for ready
-				SPIC.DATA = data[k];
-#endif
-			}
-		}
-	}
-	// Wait for the last one
-#ifdef USART_SPI
-	while(!(USARTC0.STATUS & USART_TXCIF_bm)) ; // wait for transmit complete
-#else
-	while(!(SPIC.STATUS & SPI_IF_bm)) ; // wait for it to go
-#endif
+	if (writeBlockData()) goto fail;
 
 	SPI_byte(0xff); // CRC
 	SPI_byte(0xff); // CRC
@@ -0,0 +1,117 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atmel_start.h>
+#include <Vendor.h>
+#include <Profile.h>
+#include <Trace.h>
+#include <Stats.h>
+#include <Diag.h>
+#include <Settings.h>
+#include <Raw.h>
+#include <Cbt.h>
+
+COMPILER_ALIGNED(4)
+static struct vendor_info info;
+// settings going either way
+COMPILER_ALIGNED(4)
+static struct settings settings_buf;
+
+static inline uint64_t cdb_arg(const uint8_t *cdb) {
+	uint64_t out = 0;
+	for(int i = 2; i < 10; i++)
+		out = (out << 8) | cdb[i];
+	return out;
+}
+
+static inline uint32_t cdb_len(const uint8_t *cdb) {
+	return ((uint32_t)cdb[10] << 24) | ((uint32_t)cdb[11] << 16) | (cdb[12] << 8) | cdb[13];
+}
+
+int32_t vendor_cmd(uint8_t lun, const uint8_t *cdb, uint8_t **buf, uint32_t *len) {
+	(void)lun;
+	if (cdb[0] != VENDOR_OPCODE) {
+		// The standard commands we take belong to the modules they report on.
+		int32_t ret = stats_log_cmd(cdb, buf, len);
+		if (ret == ERR_UNSUPPORTED_OP) ret = diag_cmd(cdb, buf, len);
+		return ret;
+	}
+	uint64_t arg = cdb_arg(cdb);
+
+	switch(cdb[1]) {
+		case VENDOR_INFO:
+			info.magic = VENDOR_MAGIC;
+			info.version = VENDOR_VERSION;
+			info.features = 0;
+#ifdef TRACE
+			info.features |= VENDOR_FEATURE_TRACE;
+#endif
+#ifdef PROFILE
+			info.features |= VENDOR_FEATURE_PROFILE;
+#endif
+			*buf = (uint8_t*)&info;
+			*len = sizeof(info);
+			return ERR_NONE;
+#ifdef TRACE
+		case VENDOR_TRACE_DUMP:
+			trace_frozen = true;
+			*buf = (uint8_t*)&trace_dump;
+			*len = sizeof(trace_dump);
+			return ERR_NONE;
+		case VENDOR_TRACE_RESUME:
+			if (arg & 1) {
+				trace_init();
+			}
+			trace_frozen = false;
+			return ERR_NONE;
+#endif
+		case VENDOR_SETTINGS_GET:
+			settings_get(&settings_buf);
+			*buf = (uint8_t*)&settings_buf;
+			*len = sizeof(settings_buf);
+			return ERR_NONE;
+		case VENDOR_SETTINGS_SET:
+			// vendor_data_out() takes it from here.
+			*buf = (uint8_t*)&settings_buf;
+			*len = sizeof(settings_buf);
+			return ERR_NONE;
+		case VENDOR_SETTINGS_DEFAULTS:
+			return settings_defaults(arg & 1);
+		case VENDOR_RAW_OPEN:
+			return raw_open(buf, len);
+		case VENDOR_RAW_READ:
+			return raw_read(arg, cdb_len(cdb));
+		case VENDOR_RAW_CLOSE:
+			return raw_close();
+		case VENDOR_CBT_GET:
+			return cbt_get(arg & 1, buf, len);
+		case VENDOR_CBT_CLEAR:
+			return cbt_clear();
+		default:
+			(void)arg;
+			return ERR_INVALID_ARG;
+	}
+}
+
+int32_t vendor_data_out(uint8_t lun, const uint8_t *cdb, uint32_t len) {
+	(void)lun;
+	if (cdb[0] != VENDOR_OPCODE) return diag_data_out(cdb, len);
+	if (cdb[1] != VENDOR_SETTINGS_SET || len != sizeof(settings_buf)) return ERR_INVALID_ARG;
+	return settings_set(&settings_buf, cdb_arg(cdb) & 1);
+}
@@ -0,0 +1,82 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * SCSI commands the MSC driver doesn't handle itself end up here. Most of them
+ * are one vendor-specific opcode with a 16 byte CDB:
+ *
+ * 0: VENDOR_OPCODE
+ * 1: subcommand
+ * 2-9: argument (big-endian)
+ * 10-13: data length (big-endian) - the most the host will take or is sending
+ * 14-15: reserved
+ *
+ * host/orthrusctl is the other end of this. If any of it changes, so must that.
+ */
+
+#define VENDOR_OPCODE (0xC0)
+
+// Returns struct vendor_info
+#define VENDOR_INFO (0x00)
+// Returns struct trace_dump (see Trace.h) and stops tracing so the dump holds still.
+#define VENDOR_TRACE_DUMP (0x01)
+// Starts tracing again. If bit 0 of the argument is set, the ring is emptied first.
+#define VENDOR_TRACE_RESUME (0x02)
+// Returns struct settings (see Settings.h) - what's in effect now.
+#define VENDOR_SETTINGS_GET (0x03)
+// Takes struct settings and puts it into effect. If bit 0 of the argument is
+// set, it's saved in flash too.
+#define VENDOR_SETTINGS_SET (0x04)
+// Goes back to the compiled-in settings. If bit 0 of the argument is set,
+// the saved ones are erased.
+#define VENDOR_SETTINGS_DEFAULTS (0x05)
+// Starts a raw read session (see Raw.h) once someone presses the button, and
+// returns struct raw_info.
+#define VENDOR_RAW_OPEN (0x06)
+// Returns sectors straight off a card. The argument is the card (bit 32) and
+// the first sector, and the data length says how many.
+#define VENDOR_RAW_READ (0x07)
+// Ends the raw read session.
+#define VENDOR_RAW_CLOSE (0x08)
+// Returns struct cbt_info and the changed block snapshot (see Cbt.h). If bit
+// 0 of the argument is set, everything written since the last snapshot is
+// added to it first.
+#define VENDOR_CBT_GET (0x09)
+// Empties the changed block snapshot - the backup has it all.
+#define VENDOR_CBT_CLEAR (0x0a)
+
+#define VENDOR_MAGIC (0x4854524fUL) // "ORTH"
+#define VENDOR_VERSION (1)
+
+// feature bits in vendor_info
+#define VENDOR_FEATURE_TRACE (0x00000001UL)
+#define VENDOR_FEATURE_PROFILE (0x00000002UL)
+
+// little-endian
+struct vendor_info {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t features;
+};
+
+// These are the MSCDF_CB_EXT_CMD and MSCDF_CB_EXT_DATA_OUT callbacks. They're
+// called from the USB interrupt.
+int32_t vendor_cmd(uint8_t lun, const uint8_t *cdb, uint8_t **buf, uint32_t *len);
+int32_t vendor_data_out(uint8_t lun, const uint8_t *cdb, uint32_t len);
@@ -0,0 +1,114 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "extentcache.h"
+
+#include <algorithm>
+#include <cstring>
+
+ExtentCache::Extent::Extent(size_t length) : data(new uint8_t[length]), length(length), ready(false) {
+}
+
+ExtentCache::Extent::~Extent() {
+	// It's plaintext.
+	memset(data, 0, length);
+	delete[] data;
+}
+
+ExtentCache::ExtentCache(const Volume &volume, size_t capacityBytes) : volume(volume) {
+	blocksPerExtent = EXTENT_BYTES / volume.blockSize();
+	extentCount = (volume.blocks() + blocksPerExtent - 1) / blocksPerExtent;
+	capacity = capacityBytes / EXTENT_BYTES;
+	if (capacity < 1) capacity = 1;
+	memset(&counts, 0, sizeof(counts));
+}
+
+ExtentCache::~ExtentCache() {
+	std::lock_guard<std::mutex> guard(lock);
+	map.clear();
+	lru.clear();
+}
+
+void ExtentCache::evict() {
+	// Only ready extents are on the list - ones being decrypted can't go yet.
+	while(lru.size() > capacity) {
+		map.erase(lru.back());
+		lru.pop_back();
+	}
+}
+
+ExtentCache::ExtentPtr ExtentCache::get(uint64_t index, bool prefetching) {
+	std::unique_lock<std::mutex> guard(lock);
+	auto it = map.find(index);
+	if (it != map.end()) {
+		ExtentPtr extent = it->second;
+		if (prefetching) return extent;
+		if (extent->ready) {
+			counts.hits++;
+			lru.splice(lru.begin(), lru, extent->lru);
+			return extent;
+		}
+		// Someone else is decrypting it.
+		counts.misses++;
+		loaded.wait(guard, [&extent] { return extent->ready; });
+		return extent;
+	}
+
+	uint64_t first = index * blocksPerExtent;
+	uint64_t count = std::min((uint64_t)blocksPerExtent, volume.blocks() - first);
+	ExtentPtr extent = std::make_shared<Extent>(count * volume.blockSize());
+	map[index] = extent;
+	if (prefetching) counts.prefetched++;
+	else counts.misses++;
+	guard.unlock();
+
+	volume.decrypt(first, count, extent->data);
+
+	guard.lock();
+	extent->ready = true;
+	lru.push_front(index);
+	extent->lru = lru.begin();
+	evict();
+	guard.unlock();
+	loaded.notify_all();
+	return extent;
+}
+
+void ExtentCache::read(uint64_t offset, size_t length, uint8_t *out) {
+	while(length > 0) {
+		uint64_t index = extentOf(offset);
+		size_t within = offset - index * EXTENT_BYTES;
+		ExtentPtr extent = get(index, false);
+		size_t n = std::min(length, extent->length - within);
+		// Holding the pointer keeps the extent around even if it's evicted meanwhile.
+		memcpy(out, extent->data + within, n);
+		offset += n;
+		out += n;
+		length -= n;
+	}
+}
+
+void ExtentCache::prefetch(uint64_t extent) {
+	if (extent < extentCount) get(extent, true);
+}
+
+ExtentCache::Stats ExtentCache::stats() {
+	std::lock_guard<std::mutex> guard(lock);
+	return counts;
+}
@@ -0,0 +1,92 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef ORTHRUS_EXTENTCACHE_H_
+#define ORTHRUS_EXTENTCACHE_H_
+
+#include "volume.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+/*
+ * Decrypted volume data for random access, an extent (a fixed number of
+ * volume blocks) at a time. The most recently used extents are kept, up to
+ * the capacity. Any number of threads can read at once: an extent that isn't
+ * there is decrypted by the first thread to want it, and anyone else who
+ * wants it meanwhile waits for that rather than doing it again.
+ */
+class ExtentCache {
+public:
+	static const size_t EXTENT_BYTES = 64 * 1024;
+
+	ExtentCache(const Volume &volume, size_t capacityBytes);
+	~ExtentCache();
+	ExtentCache(const ExtentCache &) = delete;
+	ExtentCache &operator=(const ExtentCache &) = delete;
+
+	uint64_t extents() const { return extentCount; }
+	uint64_t extentOf(uint64_t offset) const { return offset / EXTENT_BYTES; }
+	size_t capacityExtents() const { return capacity; }
+
+	// Copy length bytes of the decrypted volume, from offset, to out. The
+	// range has to be inside the volume.
+	void read(uint64_t offset, size_t length, uint8_t *out);
+
+	// Decrypt an extent ahead of time, unless it's already there (or on its way).
+	void prefetch(uint64_t extent);
+
+	struct Stats {
+		uint64_t hits, misses, prefetched;
+	};
+	Stats stats();
+
+private:
+	struct Extent {
+		uint8_t *data;
+		size_t length;
+		bool ready;
+		std::list<uint64_t>::iterator lru;
+		explicit Extent(size_t length);
+		~Extent();
+	};
+	typedef std::shared_ptr<Extent> ExtentPtr;
+
+	// Get an extent, decrypting it here if need be.
+	ExtentPtr get(uint64_t index, bool prefetching);
+	void evict();
+
+	const Volume &volume;
+	uint64_t extentCount;
+	size_t blocksPerExtent;
+	size_t capacity; // in extents
+
+	std::mutex lock;
+	std::condition_variable loaded;
+	std::unordered_map<uint64_t, ExtentPtr> map;
+	std::list<uint64_t> lru; // ready extents, most recently used first
+	Stats counts;
+};
+
+#endif
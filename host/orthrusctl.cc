@@ -0,0 +1,644 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// orthrusctl - talk to an Orthrus through its vendor SCSI commands.
+
+#include "scsi.h"
+#include "trace.h"
+#include "vendor.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef int (*Command)(const std::vector<std::string> &args);
+
+void usage() {
+	std::cerr <<
+		"Usage: orthrusctl <command> [args]\n"
+		"  info <dev>                        show what the firmware supports\n"
+		"  trace-dump <dev> <file> [--clear] save the trace ring and restart tracing\n"
+		"  trace-json <file> <json> [mhz]    convert a saved trace to Chrome/Perfetto JSON\n"
+		"  stats <dev> [--reset]             show the I/O, latency and cache counters\n"
+		"  bench <dev> [--write] [sectors]   run the on-device benchmark\n"
+		"  tune <dev> [knob=value ...] [--save]\n"
+		"                                    show or change the performance knobs:\n"
+		"                                    clock_khz, prefetch, write_back, batch, sched\n"
+		"  tune <dev> --defaults [--save]    go back to the built-in knobs (--save forgets saved ones)\n"
+		"  backup <dev> <image A> <image B> [--incremental]\n"
+		"                                    copy both cards' ciphertext, as is (needs the button) -\n"
+		"                                    with --incremental, only what changed since the last one\n"
+		"  cbt <dev> [--snapshot] [--clear]  show the regions written since the last backup\n";
+}
+
+bool readFile(const std::string &path, std::vector<uint8_t> &data) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in) return false;
+	data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	return true;
+}
+
+bool writeFile(const std::string &path, const std::vector<uint8_t> &data) {
+	std::ofstream out(path, std::ios::binary);
+	out.write(reinterpret_cast<const char *>(data.data()), data.size());
+	return bool(out);
+}
+
+// Open the device and make sure it's an Orthrus. Returns the feature bits, or -1.
+long long openDevice(ScsiDevice &dev, const std::string &path) {
+	if (!dev.isOpen()) {
+		std::cerr << path << ": " << strerror(errno) << "\n";
+		return -1;
+	}
+	std::vector<uint8_t> data(12);
+	std::string error;
+	if (!dev.command(vendorCdb(VENDOR_INFO, 0, data.size()), ScsiDevice::IN, data, error)) {
+		std::cerr << path << ": " << error << " (is this an Orthrus?)\n";
+		return -1;
+	}
+	if (data.size() < 12 || le32(data.data()) != VENDOR_MAGIC) {
+		std::cerr << path << ": not an Orthrus\n";
+		return -1;
+	}
+	return le32(data.data() + 8);
+}
+
+int cmdInfo(const std::vector<std::string> &args) {
+	if (args.size() != 1) {
+		usage();
+		return 1;
+	}
+	ScsiDevice dev(args[0]);
+	long long features = openDevice(dev, args[0]);
+	if (features < 0) return 1;
+	std::cout << "trace:   " << ((features & VENDOR_FEATURE_TRACE) ? "yes" : "no") << "\n";
+	std::cout << "profile: " << ((features & VENDOR_FEATURE_PROFILE) ? "yes" : "no") << "\n";
+	return 0;
+}
+
+int cmdTraceDump(const std::vector<std::string> &args) {
+	if (args.size() < 2 || args.size() > 3 || (args.size() == 3 && args[2] != "--clear")) {
+		usage();
+		return 1;
+	}
+	ScsiDevice dev(args[0]);
+	long long features = openDevice(dev, args[0]);
+	if (features < 0) return 1;
+	if (!(features & VENDOR_FEATURE_TRACE)) {
+		std::cerr << args[0] << ": firmware was built without TRACE\n";
+		return 1;
+	}
+
+	std::vector<uint8_t> data(1024 * 1024);
+	std::string error;
+	bool ok = dev.command(vendorCdb(VENDOR_TRACE_DUMP, 0, data.size()), ScsiDevice::IN, data, error);
+	// The dump stops tracing. Start it again no matter what.
+	std::vector<uint8_t> none;
+	std::string resume_error;
+	if (!dev.command(vendorCdb(VENDOR_TRACE_RESUME, args.size() == 3 ? 1 : 0, 0), ScsiDevice::NONE, none, resume_error))
+		std::cerr << args[0] << ": couldn't restart tracing: " << resume_error << "\n";
+	if (!ok) {
+		std::cerr << args[0] << ": " << error << "\n";
+		return 1;
+	}
+	if (!writeFile(args[1], data)) {
+		std::cerr << args[1] << ": " << strerror(errno) << "\n";
+		return 1;
+	}
+	return 0;
+}
+
+int cmdTraceJson(const std::vector<std::string> &args) {
+	if (args.size() < 2 || args.size() > 3) {
+		usage();
+		return 1;
+	}
+	std::vector<uint8_t> dump;
+	if (!readFile(args[0], dump)) {
+		std::cerr << args[0] << ": " << strerror(errno) << "\n";
+		return 1;
+	}
+	std::vector<TraceRecord> records;
+	unsigned int mhz;
+	std::string error;
+	if (!decodeTrace(dump, records, mhz, error)) {
+		std::cerr << args[0] << ": " << error << "\n";
+		return 1;
+	}
+	if (args.size() == 3) mhz = strtoul(args[2].c_str(), NULL, 0);
+	if (mhz == 0) {
+		std::cerr << "The clock speed has to be more than 0 MHz\n";
+		return 1;
+	}
+	std::ofstream out(args[1]);
+	if (!out) {
+		std::cerr << args[1] << ": " << strerror(errno) << "\n";
+		return 1;
+	}
+	writeChromeTrace(records, mhz, out);
+	std::cerr << records.size() << " events\n";
+	return out ? 0 : 1;
+}
+
+typedef std::map<uint16_t, uint64_t> LogParams;
+
+// Fetch a log page and pull out its parameters (big-endian, unlike the vendor command).
+bool readLogPage(ScsiDevice &dev, uint8_t page, LogParams &params, std::string &error) {
+	std::vector<uint8_t> data(4096);
+	if (!dev.command(logSenseCdb(page, data.size()), ScsiDevice::IN, data, error)) return false;
+	if (data.size() < 4 || (data[0] & 0x3f) != page) {
+		error = "bad log page";
+		return false;
+	}
+	size_t end = std::min(data.size(), size_t(4 + ((data[2] << 8) | data[3])));
+	for(size_t p = 4; p + 4 <= end; ) {
+		uint16_t code = (data[p] << 8) | data[p + 1];
+		size_t len = data[p + 3];
+		if (p + 4 + len > end) break;
+		uint64_t value = 0;
+		for(size_t i = 0; i < len; i++)
+			value = (value << 8) | data[p + 4 + i];
+		params[code] = value;
+		p += 4 + len;
+	}
+	return true;
+}
+
+const char *opcodeName(uint8_t opcode) {
+	switch(opcode) {
+		case 0x00: return "TEST UNIT READY";
+		case 0x03: return "REQUEST SENSE";
+		case 0x12: return "INQUIRY";
+		case 0x1a: return "MODE SENSE(6)";
+		case 0x1b: return "START STOP UNIT";
+		case 0x1e: return "PREVENT ALLOW MEDIUM REMOVAL";
+		case 0x23: return "READ FORMAT CAPACITIES";
+		case 0x25: return "READ CAPACITY(10)";
+		case 0x28: return "READ(10)";
+		case 0x2a: return "WRITE(10)";
+		case 0x2f: return "VERIFY(10)";
+		case 0x35: return "SYNCHRONIZE CACHE(10)";
+		case 0x4c: return "LOG SELECT";
+		case 0x4d: return "LOG SENSE";
+		case 0x5a: return "MODE SENSE(10)";
+		case VENDOR_OPCODE: return "vendor";
+		default: return "";
+	}
+}
+
+int cmdStats(const std::vector<std::string> &args) {
+	if (args.size() < 1 || args.size() > 2 || (args.size() == 2 && args[1] != "--reset")) {
+		usage();
+		return 1;
+	}
+	ScsiDevice dev(args[0]);
+	if (openDevice(dev, args[0]) < 0) return 1;
+
+	LogParams cards, opcodes, service, cache;
+	std::string error;
+	if (!readLogPage(dev, LOG_PAGE_CARDS, cards, error) ||
+			!readLogPage(dev, LOG_PAGE_OPCODES, opcodes, error) ||
+			!readLogPage(dev, LOG_PAGE_SERVICE, service, error) ||
+			!readLogPage(dev, LOG_PAGE_CACHE, cache, error)) {
+		std::cerr << args[0] << ": " << error << "\n";
+		return 1;
+	}
+
+	double seconds = cards[0x8000] / 1000.0;
+	printf("%.1f seconds since the counters were reset\n\n", seconds);
+	printf("card  sectors read  sectors written   MB/s  errors  crc  selects\n");
+	for(int card = 0; card < 2; card++) {
+		uint16_t base = card << 8;
+		uint64_t sectors = cards[base] + cards[base | 1];
+		printf("%-4s  %12llu  %15llu  %5.2f  %6llu  %3llu  %7llu\n", card ? "B" : "A",
+			(unsigned long long)cards[base], (unsigned long long)cards[base | 1],
+			seconds > 0 ? sectors * 512 / seconds / 1e6 : 0.0,
+			(unsigned long long)cards[base | 3], (unsigned long long)cards[base | 4],
+			(unsigned long long)cards[base | 5]);
+	}
+
+	printf("\ncommands\n");
+	for(LogParams::const_iterator it = opcodes.begin(); it != opcodes.end(); ++it)
+		printf("  0x%02x %-28s %10llu\n", it->first, opcodeName(it->first), (unsigned long long)it->second);
+
+	printf("\nservice time (us): %llu commands, average %llu, p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+		(unsigned long long)service[0], (unsigned long long)service[1], (unsigned long long)service[2],
+		(unsigned long long)service[3], (unsigned long long)service[4], (unsigned long long)service[5]);
+
+	printf("\ncache: %llu hits, %llu misses (%.1f%% hit rate)\n",
+		(unsigned long long)cache[0], (unsigned long long)cache[1], cache[4] / 10.0);
+	printf("read-ahead: %llu used, %llu wasted (%.1f%% accurate)\n",
+		(unsigned long long)cache[2], (unsigned long long)cache[3], cache[5] / 10.0);
+
+	if (args.size() == 2) {
+		std::vector<uint8_t> none;
+		if (!dev.command(logResetCdb(), ScsiDevice::NONE, none, error)) {
+			std::cerr << args[0] << ": " << error << "\n";
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static inline uint32_t be32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+int cmdBench(const std::vector<std::string> &args) {
+	if (args.empty() || args.size() > 3) {
+		usage();
+		return 1;
+	}
+	uint8_t flags = 0;
+	unsigned long sectors = 0;
+	for(size_t i = 1; i < args.size(); i++) {
+		if (args[i] == "--write") {
+			flags |= DIAG_FLAG_WRITE;
+		} else {
+			sectors = strtoul(args[i].c_str(), NULL, 0);
+			if (sectors == 0 || sectors > 0xffff) {
+				std::cerr << "The size has to be from 1 to 65535 sectors\n";
+				return 1;
+			}
+		}
+	}
+	ScsiDevice dev(args[0]);
+	if (openDevice(dev, args[0]) < 0) return 1;
+
+	std::vector<uint8_t> page = { DIAG_PAGE_BENCH, 0, 0, 4, flags, 0, (uint8_t)(sectors >> 8), (uint8_t)sectors };
+	std::string error;
+	std::cerr << "Running the benchmark...\n";
+	// A failed test fails the command, but the results are still worth a look.
+	bool ok = dev.command(sendDiagnosticCdb(page.size()), ScsiDevice::OUT, page, error);
+	if (!ok) std::cerr << args[0] << ": " << error << "\n";
+
+	std::vector<uint8_t> data(1024);
+	if (!dev.command(receiveDiagnosticCdb(DIAG_PAGE_BENCH, data.size()), ScsiDevice::IN, data, error)) {
+		std::cerr << args[0] << ": " << error << "\n";
+		return 1;
+	}
+	if (data.size() < 8 || data[0] != DIAG_PAGE_BENCH) {
+		std::cerr << args[0] << ": bad results page\n";
+		return 1;
+	}
+	static const char *tests[] = { "sequential read", "random read", "sequential write", "random write", "XEX", "volume read" };
+	static const char *results[] = { "ok", "FAILED", "skipped" };
+	printf("%u sectors per test\n\n", (data[6] << 8) | data[7]);
+	printf("test              card  result        MB/s    ops/s   us/op\n");
+	for(size_t p = 8; p + DIAG_RECORD_SIZE <= data.size(); p += DIAG_RECORD_SIZE) {
+		const uint8_t *r = data.data() + p;
+		uint32_t bytes = be32(r + 4), ops = be32(r + 8), us = be32(r + 12);
+		const char *card = r[1] == 0 ? "A" : r[1] == 1 ? "B" : "-";
+		printf("%-16s  %-4s  %-7s", r[0] < 6 ? tests[r[0]] : "?", card, r[2] < 3 ? results[r[2]] : "?");
+		if (r[2] == 0 && us > 0)
+			printf("  %9.2f  %7.0f  %6.1f", bytes / (double)us, ops * 1e6 / us, us / (double)ops);
+		printf("\n");
+	}
+	return ok ? 0 : 1;
+}
+
+const char *schedNames[] = { "rounds", "disk-first" };
+
+void printSettings(const std::vector<uint8_t> &s) {
+	uint8_t sched = s[SETTINGS_SCHED_POLICY];
+	printf("clock_khz  = %u\n", le32(&s[SETTINGS_CARD_CLOCK]) / 1000);
+	printf("prefetch   = %u\n", le16(&s[SETTINGS_PREFETCH_DEPTH]));
+	printf("write_back = %u\n", s[SETTINGS_WRITE_BACK]);
+	printf("batch      = %u\n", s[SETTINGS_BATCH_SECTORS]);
+	printf("sched      = %s\n", sched < 2 ? schedNames[sched] : "?");
+}
+
+// Change one knob in a settings block. Returns false if it doesn't make sense.
+bool setKnob(std::vector<uint8_t> &s, const std::string &knob) {
+	size_t eq = knob.find('=');
+	if (eq == std::string::npos) return false;
+	std::string name = knob.substr(0, eq), value = knob.substr(eq + 1);
+	if (name == "sched") {
+		for(uint8_t i = 0; i < 2; i++) {
+			if (value == schedNames[i]) {
+				s[SETTINGS_SCHED_POLICY] = i;
+				return true;
+			}
+		}
+		return false;
+	}
+	char *end;
+	unsigned long n = strtoul(value.c_str(), &end, 0);
+	if (value.empty() || *end != '\0') return false;
+	if (name == "clock_khz") {
+		putLe32(&s[SETTINGS_CARD_CLOCK], n * 1000);
+	} else if (name == "prefetch") {
+		putLe16(&s[SETTINGS_PREFETCH_DEPTH], n);
+	} else if (name == "write_back") {
+		s[SETTINGS_WRITE_BACK] = n;
+	} else if (name == "batch") {
+		s[SETTINGS_BATCH_SECTORS] = n;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+int cmdTune(const std::vector<std::string> &args) {
+	if (args.empty()) {
+		usage();
+		return 1;
+	}
+	bool save = false, defaults = false;
+	std::vector<std::string> knobs;
+	for(size_t i = 1; i < args.size(); i++) {
+		if (args[i] == "--save") save = true;
+		else if (args[i] == "--defaults") defaults = true;
+		else knobs.push_back(args[i]);
+	}
+	if (defaults && !knobs.empty()) {
+		usage();
+		return 1;
+	}
+	ScsiDevice dev(args[0]);
+	if (openDevice(dev, args[0]) < 0) return 1;
+
+	std::string error;
+	std::vector<uint8_t> none;
+	if (defaults) {
+		if (!dev.command(vendorCdb(VENDOR_SETTINGS_DEFAULTS, save ? 1 : 0, 0), ScsiDevice::NONE, none, error)) {
+			std::cerr << args[0] << ": " << error << "\n";
+			return 1;
+		}
+	}
+	std::vector<uint8_t> s(SETTINGS_SIZE);
+	if (!dev.command(vendorCdb(VENDOR_SETTINGS_GET, 0, s.size()), ScsiDevice::IN, s, error)) {
+		std::cerr << args[0] << ": " << error << "\n";
+		return 1;
+	}
+	if (s.size() != SETTINGS_SIZE || le32(s.data()) != SETTINGS_MAGIC || le16(&s[4]) != SETTINGS_VERSION) {
+		std::cerr << args[0] << ": firmware has different settings than this program knows about\n";
+		return 1;
+	}
+	if (!knobs.empty() || (save && !defaults)) {
+		for(size_t i = 0; i < knobs.size(); i++) {
+			if (!setKnob(s, knobs[i])) {
+				std::cerr << "Don't understand " << knobs[i] << "\n";
+				return 1;
+			}
+		}
+		if (!dev.command(vendorCdb(VENDOR_SETTINGS_SET, save ? 1 : 0, s.size()), ScsiDevice::OUT, s, error)) {
+			// The firmware checks the ranges.
+			std::cerr << args[0] << ": " << error << "\n";
+			return 1;
+		}
+	}
+	printSettings(s);
+	return 0;
+}
+
+// Copy count sectors of a card, starting at first, to the same place in a file.
+bool copySectors(ScsiDevice &dev, int card, uint64_t first, uint64_t count, uint32_t per_read, std::fstream &out, std::string &error) {
+	std::vector<uint8_t> data;
+	out.seekp(first * 512);
+	for(uint64_t sector = first; sector < first + count; ) {
+		uint32_t n = (uint32_t)std::min<uint64_t>(per_read, first + count - sector);
+		data.resize(n * 512);
+		uint64_t arg = ((uint64_t)card << 32) | sector;
+		if (!dev.command(vendorCdb(VENDOR_RAW_READ, arg, data.size()), ScsiDevice::IN, data, error)) return false;
+		if (data.size() != n * 512) {
+			error = "short read";
+			return false;
+		}
+		out.write(reinterpret_cast<const char *>(data.data()), data.size());
+		if (!out) {
+			error = strerror(errno);
+			return false;
+		}
+		sector += n;
+	}
+	return true;
+}
+
+struct CbtMap {
+	uint32_t regionBlocks;
+	uint32_t regions;
+	uint32_t blockSize;
+	uint32_t flags;
+	std::vector<uint8_t> bits;
+
+	bool changed(uint32_t region) const { return bits[region / 8] & (1 << (region % 8)); }
+};
+
+bool readCbt(ScsiDevice &dev, bool snapshot, CbtMap &map, std::string &error) {
+	std::vector<uint8_t> data(CBT_INFO_SIZE + CBT_MAX_BYTES);
+	if (!dev.command(vendorCdb(VENDOR_CBT_GET, snapshot ? 1 : 0, data.size()), ScsiDevice::IN, data, error)) return false;
+	if (data.size() < CBT_INFO_SIZE) {
+		error = "bad changed block map";
+		return false;
+	}
+	map.regionBlocks = le32(&data[CBT_INFO_REGION_BLOCKS]);
+	map.regions = le32(&data[CBT_INFO_REGIONS]);
+	map.blockSize = le32(&data[CBT_INFO_BLOCK_SIZE]);
+	map.flags = le32(&data[CBT_INFO_FLAGS]);
+	if (map.regionBlocks < 2 || map.blockSize < 512 || data.size() < CBT_INFO_SIZE + (map.regions + 7) / 8) {
+		error = "bad changed block map";
+		return false;
+	}
+	map.bits.assign(data.begin() + CBT_INFO_SIZE, data.begin() + CBT_INFO_SIZE + (map.regions + 7) / 8);
+	return true;
+}
+
+// The sectors a region covers on each card. Volume blocks alternate between the
+// cards, and the first block's worth of sectors on each card is the keyblock -
+// region 0 takes that along too.
+void regionSectors(const CbtMap &map, uint32_t region, uint64_t card_sectors, uint64_t &first, uint64_t &count) {
+	uint64_t spb = map.blockSize / 512;
+	uint64_t per_card = map.regionBlocks / 2;
+	first = region == 0 ? 0 : (region * per_card + 1) * spb;
+	uint64_t end = ((region + 1) * per_card + 1) * spb;
+	if (end > card_sectors) end = card_sectors;
+	count = end > first ? end - first : 0;
+}
+
+int cmdBackup(const std::vector<std::string> &args) {
+	if (args.size() < 3 || args.size() > 4 || (args.size() == 4 && args[3] != "--incremental")) {
+		usage();
+		return 1;
+	}
+	bool incremental = args.size() == 4;
+	ScsiDevice dev(args[0]);
+	if (openDevice(dev, args[0]) < 0) return 1;
+
+	// An incremental backup goes over the top of the last one, so the images
+	// have to be there already. A full one truncates them, but not until the
+	// raw session is open - a denied or timed out open mustn't cost the
+	// last backup.
+	std::fstream images[2];
+	if (incremental) {
+		for(int card = 0; card < 2; card++) {
+			images[card].open(args[1 + card], std::ios::binary | std::ios::in | std::ios::out);
+			if (!images[card]) {
+				std::cerr << args[1 + card] << ": " << strerror(errno) << "\n";
+				return 1;
+			}
+		}
+	}
+
+	std::vector<uint8_t> info(RAW_INFO_SIZE);
+	std::string error;
+	std::cerr << "Press the button on the Orthrus to allow the backup...\n";
+	if (!dev.command(vendorCdb(VENDOR_RAW_OPEN, 0, info.size()), ScsiDevice::IN, info, error)) {
+		std::cerr << args[0] << ": " << error << "\n";
+		return 1;
+	}
+	if (info.size() != RAW_INFO_SIZE) {
+		std::cerr << args[0] << ": bad raw info\n";
+		return 1;
+	}
+	uint32_t per_read = le32(&info[RAW_INFO_MAX_SECTORS]);
+	uint64_t card_sectors[2] = { le64(&info[RAW_INFO_CARD_SECTORS]), le64(&info[RAW_INFO_CARD_SECTORS + 8]) };
+	bool ok = per_read > 0;
+	if (!ok) error = "bad raw info";
+	for(int card = 0; ok && !incremental && card < 2; card++) {
+		images[card].open(args[1 + card], std::ios::binary | std::ios::out | std::ios::trunc);
+		if (!images[card]) {
+			error = args[1 + card] + ": " + strerror(errno);
+			ok = false;
+		}
+	}
+
+	CbtMap map;
+	if (ok && incremental) {
+		ok = readCbt(dev, true, map, error);
+		uint32_t changed = 0;
+		for(uint32_t r = 0; ok && r < map.regions; r++) {
+			if (!map.changed(r)) continue;
+			for(int card = 0; ok && card < 2; card++) {
+				uint64_t first, count;
+				regionSectors(map, r, card_sectors[card], first, count);
+				ok = copySectors(dev, card, first, count, per_read, images[card], error);
+			}
+			changed++;
+			if (changed % 64 == 0) fprintf(stderr, "\r%u regions copied", changed);
+		}
+		if (ok) fprintf(stderr, "\r%u of %u regions had changed\n", changed, map.regions);
+	} else {
+		for(int card = 0; ok && card < 2; card++) {
+			// 256 MB at a time, so there's something to watch.
+			for(uint64_t sector = 0; ok && sector < card_sectors[card]; sector += 2048 * 256) {
+				uint64_t count = std::min<uint64_t>(2048 * 256, card_sectors[card] - sector);
+				ok = copySectors(dev, card, sector, count, per_read, images[card], error);
+				fprintf(stderr, "\rcard %c: %llu of %llu MB", card ? 'B' : 'A',
+					(unsigned long long)((sector + count) / 2048), (unsigned long long)(card_sectors[card] / 2048));
+			}
+			fprintf(stderr, "\n");
+		}
+	}
+	if (ok) {
+		for(int card = 0; card < 2; card++)
+			images[card].flush();
+		ok = images[0] && images[1];
+		if (!ok) error = strerror(errno);
+	}
+	// Only now is it safe to forget what changed. A full backup covers everything.
+	std::vector<uint8_t> none;
+	if (ok && !dev.command(vendorCdb(VENDOR_CBT_CLEAR, 0, 0), ScsiDevice::NONE, none, error)) {
+		if (incremental) ok = false;
+		else error.clear(); // it's fine if there's no volume to track
+	}
+	if (!ok) std::cerr << args[0] << ": " << error << "\n";
+	// Don't leave the session open, whatever happened.
+	std::string close_error;
+	if (!dev.command(vendorCdb(VENDOR_RAW_CLOSE, 0, 0), ScsiDevice::NONE, none, close_error))
+		std::cerr << args[0] << ": couldn't end the raw session: " << close_error << "\n";
+	return ok ? 0 : 1;
+}
+
+int cmdCbt(const std::vector<std::string> &args) {
+	bool snapshot = false, clear = false, bad = args.empty();
+	for(size_t i = 1; i < args.size(); i++) {
+		if (args[i] == "--snapshot") snapshot = true;
+		else if (args[i] == "--clear") clear = true;
+		else bad = true;
+	}
+	if (bad) {
+		usage();
+		return 1;
+	}
+	ScsiDevice dev(args[0]);
+	if (openDevice(dev, args[0]) < 0) return 1;
+
+	CbtMap map;
+	std::string error;
+	if (!readCbt(dev, snapshot, map, error)) {
+		std::cerr << args[0] << ": " << error << "\n";
+		return 1;
+	}
+	uint64_t region_bytes = (uint64_t)map.regionBlocks * map.blockSize;
+	uint32_t changed = 0;
+	for(uint32_t r = 0; r < map.regions; r++)
+		if (map.changed(r)) changed++;
+	printf("%u regions of %llu KB, %u changed%s\n", map.regions, (unsigned long long)(region_bytes / 1024), changed,
+		(map.flags & CBT_FLAG_PERSISTENT) ? "" : " (not kept across mounts - old volume format)");
+	// Runs of changed regions, as byte ranges of the volume.
+	for(uint32_t r = 0; r < map.regions; ) {
+		if (!map.changed(r)) {
+			r++;
+			continue;
+		}
+		uint32_t end = r;
+		while(end < map.regions && map.changed(end)) end++;
+		printf("  %12llu - %12llu\n", (unsigned long long)(r * region_bytes), (unsigned long long)(end * region_bytes - 1));
+		r = end;
+	}
+	if (clear) {
+		std::vector<uint8_t> none;
+		if (!dev.command(vendorCdb(VENDOR_CBT_CLEAR, 0, 0), ScsiDevice::NONE, none, error)) {
+			std::cerr << args[0] << ": " << error << "\n";
+			return 1;
+		}
+	}
+	return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+	std::map<std::string, Command> commands = {
+		{ "info", cmdInfo },
+		{ "trace-dump", cmdTraceDump },
+		{ "trace-json", cmdTraceJson },
+		{ "stats", cmdStats },
+		{ "bench", cmdBench },
+		{ "tune", cmdTune },
+		{ "backup", cmdBackup },
+		{ "cbt", cmdCbt },
+	};
+	if (argc < 2 || commands.find(argv[1]) == commands.end()) {
+		usage();
+		return 1;
+	}
+	std::vector<std::string> args(argv + 2, argv + argc);
+	return commands[argv[1]](args);
+}
@@ -0,0 +1,492 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// orthrusnbd - serve the decrypted volume from images of its two cards as a
+// read-only NBD export on a Unix socket, so it can be mounted and the few
+// files that are wanted copied off, without decrypting the rest.
+//
+//   orthrusnbd cardA.img cardB.img /tmp/orthrus.sock &
+//   nbd-client -unix /tmp/orthrus.sock /dev/nbd0 -readonly
+//   mount -o ro /dev/nbd0p1 /mnt
+
+#include "extentcache.h"
+#include "volume.h"
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <poll.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+// The NBD protocol (the "fixed newstyle" handshake and simple replies). See
+// https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md
+const uint64_t NBD_MAGIC = 0x4e42444d41474943ULL; // "NBDMAGIC"
+const uint64_t NBD_OPTS_MAGIC = 0x49484156454f5054ULL; // "IHAVEOPT"
+const uint64_t NBD_REP_MAGIC = 0x0003e889045565a9ULL;
+const uint32_t NBD_REQUEST_MAGIC = 0x25609513;
+const uint32_t NBD_SIMPLE_REPLY_MAGIC = 0x67446698;
+
+const uint16_t NBD_FLAG_FIXED_NEWSTYLE = 1 << 0;
+const uint16_t NBD_FLAG_NO_ZEROES = 1 << 1;
+
+const uint16_t NBD_FLAG_HAS_FLAGS = 1 << 0;
+const uint16_t NBD_FLAG_READ_ONLY = 1 << 1;
+const uint16_t NBD_FLAG_CAN_MULTI_CONN = 1 << 8;
+
+const uint32_t NBD_OPT_EXPORT_NAME = 1;
+const uint32_t NBD_OPT_ABORT = 2;
+const uint32_t NBD_OPT_LIST = 3;
+const uint32_t NBD_OPT_INFO = 6;
+const uint32_t NBD_OPT_GO = 7;
+
+const uint32_t NBD_REP_ACK = 1;
+const uint32_t NBD_REP_SERVER = 2;
+const uint32_t NBD_REP_INFO = 3;
+const uint32_t NBD_REP_ERR_UNSUP = 0x80000001;
+const uint32_t NBD_REP_ERR_INVALID = 0x80000003;
+
+const uint16_t NBD_INFO_EXPORT = 0;
+const uint16_t NBD_INFO_BLOCK_SIZE = 3;
+
+const uint16_t NBD_CMD_READ = 0;
+const uint16_t NBD_CMD_WRITE = 1;
+const uint16_t NBD_CMD_DISC = 2;
+const uint16_t NBD_CMD_FLUSH = 3;
+
+// The most one read can ask for (what the spec suggests as a limit).
+const uint32_t MAX_READ = 32 * 1024 * 1024;
+// Options longer than this are nonsense, as far as this export goes.
+const uint32_t MAX_OPTION = 4096;
+
+// Read-ahead, in extents: where a sequential run starts, and how far it can grow.
+const unsigned READ_AHEAD_MIN = 4;
+const unsigned READ_AHEAD_MAX = 64;
+
+volatile sig_atomic_t stopping;
+
+void onSignal(int) {
+	stopping = 1;
+}
+
+void usage() {
+	std::cerr <<
+		"Usage: orthrusnbd [-j threads] [-c cache MB] <image 1> <image 2> <socket>\n"
+		"  Serves the decrypted volume, read-only, over NBD on a Unix socket - e.g.\n"
+		"  nbd-client -unix <socket> /dev/nbd0 -readonly\n";
+}
+
+void putBe(uint8_t *p, uint64_t v, int bytes) {
+	for(int i = bytes - 1; i >= 0; i--, v >>= 8) p[i] = (uint8_t)v;
+}
+
+uint64_t getBe(const uint8_t *p, int bytes) {
+	uint64_t v = 0;
+	for(int i = 0; i < bytes; i++) v = (v << 8) | p[i];
+	return v;
+}
+
+bool readAll(int fd, void *buf, size_t len) {
+	uint8_t *p = static_cast<uint8_t *>(buf);
+	while(len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool writeAll(int fd, const void *buf, size_t len) {
+	const uint8_t *p = static_cast<const uint8_t *>(buf);
+	while(len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/*
+ * The workers. Reads the client is waiting on always go ahead of read-ahead,
+ * so a burst of read-ahead never holds up the next request.
+ */
+class WorkQueue {
+public:
+	explicit WorkQueue(unsigned threads) : done(false) {
+		for(unsigned i = 0; i < threads; i++)
+			workers.emplace_back(&WorkQueue::run, this);
+	}
+
+	~WorkQueue() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			done = true;
+		}
+		ready.notify_all();
+		for(auto &t : workers) t.join();
+	}
+
+	void push(std::function<void()> job, bool urgent) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			(urgent ? requests : readAhead).push_back(std::move(job));
+		}
+		ready.notify_one();
+	}
+
+private:
+	void run() {
+		for(;;) {
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				ready.wait(guard, [this] { return done || !requests.empty() || !readAhead.empty(); });
+				if (done) return;
+				std::deque<std::function<void()>> &from = requests.empty() ? readAhead : requests;
+				job = std::move(from.front());
+				from.pop_front();
+			}
+			job();
+		}
+	}
+
+	std::mutex lock;
+	std::condition_variable ready;
+	std::deque<std::function<void()>> requests, readAhead;
+	std::vector<std::thread> workers;
+	bool done;
+};
+
+struct Server {
+	const Volume *volume;
+	ExtentCache *cache;
+	WorkQueue *work;
+};
+
+/*
+ * One client. The connection's thread does the handshake and reads the
+ * requests, and the workers answer them - in whatever order they finish,
+ * which NBD allows. The last one out closes the socket.
+ */
+class Connection {
+public:
+	Connection(const Server &server, int fd) : server(server), fd(fd), noZeroes(false),
+		nextOffset(UINT64_MAX), window(0), readAheadTo(0) {
+	}
+
+	~Connection() {
+		close(fd);
+	}
+
+	// The handshake. Returns true once the client is ready for requests.
+	bool negotiate();
+	// Take requests until the client is done.
+	void serve(const std::shared_ptr<Connection> &self);
+
+private:
+	bool optionReply(uint32_t option, uint32_t type, const uint8_t *data, uint32_t length);
+	bool infoReplies(uint32_t option, const std::vector<uint8_t> &data, bool &valid);
+	bool reply(uint64_t handle, uint32_t error, const uint8_t *data, uint32_t length);
+	void readAhead(uint64_t offset, uint32_t length);
+
+	const Server &server;
+	int fd;
+	bool noZeroes;
+	std::mutex sendLock;
+
+	// Read-ahead state, only touched by the connection's thread.
+	uint64_t nextOffset; // where the next read starts if it's sequential
+	unsigned window; // extents to keep ahead of a sequential reader
+	uint64_t readAheadTo; // extents before this have been asked for
+};
+
+bool Connection::optionReply(uint32_t option, uint32_t type, const uint8_t *data, uint32_t length) {
+	uint8_t header[20];
+	putBe(header, NBD_REP_MAGIC, 8);
+	putBe(header + 8, option, 4);
+	putBe(header + 12, type, 4);
+	putBe(header + 16, length, 4);
+	std::lock_guard<std::mutex> guard(sendLock);
+	return writeAll(fd, header, sizeof(header)) && (length == 0 || writeAll(fd, data, length));
+}
+
+uint16_t transmissionFlags() {
+	return NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY | NBD_FLAG_CAN_MULTI_CONN;
+}
+
+// NBD_OPT_INFO and NBD_OPT_GO: the export's size and flags, and its block sizes if asked.
+bool Connection::infoReplies(uint32_t option, const std::vector<uint8_t> &data, bool &valid) {
+	valid = false;
+	if (data.size() < 6) return optionReply(option, NBD_REP_ERR_INVALID, nullptr, 0);
+	uint32_t nameLength = getBe(data.data(), 4);
+	if (data.size() < 4 + (size_t)nameLength + 2) return optionReply(option, NBD_REP_ERR_INVALID, nullptr, 0);
+	uint16_t requests = getBe(data.data() + 4 + nameLength, 2);
+	if (data.size() != 4 + (size_t)nameLength + 2 + 2 * requests) return optionReply(option, NBD_REP_ERR_INVALID, nullptr, 0);
+	valid = true;
+	// There's only one export, so whatever it's called, that's it.
+	uint8_t info[14];
+	putBe(info, NBD_INFO_EXPORT, 2);
+	putBe(info + 2, server.volume->bytes(), 8);
+	putBe(info + 10, transmissionFlags(), 2);
+	if (!optionReply(option, NBD_REP_INFO, info, 12)) return false;
+	for(uint16_t i = 0; i < requests; i++) {
+		if (getBe(data.data() + 4 + nameLength + 2 + 2 * i, 2) != NBD_INFO_BLOCK_SIZE) continue;
+		// Any byte range can be read, but whole volume blocks are what's cheap.
+		uint8_t sizes[14];
+		putBe(sizes, NBD_INFO_BLOCK_SIZE, 2);
+		putBe(sizes + 2, 1, 4);
+		putBe(sizes + 6, server.volume->blockSize(), 4);
+		putBe(sizes + 10, MAX_READ, 4);
+		if (!optionReply(option, NBD_REP_INFO, sizes, sizeof(sizes))) return false;
+	}
+	return optionReply(option, NBD_REP_ACK, nullptr, 0);
+}
+
+bool Connection::negotiate() {
+	uint8_t hello[18];
+	putBe(hello, NBD_MAGIC, 8);
+	putBe(hello + 8, NBD_OPTS_MAGIC, 8);
+	putBe(hello + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES, 2);
+	if (!writeAll(fd, hello, sizeof(hello))) return false;
+	uint8_t clientFlags[4];
+	if (!readAll(fd, clientFlags, sizeof(clientFlags))) return false;
+	noZeroes = (getBe(clientFlags, 4) & NBD_FLAG_NO_ZEROES) != 0;
+
+	for(;;) {
+		uint8_t header[16];
+		if (!readAll(fd, header, sizeof(header))) return false;
+		if (getBe(header, 8) != NBD_OPTS_MAGIC) return false;
+		uint32_t option = getBe(header + 8, 4);
+		uint32_t length = getBe(header + 12, 4);
+		if (length > MAX_OPTION) return false;
+		std::vector<uint8_t> data(length);
+		if (length > 0 && !readAll(fd, data.data(), length)) return false;
+
+		switch(option) {
+			case NBD_OPT_EXPORT_NAME: {
+				// The old way in: no reply header, and no way to say no.
+				uint8_t info[10 + 124] = { 0 };
+				putBe(info, server.volume->bytes(), 8);
+				putBe(info + 8, transmissionFlags(), 2);
+				return writeAll(fd, info, noZeroes ? 10 : sizeof(info));
+			}
+			case NBD_OPT_GO:
+			case NBD_OPT_INFO: {
+				bool valid;
+				if (!infoReplies(option, data, valid)) return false;
+				if (option == NBD_OPT_GO && valid) return true;
+				break;
+			}
+			case NBD_OPT_LIST: {
+				// One export, with an empty name.
+				uint8_t entry[4] = { 0 };
+				if (!optionReply(option, NBD_REP_SERVER, entry, sizeof(entry))) return false;
+				if (!optionReply(option, NBD_REP_ACK, nullptr, 0)) return false;
+				break;
+			}
+			case NBD_OPT_ABORT:
+				optionReply(option, NBD_REP_ACK, nullptr, 0);
+				return false;
+			default:
+				// Including structured replies - simple ones will do.
+				if (!optionReply(option, NBD_REP_ERR_UNSUP, nullptr, 0)) return false;
+				break;
+		}
+	}
+}
+
+bool Connection::reply(uint64_t handle, uint32_t error, const uint8_t *data, uint32_t length) {
+	uint8_t header[16];
+	putBe(header, NBD_SIMPLE_REPLY_MAGIC, 4);
+	putBe(header + 4, error, 4);
+	putBe(header + 8, handle, 8);
+	std::lock_guard<std::mutex> guard(sendLock);
+	return writeAll(fd, header, sizeof(header)) && (length == 0 || writeAll(fd, data, length));
+}
+
+/*
+ * Keep window extents decrypted ahead of a sequential reader. The window
+ * starts small and doubles as long as the reads stay sequential, and any
+ * read somewhere else starts it over.
+ */
+void Connection::readAhead(uint64_t offset, uint32_t length) {
+	ExtentCache &cache = *server.cache;
+	// Much more than this and it would push out what it read ahead before it's wanted.
+	unsigned most = std::max((unsigned)1, std::min(READ_AHEAD_MAX, (unsigned)(cache.capacityExtents() / 4)));
+	if (offset == nextOffset) {
+		window = std::min(window ? window * 2 : READ_AHEAD_MIN, most);
+	} else {
+		window = 0;
+		readAheadTo = 0;
+	}
+	nextOffset = offset + length;
+	if (window == 0) return;
+	uint64_t from = std::max(readAheadTo, cache.extentOf(nextOffset + ExtentCache::EXTENT_BYTES - 1));
+	uint64_t to = std::min(cache.extentOf(nextOffset) + 1 + window, cache.extents());
+	for(uint64_t extent = from; extent < to; extent++)
+		server.work->push([&cache, extent] { cache.prefetch(extent); }, false);
+	readAheadTo = std::max(readAheadTo, to);
+}
+
+void Connection::serve(const std::shared_ptr<Connection> &self) {
+	for(;;) {
+		uint8_t request[28];
+		if (!readAll(fd, request, sizeof(request))) return;
+		if (getBe(request, 4) != NBD_REQUEST_MAGIC) return;
+		uint16_t type = getBe(request + 6, 2);
+		uint64_t handle = getBe(request + 8, 8);
+		uint64_t offset = getBe(request + 16, 8);
+		uint32_t length = getBe(request + 24, 4);
+
+		switch(type) {
+			case NBD_CMD_READ:
+				if (length > MAX_READ || offset > server.volume->bytes() || length > server.volume->bytes() - offset) {
+					if (!reply(handle, EINVAL, nullptr, 0)) return;
+					break;
+				}
+				server.work->push([self, handle, offset, length] {
+					std::vector<uint8_t> buf(length);
+					self->server.cache->read(offset, length, buf.data());
+					self->reply(handle, 0, buf.data(), length);
+					memset(buf.data(), 0, length);
+				}, true);
+				readAhead(offset, length);
+				break;
+			case NBD_CMD_DISC:
+				// The workers still have the connection until they've answered.
+				return;
+			case NBD_CMD_FLUSH:
+				if (!reply(handle, 0, nullptr, 0)) return;
+				break;
+			default:
+				// Writes, trims and the rest. The data of a write still has to be got out of the way.
+				if (type == NBD_CMD_WRITE) {
+					std::vector<uint8_t> discard(std::min(length, MAX_READ));
+					for(uint32_t left = length; left > 0; ) {
+						uint32_t n = std::min(left, (uint32_t)discard.size());
+						if (!readAll(fd, discard.data(), n)) return;
+						left -= n;
+					}
+					if (!reply(handle, EPERM, nullptr, 0)) return;
+				} else if (!reply(handle, EINVAL, nullptr, 0)) {
+					return;
+				}
+				break;
+		}
+	}
+}
+
+void handle(const Server &server, int fd) {
+	auto connection = std::make_shared<Connection>(server, fd);
+	if (connection->negotiate()) connection->serve(connection);
+	shutdown(fd, SHUT_RD);
+}
+
+}
+
+int main(int argc, char **argv) {
+	unsigned threads = std::thread::hardware_concurrency();
+	size_t cacheMB = 256;
+	int opt;
+	while((opt = getopt(argc, argv, "j:c:")) != -1) {
+		switch(opt) {
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'c':
+				cacheMB = atoi(optarg);
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if (argc - optind != 3 || threads == 0) {
+		usage();
+		return 1;
+	}
+
+	Volume volume;
+	std::string error;
+	if (!volume.open(argv[optind], argv[optind + 1], error)) {
+		std::cerr << error << "\n";
+		return 1;
+	}
+	volume.advise(MADV_RANDOM); // the read-ahead here knows better
+
+	const char *path = argv[optind + 2];
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		std::cerr << path << ": too long for a socket path\n";
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listener, 8) != 0) {
+		perror(path);
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onSignal;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "%s volume: %llu blocks of %u bytes (XEX kernel %s), serving on %s\n", volume.legacy() ? "V02" : "V03",
+		(unsigned long long)volume.blocks(), (unsigned)volume.blockSize(), xexKernel(), path);
+
+	ExtentCache cache(volume, cacheMB * 1024 * 1024);
+	WorkQueue work(threads);
+	Server server = { &volume, &cache, &work };
+	while(!stopping) {
+		struct pollfd pfd = { listener, POLLIN, 0 };
+		if (poll(&pfd, 1, 500) <= 0) continue;
+		int fd = accept(listener, nullptr, nullptr);
+		if (fd < 0) continue;
+		std::thread(handle, std::cref(server), fd).detach();
+	}
+	ExtentCache::Stats stats = cache.stats();
+	fprintf(stderr, "cache: %llu hits, %llu misses, %llu extents read ahead\n", (unsigned long long)stats.hits,
+		(unsigned long long)stats.misses, (unsigned long long)stats.prefetched);
+	close(listener);
+	unlink(path);
+	// Any connections still open have the server in use, so they just go with the process.
+	_exit(0);
+}
@@ -0,0 +1,425 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// orthrusrecover - decrypt an Orthrus volume from images of its two cards
+// (orthrusctl backup makes them, or dd them from a card reader). This is
+// OrthrusDecrypt.java, only fast enough for a card of any size.
+//
+// Progress is checkpointed to <output>.progress as it goes, so a run that's
+// stopped (^C is fine) picks up where it left off when it's run again. A
+// regular output file is sparse: the parts that decrypt to all zeroes are
+// left as holes rather than written.
+
+#include "volume.h"
+
+#include <atomic>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+// Each worker decrypts this much at a time, then writes it out. It's also
+// what the checkpoint keeps track of.
+const uint64_t CHUNK_BYTES = 4 * 1024 * 1024;
+
+// Holes come in filesystem blocks, so this is what has to be all zeroes to be left out.
+const size_t SPARSE_BYTES = 4096;
+
+// How often the checkpoint is brought up to date.
+const auto CHECKPOINT_INTERVAL = std::chrono::seconds(5);
+
+volatile sig_atomic_t stopping;
+
+void onSignal(int) {
+	stopping = 1;
+}
+
+void usage() {
+	std::cerr <<
+		"Usage: orthrusrecover [-j threads] <image 1> <image 2> <output>\n"
+		"  The images can be in either order. The output is the decrypted volume.\n"
+		"  If it's stopped, running it again the same way carries on from\n"
+		"  <output>.progress.\n";
+}
+
+bool writeAll(int fd, const uint8_t *buf, size_t len, uint64_t offset) {
+	while(len > 0) {
+		ssize_t n = pwrite(fd, buf, len, offset);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+bool isZero(const uint8_t *p, size_t len) {
+	const uint64_t *w = reinterpret_cast<const uint64_t *>(p);
+	uint64_t any = 0;
+	for(size_t i = 0; i < len / sizeof(uint64_t); i++) any |= w[i];
+	return any == 0;
+}
+
+void putLe(uint8_t *p, uint64_t v, int bytes) {
+	for(int i = 0; i < bytes; i++, v >>= 8) p[i] = (uint8_t)v;
+}
+
+/*
+ * Which chunks are safely in the output. The sidecar file is a header and
+ * then a bitmap, bit c (bit c % 8 of byte c / 8) for chunk c:
+ * 0x00-0x0f: magic
+ * 0x10-0x4f: volume ID (not secret - it's on both cards as is)
+ * 0x50-0x57: volume blocks, little-endian
+ * 0x58-0x5b: volume block size
+ * 0x5c-0x5f: chunk size
+ * 0x60-0x63: 1 if the output is sparse
+ * It's only ever replaced whole (write, then rename), after the output has
+ * been synced - so whatever it says is done really is.
+ */
+class Checkpoint {
+public:
+	static const size_t HEADER_SIZE = 0x64;
+
+	Checkpoint(const Volume &volume, uint64_t chunks, bool sparse, const std::string &path) :
+		volume(volume), chunks(chunks), sparse(sparse), path(path), bits((chunks + 7) / 8), doneCount(0) {
+	}
+
+	// Load a checkpoint for this volume. Returns false with an empty error if
+	// there isn't one, or with an error if there's one for something else.
+	bool load(std::string &error);
+	// Write out what's done so far. The output must already be synced.
+	bool save(const std::vector<uint8_t> &snapshot, std::string &error);
+	bool remove() { return unlink(path.c_str()) == 0 || errno == ENOENT; }
+
+	bool done(uint64_t chunk) {
+		std::lock_guard<std::mutex> guard(lock);
+		return (bits[chunk / 8] >> (chunk % 8)) & 1;
+	}
+	void markDone(uint64_t chunk) {
+		std::lock_guard<std::mutex> guard(lock);
+		bits[chunk / 8] |= 1 << (chunk % 8);
+		doneCount++;
+	}
+	std::vector<uint8_t> snapshot() {
+		std::lock_guard<std::mutex> guard(lock);
+		return bits;
+	}
+	uint64_t completed() {
+		std::lock_guard<std::mutex> guard(lock);
+		return doneCount;
+	}
+
+private:
+	void header(uint8_t *h) const;
+
+	const Volume &volume;
+	uint64_t chunks;
+	bool sparse;
+	std::string path;
+	std::mutex lock;
+	std::vector<uint8_t> bits;
+	uint64_t doneCount;
+};
+
+const char CHECKPOINT_MAGIC[] = "OrthrusRecover01";
+
+void Checkpoint::header(uint8_t *h) const {
+	memset(h, 0, HEADER_SIZE);
+	memcpy(h, CHECKPOINT_MAGIC, 16);
+	memcpy(h + 0x10, volume.volumeId(), 64);
+	putLe(h + 0x50, volume.blocks(), 8);
+	putLe(h + 0x58, volume.blockSize(), 4);
+	putLe(h + 0x5c, CHUNK_BYTES, 4);
+	putLe(h + 0x60, sparse ? 1 : 0, 4);
+}
+
+bool Checkpoint::load(std::string &error) {
+	error.clear();
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == nullptr) {
+		if (errno != ENOENT) error = path + ": " + strerror(errno);
+		return false;
+	}
+	uint8_t want[HEADER_SIZE], got[HEADER_SIZE];
+	header(want);
+	std::vector<uint8_t> loaded(bits.size());
+	bool ok = fread(got, 1, sizeof(got), f) == sizeof(got) && fread(loaded.data(), 1, loaded.size(), f) == loaded.size();
+	fclose(f);
+	if (!ok || memcmp(got, CHECKPOINT_MAGIC, 16)) {
+		error = path + ": not a checkpoint (remove it to start over)";
+		return false;
+	}
+	if (memcmp(got, want, HEADER_SIZE)) {
+		error = path + ": that's for some other volume (or recovery) - remove it to start over";
+		return false;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	bits = loaded;
+	doneCount = 0;
+	for(uint64_t c = 0; c < chunks; c++) doneCount += (bits[c / 8] >> (c % 8)) & 1;
+	return true;
+}
+
+bool Checkpoint::save(const std::vector<uint8_t> &snapshot, std::string &error) {
+	std::string temp = path + ".tmp";
+	int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) goto err;
+	{
+		uint8_t h[HEADER_SIZE];
+		header(h);
+		bool ok = writeAll(fd, h, sizeof(h), 0) && writeAll(fd, snapshot.data(), snapshot.size(), sizeof(h)) && fsync(fd) == 0;
+		if (close(fd) != 0) ok = false;
+		if (ok && rename(temp.c_str(), path.c_str()) == 0) return true;
+	}
+err:
+	error = temp + ": " + strerror(errno);
+	return false;
+}
+
+struct Job {
+	const Volume *volume;
+	Checkpoint *checkpoint;
+	int out;
+	bool sparse;
+	uint64_t chunkBlocks;
+	uint64_t chunks;
+	std::atomic<uint64_t> next;
+	std::atomic<uint64_t> bytesWritten;
+	std::atomic<uint64_t> bytesSkipped;
+	std::atomic<bool> failed;
+	int error;
+};
+
+// Write a decrypted chunk, leaving out any all-zero filesystem blocks if the output is sparse.
+bool writeChunk(const Job &job, const uint8_t *buf, size_t length, uint64_t offset, uint64_t &skipped) {
+	skipped = 0;
+	if (!job.sparse) return writeAll(job.out, buf, length, offset);
+	size_t pos = 0;
+	while(pos < length) {
+		size_t n = std::min(SPARSE_BYTES, length - pos);
+		if (isZero(buf + pos, n)) {
+			skipped += n;
+			pos += n;
+			continue;
+		}
+		// Write everything up to the next zero block in one go.
+		size_t end = pos + n;
+		while(end < length) {
+			size_t m = std::min(SPARSE_BYTES, length - end);
+			if (isZero(buf + end, m)) break;
+			end += m;
+		}
+		if (!writeAll(job.out, buf + pos, end - pos, offset + pos)) return false;
+		pos = end;
+	}
+	return true;
+}
+
+void worker(Job *job) {
+	const Volume &volume = *job->volume;
+	uint8_t *buf = static_cast<uint8_t *>(aligned_alloc(4096, job->chunkBlocks * volume.blockSize()));
+	if (buf == nullptr) {
+		job->error = ENOMEM;
+		job->failed = true;
+		return;
+	}
+	while(!job->failed && !stopping) {
+		uint64_t chunk = job->next++;
+		if (chunk >= job->chunks) break;
+		if (job->checkpoint->done(chunk)) continue;
+		uint64_t first = chunk * job->chunkBlocks;
+		uint64_t count = std::min(job->chunkBlocks, volume.blocks() - first);
+		size_t length = count * volume.blockSize();
+		volume.decrypt(first, count, buf);
+		uint64_t skipped;
+		if (!writeChunk(*job, buf, length, first * volume.blockSize(), skipped)) {
+			job->error = errno;
+			job->failed = true;
+			break;
+		}
+		job->bytesWritten += length - skipped;
+		job->bytesSkipped += skipped;
+		job->checkpoint->markDone(chunk);
+	}
+	memset(buf, 0, job->chunkBlocks * volume.blockSize());
+	free(buf);
+}
+
+// Sync the output, then record what's in it.
+bool checkpointNow(Job &job, const char *outPath) {
+	std::vector<uint8_t> snapshot = job.checkpoint->snapshot();
+	if (fdatasync(job.out) != 0) {
+		perror(outPath);
+		return false;
+	}
+	std::string error;
+	if (!job.checkpoint->save(snapshot, error)) {
+		std::cerr << error << "\n";
+		return false;
+	}
+	return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+	unsigned threads = std::thread::hardware_concurrency();
+	int opt;
+	while((opt = getopt(argc, argv, "j:")) != -1) {
+		switch(opt) {
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if (argc - optind != 3 || threads == 0) {
+		usage();
+		return 1;
+	}
+
+	Volume volume;
+	std::string error;
+	if (!volume.open(argv[optind], argv[optind + 1], error)) {
+		std::cerr << error << "\n";
+		return 1;
+	}
+	volume.advise(MADV_SEQUENTIAL);
+	fprintf(stderr, "%s volume: %llu blocks of %u bytes (XEX kernel %s)\n", volume.legacy() ? "V02" : "V03",
+		(unsigned long long)volume.blocks(), (unsigned)volume.blockSize(), xexKernel());
+
+	const char *outPath = argv[optind + 2];
+	int out = open(outPath, O_WRONLY | O_CREAT, 0600);
+	struct stat st;
+	if (out < 0 || fstat(out, &st) != 0) {
+		perror(outPath);
+		return 1;
+	}
+	// Holes only read back as zeroes in a file - a block device has whatever was there before.
+	bool sparse = S_ISREG(st.st_mode);
+
+	Job job;
+	job.volume = &volume;
+	job.out = out;
+	job.sparse = sparse;
+	job.chunkBlocks = CHUNK_BYTES / volume.blockSize();
+	job.chunks = (volume.blocks() + job.chunkBlocks - 1) / job.chunkBlocks;
+	job.next = 0;
+	job.bytesWritten = 0;
+	job.bytesSkipped = 0;
+	job.failed = false;
+	job.error = 0;
+
+	Checkpoint checkpoint(volume, job.chunks, sparse, std::string(outPath) + ".progress");
+	job.checkpoint = &checkpoint;
+	bool resuming = checkpoint.load(error);
+	if (!error.empty()) {
+		std::cerr << error << "\n";
+		return 1;
+	}
+	if (resuming) {
+		fprintf(stderr, "resuming: %llu of %llu chunks already done\n", (unsigned long long)checkpoint.completed(),
+			(unsigned long long)job.chunks);
+	} else if (sparse) {
+		// Start from nothing, so everything that isn't written is a hole. (When resuming,
+		// the parts that aren't done are either holes or what was being written anyway.)
+		if (ftruncate(out, 0) != 0) {
+			perror(outPath);
+			return 1;
+		}
+	}
+	if (sparse && ftruncate(out, volume.bytes()) != 0) {
+		perror(outPath);
+		return 1;
+	}
+	// There's now an output to resume, even if nothing's done yet.
+	if (!resuming && !checkpointNow(job, outPath)) return 1;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onSignal;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+
+	auto start = std::chrono::steady_clock::now();
+	auto lastCheckpoint = start;
+	uint64_t alreadyDone = checkpoint.completed();
+	std::vector<std::thread> workers;
+	for(unsigned i = 0; i < threads; i++)
+		workers.emplace_back(worker, &job);
+	uint64_t mb = volume.bytes() >> 20;
+	bool ok = true;
+	while(checkpoint.completed() < job.chunks && !job.failed && !stopping) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		fprintf(stderr, "\r%llu of %llu MB", (unsigned long long)std::min((checkpoint.completed() * CHUNK_BYTES) >> 20, mb),
+			(unsigned long long)mb);
+		if (std::chrono::steady_clock::now() - lastCheckpoint >= CHECKPOINT_INTERVAL) {
+			if (!checkpointNow(job, outPath)) {
+				ok = false;
+				stopping = 1;
+			}
+			lastCheckpoint = std::chrono::steady_clock::now();
+		}
+	}
+	for(auto &t : workers) t.join();
+	if (job.failed) {
+		fprintf(stderr, "\n%s: %s\n", outPath, strerror(job.error));
+		ok = false;
+	}
+	// Whatever got done, keep.
+	if (!checkpointNow(job, outPath)) ok = false;
+	if (!ok || checkpoint.completed() < job.chunks) {
+		if (ok) fprintf(stderr, "\nstopped - run it again to carry on\n");
+		close(out);
+		return 1;
+	}
+	if (close(out) != 0) {
+		perror(outPath);
+		return 1;
+	}
+	checkpoint.remove();
+
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	uint64_t doneMB = ((checkpoint.completed() - alreadyDone) * CHUNK_BYTES) >> 20;
+	fprintf(stderr, "\r%llu MB in %.1f s (%.0f MB/s)", (unsigned long long)std::min(doneMB, mb), secs,
+		secs > 0 ? std::min(doneMB, mb) / secs : 0.0);
+	if (sparse)
+		fprintf(stderr, ", %llu MB of it zeroes left as holes", (unsigned long long)(job.bytesSkipped >> 20));
+	fprintf(stderr, "\n");
+	return 0;
+}
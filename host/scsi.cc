@@ -0,0 +1,130 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "scsi.h"
+#include "vendor.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <scsi/sg.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// Long enough for the on-device benchmark and anything else that takes a while.
+static const unsigned int TIMEOUT_MS = 120000;
+
+ScsiDevice::ScsiDevice(const std::string &path) {
+	fd = open(path.c_str(), O_RDWR | O_NONBLOCK);
+}
+
+ScsiDevice::~ScsiDevice() {
+	if (fd >= 0) close(fd);
+}
+
+bool ScsiDevice::command(const std::vector<uint8_t> &cdb, Direction dir, std::vector<uint8_t> &data, std::string &error) {
+	uint8_t sense[32];
+	sg_io_hdr_t io;
+	memset(&io, 0, sizeof(io));
+	memset(sense, 0, sizeof(sense));
+	io.interface_id = 'S';
+	io.cmdp = const_cast<uint8_t *>(cdb.data());
+	io.cmd_len = cdb.size();
+	io.sbp = sense;
+	io.mx_sb_len = sizeof(sense);
+	io.timeout = TIMEOUT_MS;
+	switch(dir) {
+		case NONE:
+			io.dxfer_direction = SG_DXFER_NONE;
+			break;
+		case IN:
+			io.dxfer_direction = SG_DXFER_FROM_DEV;
+			break;
+		case OUT:
+			io.dxfer_direction = SG_DXFER_TO_DEV;
+			break;
+	}
+	if (dir != NONE) {
+		io.dxferp = data.data();
+		io.dxfer_len = data.size();
+	}
+	if (ioctl(fd, SG_IO, &io) < 0) {
+		error = std::string("SG_IO: ") + strerror(errno);
+		return false;
+	}
+	if (io.status != 0 || io.host_status != 0 || io.driver_status != 0) {
+		char buf[128];
+		if (io.sb_len_wr >= 14) {
+			snprintf(buf, sizeof(buf), "check condition: key %x asc %02x ascq %02x", sense[2] & 0xf, sense[12], sense[13]);
+		} else {
+			snprintf(buf, sizeof(buf), "failed: status %x host %x driver %x", io.status, io.host_status, io.driver_status);
+		}
+		error = buf;
+		return false;
+	}
+	if (dir == IN) data.resize(data.size() - io.resid);
+	return true;
+}
+
+std::vector<uint8_t> vendorCdb(uint8_t subcommand, uint64_t arg, uint32_t length) {
+	std::vector<uint8_t> cdb(16, 0);
+	cdb[0] = VENDOR_OPCODE;
+	cdb[1] = subcommand;
+	for(int i = 0; i < 8; i++)
+		cdb[2 + i] = (uint8_t)(arg >> (56 - 8 * i));
+	for(int i = 0; i < 4; i++)
+		cdb[10 + i] = (uint8_t)(length >> (24 - 8 * i));
+	return cdb;
+}
+
+std::vector<uint8_t> logSenseCdb(uint8_t page, uint16_t length) {
+	std::vector<uint8_t> cdb(10, 0);
+	cdb[0] = 0x4d;
+	cdb[2] = 0x40 | (page & 0x3f); // PC 01b - cumulative values
+	cdb[7] = length >> 8;
+	cdb[8] = length;
+	return cdb;
+}
+
+std::vector<uint8_t> logResetCdb() {
+	std::vector<uint8_t> cdb(10, 0);
+	cdb[0] = 0x4c;
+	cdb[1] = 0x02; // PCR
+	cdb[2] = 0x40;
+	return cdb;
+}
+
+std::vector<uint8_t> sendDiagnosticCdb(uint16_t length) {
+	std::vector<uint8_t> cdb(6, 0);
+	cdb[0] = 0x1d;
+	cdb[1] = 0x10; // PF
+	cdb[3] = length >> 8;
+	cdb[4] = length;
+	return cdb;
+}
+
+std::vector<uint8_t> receiveDiagnosticCdb(uint8_t page, uint16_t length) {
+	std::vector<uint8_t> cdb(6, 0);
+	cdb[0] = 0x1c;
+	cdb[1] = 0x01; // PCV
+	cdb[2] = page;
+	cdb[3] = length >> 8;
+	cdb[4] = length;
+	return cdb;
+}
@@ -0,0 +1,59 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef ORTHRUS_SCSI_H_
+#define ORTHRUS_SCSI_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Pass-through SCSI commands to an Orthrus with the Linux SG_IO ioctl.
+class ScsiDevice {
+public:
+	enum Direction { NONE, IN, OUT };
+
+	explicit ScsiDevice(const std::string &path);
+	~ScsiDevice();
+	ScsiDevice(const ScsiDevice &) = delete;
+	ScsiDevice &operator=(const ScsiDevice &) = delete;
+
+	bool isOpen() const { return fd >= 0; }
+
+	// Run a command. For IN, data is resized to what actually came back.
+	// Returns false (and sets error) on a transport failure or CHECK CONDITION.
+	bool command(const std::vector<uint8_t> &cdb, Direction dir, std::vector<uint8_t> &data, std::string &error);
+
+private:
+	int fd;
+};
+
+// The vendor command CDB (see Vendor.h in the firmware).
+std::vector<uint8_t> vendorCdb(uint8_t subcommand, uint64_t arg, uint32_t length);
+
+// LOG SENSE for the cumulative values of a page, and LOG SELECT with PCR set.
+std::vector<uint8_t> logSenseCdb(uint8_t page, uint16_t length);
+std::vector<uint8_t> logResetCdb();
+
+// SEND DIAGNOSTIC with PF set and a parameter list, and RECEIVE DIAGNOSTIC RESULTS.
+std::vector<uint8_t> sendDiagnosticCdb(uint16_t length);
+std::vector<uint8_t> receiveDiagnosticCdb(uint8_t page, uint16_t length);
+
+#endif
@@ -0,0 +1,193 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "trace.h"
+#include "vendor.h"
+
+#include <cstdio>
+
+static const size_t HEADER_SIZE = 16;
+static const size_t RECORD_SIZE = 8;
+
+bool decodeTrace(const std::vector<uint8_t> &dump, std::vector<TraceRecord> &records, unsigned int &mhz, std::string &error) {
+	if (dump.size() < HEADER_SIZE || le32(dump.data()) != TRACE_MAGIC) {
+		error = "not a trace dump";
+		return false;
+	}
+	if (le16(dump.data() + 4) != TRACE_VERSION) {
+		error = "unknown trace dump version";
+		return false;
+	}
+	mhz = le16(dump.data() + 6);
+	uint32_t count = le32(dump.data() + 8);
+	uint32_t next = le32(dump.data() + 12);
+	if (count == 0 || dump.size() < HEADER_SIZE + count * RECORD_SIZE) {
+		error = "trace dump is truncated";
+		return false;
+	}
+
+	// Until the ring wraps, the oldest record is the first one.
+	uint32_t first = (next > count) ? (next % count) : 0;
+	uint32_t used = (next > count) ? count : next;
+
+	records.clear();
+	uint64_t now = 1ULL << 32; // room for records that come out slightly out of order
+	uint32_t last = 0;
+	for(uint32_t i = 0; i < used; i++) {
+		const uint8_t *p = dump.data() + HEADER_SIZE + ((first + i) % count) * RECORD_SIZE;
+		TraceRecord rec;
+		uint32_t cycles = le32(p);
+		rec.event = p[4];
+		rec.aux = p[5];
+		rec.arg = le16(p + 6);
+		if (rec.event == TR_NONE || rec.event >= TR_EVENT_COUNT) continue;
+		// An interrupt can get in between a record claiming its slot and reading the
+		// clock, so time can go backwards a little. Treat the difference as signed,
+		// which also takes care of CYCCNT wrapping.
+		if (!records.empty()) now += (int32_t)(cycles - last);
+		last = cycles;
+		rec.cycles = now;
+		records.push_back(rec);
+	}
+	return true;
+}
+
+namespace {
+
+// The timeline rows
+enum Lane { LANE_SCSI = 1, LANE_USB, LANE_CARD_A, LANE_CARD_B, LANE_CRYPTO, LANE_CACHE, LANE_COUNT };
+
+const char *laneNames[] = { "", "SCSI", "USB", "Card A", "Card B", "Crypto", "Cache" };
+
+class ChromeWriter {
+public:
+	ChromeWriter(std::ostream &out, double mhz, uint64_t origin) : out(out), mhz(mhz), origin(origin), first(true) {
+		for(int i = 0; i < LANE_COUNT; i++) open[i] = 0;
+		out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+		for(int i = LANE_SCSI; i < LANE_COUNT; i++) {
+			separator();
+			out << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << i << ",\"name\":\"thread_name\",\"args\":{\"name\":\"" << laneNames[i] << "\"}}";
+		}
+	}
+
+	~ChromeWriter() {
+		out << "\n]}\n";
+	}
+
+	void begin(int lane, uint64_t cycles, const std::string &name, const std::string &args = "") {
+		open[lane]++;
+		event("B", lane, cycles, name, args);
+	}
+
+	void end(int lane, uint64_t cycles, const std::string &args = "") {
+		// The ring may have started in the middle of something.
+		if (open[lane] == 0) return;
+		open[lane]--;
+		event("E", lane, cycles, "", args);
+	}
+
+	void instant(int lane, uint64_t cycles, const std::string &name, const std::string &args = "") {
+		event("i", lane, cycles, name, args, "\"s\":\"t\",");
+	}
+
+private:
+	void separator() {
+		if (!first) out << ",\n";
+		first = false;
+	}
+
+	void event(const char *ph, int lane, uint64_t cycles, const std::string &name, const std::string &args, const char *extra = "") {
+		char ts[32];
+		snprintf(ts, sizeof(ts), "%.3f", (int64_t)(cycles - origin) / mhz);
+		separator();
+		out << "{\"ph\":\"" << ph << "\",\"pid\":1,\"tid\":" << lane << ",\"ts\":" << ts << "," << extra;
+		if (!name.empty()) out << "\"name\":\"" << name << "\",";
+		out << "\"args\":{" << args << "}}";
+	}
+
+	std::ostream &out;
+	double mhz;
+	uint64_t origin;
+	bool first;
+	int open[LANE_COUNT];
+};
+
+std::string hex(unsigned int v) {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "0x%02x", v);
+	return buf;
+}
+
+int cardLane(uint8_t card) {
+	return card ? LANE_CARD_B : LANE_CARD_A;
+}
+
+}
+
+void writeChromeTrace(const std::vector<TraceRecord> &records, double mhz, std::ostream &out) {
+	ChromeWriter w(out, mhz, records.empty() ? 0 : records[0].cycles);
+	for(const TraceRecord &r : records) {
+		std::string arg = std::to_string(r.arg);
+		switch(r.event) {
+			case TR_CBW:
+				w.begin(LANE_SCSI, r.cycles, "CDB " + hex(r.aux), "\"tag\":" + arg);
+				break;
+			case TR_CSW:
+				w.end(LANE_SCSI, r.cycles, "\"status\":" + std::to_string(r.aux));
+				break;
+			case TR_USB_START:
+				w.begin(LANE_USB, r.cycles, r.aux ? "to host" : "from host");
+				break;
+			case TR_USB_DONE:
+				w.end(LANE_USB, r.cycles);
+				break;
+			case TR_CARD_SELECT:
+				w.instant(cardLane(r.aux), r.cycles, "select");
+				break;
+			case TR_CARD_READ_START:
+				w.begin(cardLane(r.aux), r.cycles, "read", "\"sectors\":" + arg);
+				break;
+			case TR_CARD_WRITE_START:
+				w.begin(cardLane(r.aux), r.cycles, "write", "\"sectors\":" + arg);
+				break;
+			case TR_CARD_READ_END:
+			case TR_CARD_WRITE_END:
+				w.end(cardLane(r.aux), r.cycles, "\"ok\":" + arg);
+				break;
+			case TR_XEX_START:
+				w.begin(LANE_CRYPTO, r.cycles, "xex", "\"aes_blocks\":" + arg);
+				break;
+			case TR_XEX_END:
+				w.end(LANE_CRYPTO, r.cycles);
+				break;
+			case TR_FLUSH_START:
+				w.begin(LANE_CACHE, r.cycles, "flush", "\"dirty\":" + arg);
+				break;
+			case TR_FLUSH_END:
+				w.end(LANE_CACHE, r.cycles, "\"ok\":" + arg);
+				break;
+			case TR_PREFETCH_START:
+				w.begin(LANE_CACHE, r.cycles, "prefetch", "\"blocks\":" + arg);
+				break;
+			case TR_PREFETCH_END:
+				w.end(LANE_CACHE, r.cycles, "\"added\":" + arg);
+				break;
+		}
+	}
+}
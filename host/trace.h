@@ -0,0 +1,67 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Decoding the firmware's trace ring (see Trace.h in the firmware).
+
+#ifndef ORTHRUS_TRACE_H_
+#define ORTHRUS_TRACE_H_
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+static const uint32_t TRACE_MAGIC = 0x4352544f; // "OTRC"
+static const uint16_t TRACE_VERSION = 1;
+
+enum TraceEvent {
+	TR_NONE,
+	TR_CBW,
+	TR_CSW,
+	TR_USB_START,
+	TR_USB_DONE,
+	TR_CARD_SELECT,
+	TR_CARD_READ_START,
+	TR_CARD_READ_END,
+	TR_CARD_WRITE_START,
+	TR_CARD_WRITE_END,
+	TR_XEX_START,
+	TR_XEX_END,
+	TR_FLUSH_START,
+	TR_FLUSH_END,
+	TR_PREFETCH_START,
+	TR_PREFETCH_END,
+	TR_EVENT_COUNT
+};
+
+struct TraceRecord {
+	uint64_t cycles; // unwrapped
+	uint8_t event;
+	uint8_t aux;
+	uint16_t arg;
+};
+
+// Pull the records out of a dump, oldest first, with the cycle counter unwrapped.
+// mhz comes back as the clock the device says it runs at.
+bool decodeTrace(const std::vector<uint8_t> &dump, std::vector<TraceRecord> &records, unsigned int &mhz, std::string &error);
+
+// Write the records as Chrome trace event JSON (which Perfetto also reads).
+void writeChromeTrace(const std::vector<TraceRecord> &records, double mhz, std::ostream &out);
+
+#endif
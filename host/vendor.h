@@ -0,0 +1,105 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// The host side of the firmware's Vendor.h. Keep the two in step.
+
+#ifndef ORTHRUS_VENDOR_H_
+#define ORTHRUS_VENDOR_H_
+
+#include <cstddef>
+#include <cstdint>
+
+static const uint8_t VENDOR_OPCODE = 0xC0;
+
+static const uint8_t VENDOR_INFO = 0x00;
+static const uint8_t VENDOR_TRACE_DUMP = 0x01;
+static const uint8_t VENDOR_TRACE_RESUME = 0x02;
+static const uint8_t VENDOR_SETTINGS_GET = 0x03;
+static const uint8_t VENDOR_SETTINGS_SET = 0x04;
+static const uint8_t VENDOR_SETTINGS_DEFAULTS = 0x05;
+static const uint8_t VENDOR_RAW_OPEN = 0x06;
+static const uint8_t VENDOR_RAW_READ = 0x07;
+static const uint8_t VENDOR_RAW_CLOSE = 0x08;
+static const uint8_t VENDOR_CBT_GET = 0x09;
+static const uint8_t VENDOR_CBT_CLEAR = 0x0a;
+
+static const uint32_t VENDOR_MAGIC = 0x4854524f; // "ORTH"
+
+static const uint32_t VENDOR_FEATURE_TRACE = 0x00000001;
+static const uint32_t VENDOR_FEATURE_PROFILE = 0x00000002;
+
+// struct settings (see Settings.h) - offsets of each field
+static const uint32_t SETTINGS_MAGIC = 0x5445534f; // "OSET"
+static const uint16_t SETTINGS_VERSION = 1;
+static const size_t SETTINGS_SIZE = 24;
+static const size_t SETTINGS_CARD_CLOCK = 8;
+static const size_t SETTINGS_PREFETCH_DEPTH = 12;
+static const size_t SETTINGS_WRITE_BACK = 14;
+static const size_t SETTINGS_BATCH_SECTORS = 15;
+static const size_t SETTINGS_SCHED_POLICY = 16;
+
+// struct raw_info (see Raw.h)
+static const size_t RAW_INFO_SIZE = 24;
+static const size_t RAW_INFO_CARD_SECTORS = 0; // two of them, A then B
+static const size_t RAW_INFO_MAX_SECTORS = 16;
+
+// struct cbt_info (see Cbt.h), then up to CBT_MAX_BYTES of bitmap
+static const size_t CBT_INFO_SIZE = 16;
+static const size_t CBT_INFO_REGION_BLOCKS = 0;
+static const size_t CBT_INFO_REGIONS = 4;
+static const size_t CBT_INFO_BLOCK_SIZE = 8;
+static const size_t CBT_INFO_FLAGS = 12;
+static const size_t CBT_MAX_BYTES = 2048;
+static const uint32_t CBT_FLAG_PERSISTENT = 0x00000001;
+
+// The vendor LOG SENSE pages (see Stats.h)
+static const uint8_t LOG_PAGE_CARDS = 0x30;
+static const uint8_t LOG_PAGE_OPCODES = 0x31;
+static const uint8_t LOG_PAGE_SERVICE = 0x32;
+static const uint8_t LOG_PAGE_CACHE = 0x33;
+
+// The benchmark diagnostic page (see Diag.h)
+static const uint8_t DIAG_PAGE_BENCH = 0x80;
+static const uint8_t DIAG_FLAG_WRITE = 0x01;
+static const size_t DIAG_RECORD_SIZE = 16;
+
+// Everything from the device is little-endian, except what's in log and diagnostic pages.
+static inline uint16_t le16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t le64(const uint8_t *p) {
+	return le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+static inline void putLe16(uint8_t *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void putLe32(uint8_t *p, uint32_t v) {
+	putLe16(p, v);
+	putLe16(p + 2, v >> 16);
+}
+
+#endif
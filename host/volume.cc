@@ -0,0 +1,227 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "volume.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char MAGIC[] = "OrthrusVolumeV03";
+static const char MAGIC_V02[] = "OrthrusVolumeV02";
+static const uint8_t FLAG_4KN = 0x01;
+
+bool Keyblock::parse(const uint8_t *sector, std::string &error) {
+	legacy = !memcmp(sector, MAGIC_V02, 16);
+	if (!legacy && memcmp(sector, MAGIC, 16)) {
+		error = "bad magic";
+		return false;
+	}
+	memcpy(volid, sector + 0x10, sizeof(volid));
+	memcpy(keydata, sector + 0x50, sizeof(keydata));
+	memcpy(nonce, sector + 0x70, sizeof(nonce));
+	cardA = sector[0x80] == 0;
+	formatFlags = legacy ? 0 : sector[0x81];
+	if (formatFlags & ~FLAG_4KN) {
+		error = "unknown format flags";
+		return false;
+	}
+	scratchSectors = 0;
+	if (!legacy) {
+		for(int i = 0; i < 4; i++)
+			scratchSectors = (scratchSectors << 8) | sector[0x82 + i];
+	}
+	return true;
+}
+
+void deriveVolumeKey(const Keyblock &a, const Keyblock &b, uint8_t *key) {
+	/*
+	 * The key data from both cards is shuffled together (A first), and a
+	 * zero-key CMAC of each half makes an intermediate key. A CMAC of each half
+	 * of the volume ID with that is the volume key.
+	 */
+	uint8_t shuffled[64], intermediate[AES_KEY_SIZE];
+	for(size_t i = 0; i < sizeof(a.keydata); i++) {
+		shuffled[2 * i] = a.keydata[i];
+		shuffled[2 * i + 1] = b.keydata[i];
+	}
+	uint8_t zero[AES_KEY_SIZE] = { 0 };
+	{
+		Aes256 zero_key(zero);
+		cmac(zero_key, shuffled, 32, intermediate);
+		cmac(zero_key, shuffled + 32, 32, intermediate + 16);
+	}
+	{
+		Aes256 intermediate_key(intermediate);
+		cmac(intermediate_key, a.volid, 32, key);
+		cmac(intermediate_key, a.volid + 32, 32, key + 16);
+	}
+	memset(shuffled, 0, sizeof(shuffled));
+	memset(intermediate, 0, sizeof(intermediate));
+}
+
+void blockNonce(const uint8_t *otherNonce, uint64_t block, uint8_t *nonce) {
+	memcpy(nonce, otherNonce, AES_BLOCK_SIZE);
+	// The top 32 bits of the block number are XORed into bytes 8-11 (which does
+	// nothing below 2^32 blocks), and the bottom 32 replace bytes 12-15.
+	nonce[8] ^= (uint8_t)(block >> 56);
+	nonce[9] ^= (uint8_t)(block >> 48);
+	nonce[10] ^= (uint8_t)(block >> 40);
+	nonce[11] ^= (uint8_t)(block >> 32);
+	nonce[12] = (uint8_t)(block >> 24);
+	nonce[13] = (uint8_t)(block >> 16);
+	nonce[14] = (uint8_t)(block >> 8);
+	nonce[15] = (uint8_t)(block >> 0);
+}
+
+Volume::Volume() : volumeBlockSize(0), volumeBlocks(0) {
+	for(int i = 0; i < 2; i++) {
+		images[i].fd = -1;
+		images[i].map = nullptr;
+		images[i].size = 0;
+	}
+}
+
+Volume::~Volume() {
+	for(int i = 0; i < 2; i++) {
+		if (images[i].map) munmap(const_cast<uint8_t *>(images[i].map), images[i].size);
+		if (images[i].fd >= 0) close(images[i].fd);
+	}
+	memset(keyblocks, 0, sizeof(keyblocks));
+}
+
+bool Volume::mapImage(const std::string &path, Image &image, std::string &error) {
+	image.fd = ::open(path.c_str(), O_RDONLY);
+	if (image.fd < 0) goto err;
+	{
+		// lseek works for block devices too, where st_size doesn't.
+		off_t size = lseek(image.fd, 0, SEEK_END);
+		if (size < 0) goto err;
+		image.size = size;
+		if (image.size < SECTOR_SIZE) {
+			error = path + ": too short";
+			return false;
+		}
+		void *map = mmap(nullptr, image.size, PROT_READ, MAP_SHARED, image.fd, 0);
+		if (map == MAP_FAILED) goto err;
+		image.map = static_cast<const uint8_t *>(map);
+		return true;
+	}
+err:
+	error = path + ": " + strerror(errno);
+	return false;
+}
+
+bool Volume::open(const std::string &image1, const std::string &image2, std::string &error) {
+	if (!aesAvailable()) {
+		error = "this CPU doesn't have AES-NI";
+		return false;
+	}
+	Image loaded[2];
+	for(int i = 0; i < 2; i++) {
+		loaded[i].fd = -1;
+		loaded[i].map = nullptr;
+		loaded[i].size = 0;
+	}
+	Keyblock kb[2];
+	const std::string *paths[2] = { &image1, &image2 };
+	for(int i = 0; i < 2; i++) {
+		if (!mapImage(*paths[i], loaded[i], error)) goto fail;
+		if (!kb[i].parse(loaded[i].map, error)) {
+			error = *paths[i] + ": " + error;
+			goto fail;
+		}
+	}
+	if (kb[0].cardA == kb[1].cardA) {
+		error = "need one card A and one card B";
+		goto fail;
+	}
+	if (kb[0].legacy != kb[1].legacy || memcmp(kb[0].volid, kb[1].volid, sizeof(kb[0].volid))) {
+		error = "the cards are from different volumes";
+		goto fail;
+	}
+	if (kb[0].formatFlags != kb[1].formatFlags || kb[0].scratchSectors != kb[1].scratchSectors) {
+		error = "the cards have different volume formats";
+		goto fail;
+	}
+
+	{
+		// Put them in logical order.
+		int a = kb[0].cardA ? 0 : 1;
+		images[0] = loaded[a];
+		images[1] = loaded[1 - a];
+		keyblocks[0] = kb[a];
+		keyblocks[1] = kb[1 - a];
+		memset(kb, 0, sizeof(kb));
+
+		volumeBlockSize = keyblocks[0].volumeBlockSize();
+		uint64_t card_sectors = std::min(images[0].size, images[1].size) / SECTOR_SIZE;
+		uint64_t spb = volumeBlockSize / SECTOR_SIZE;
+		uint64_t scratch = keyblocks[0].scratchSectors;
+		if (scratch > card_sectors / 2 || card_sectors - scratch < 2 * spb) {
+			error = "the cards are too small for this volume";
+			return false;
+		}
+		volumeBlocks = (((card_sectors - scratch) / spb) - 1) * 2;
+		// A V02 volume never had more than 2^32 blocks (see prepVolume() in the firmware).
+		if (keyblocks[0].legacy && volumeBlocks > 0xffffffffULL)
+			volumeBlocks = 0xffffffffULL;
+
+		uint8_t key[AES_KEY_SIZE];
+		deriveVolumeKey(keyblocks[0], keyblocks[1], key);
+		aes.reset(new Aes256(key));
+		memset(key, 0, sizeof(key));
+		return true;
+	}
+
+fail:
+	for(int i = 0; i < 2; i++) {
+		if (loaded[i].map) munmap(const_cast<uint8_t *>(loaded[i].map), loaded[i].size);
+		if (loaded[i].fd >= 0) close(loaded[i].fd);
+	}
+	memset(kb, 0, sizeof(kb));
+	return false;
+}
+
+void Volume::advise(int advice) const {
+	for(int i = 0; i < 2; i++)
+		madvise(const_cast<uint8_t *>(images[i].map), images[i].size, advice);
+}
+
+void Volume::decrypt(uint64_t first, uint64_t count, uint8_t *out) const {
+	// In batches, so the kernel gets to encrypt the nonces together.
+	const size_t BATCH = 16;
+	uint8_t nonces[BATCH * AES_BLOCK_SIZE];
+	const uint8_t *in[BATCH];
+	while(count > 0) {
+		size_t n = count < BATCH ? count : BATCH;
+		for(size_t i = 0; i < n; i++) {
+			nonceOf(first + i, nonces + i * AES_BLOCK_SIZE);
+			in[i] = ciphertext(first + i);
+		}
+		xexDecryptBlocks(*aes, nonces, in, out, n, volumeBlockSize);
+		first += n;
+		count -= n;
+		out += n * volumeBlockSize;
+	}
+}
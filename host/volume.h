@@ -0,0 +1,111 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// An Orthrus volume, straight from images (or block devices) of its two
+// cards. This is the same thing OrthrusDecrypt.java does, and the firmware
+// before it (see Crypto.c).
+
+#ifndef ORTHRUS_VOLUME_H_
+#define ORTHRUS_VOLUME_H_
+
+#include "xex.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+static const size_t SECTOR_SIZE = 512;
+
+/*
+ * The keyblock in sector 0 of each card:
+ * 0x00-0x0f: magic
+ * 0x10-0x4f: volume ID
+ * 0x50-0x6f: key data
+ * 0x70-0x7f: nonce
+ * 0x80: card - 0 for A, 1 for B
+ * 0x81: format flags (V03 only) - 0x01 for 4096 byte volume blocks
+ * 0x82-0x85: scratch sectors at the end of each card, big-endian (V03 only)
+ */
+struct Keyblock {
+	uint8_t volid[64];
+	uint8_t keydata[32];
+	uint8_t nonce[16];
+	bool cardA;
+	bool legacy; // V02 - no format flags or scratch, and at most 2^32 blocks
+	uint8_t formatFlags;
+	uint32_t scratchSectors;
+
+	bool parse(const uint8_t *sector, std::string &error);
+	size_t volumeBlockSize() const { return (formatFlags & 0x01) ? 8 * SECTOR_SIZE : SECTOR_SIZE; }
+};
+
+// The volume key from card A's and card B's keyblocks.
+void deriveVolumeKey(const Keyblock &a, const Keyblock &b, uint8_t *key);
+
+// The XEX nonce for a volume block: the other card's nonce, with the block number in the end of it.
+void blockNonce(const uint8_t *otherNonce, uint64_t block, uint8_t *nonce);
+
+class Volume {
+public:
+	Volume();
+	~Volume();
+	Volume(const Volume &) = delete;
+	Volume &operator=(const Volume &) = delete;
+
+	// The images can be given in either order - the keyblocks say which is A.
+	bool open(const std::string &image1, const std::string &image2, std::string &error);
+
+	uint64_t blocks() const { return volumeBlocks; }
+	size_t blockSize() const { return volumeBlockSize; }
+	uint64_t bytes() const { return volumeBlocks * volumeBlockSize; }
+	const uint8_t *volumeId() const { return keyblocks[0].volid; }
+	bool legacy() const { return keyblocks[0].legacy; }
+
+	// Where volume block n is: logical card 0 (A) for even blocks, 1 (B) for odd.
+	int cardOf(uint64_t block) const { return block & 1; }
+	uint64_t offsetOf(uint64_t block) const { return ((block >> 1) + 1) * volumeBlockSize; }
+	const uint8_t *ciphertext(uint64_t block) const { return images[cardOf(block)].map + offsetOf(block); }
+
+	void nonceOf(uint64_t block, uint8_t *nonce) const { blockNonce(keyblocks[1 - cardOf(block)].nonce, block, nonce); }
+
+	// madvise() both images, for how they're about to be read.
+	void advise(int advice) const;
+
+	// Decrypt count blocks, starting at first, into out.
+	void decrypt(uint64_t first, uint64_t count, uint8_t *out) const;
+
+	const Aes256 &cipher() const { return *aes; }
+
+private:
+	struct Image {
+		int fd;
+		const uint8_t *map;
+		uint64_t size;
+	};
+	bool mapImage(const std::string &path, Image &image, std::string &error);
+
+	Image images[2]; // logical A, then B
+	Keyblock keyblocks[2];
+	std::unique_ptr<Aes256> aes;
+	size_t volumeBlockSize;
+	uint64_t volumeBlocks;
+};
+
+#endif
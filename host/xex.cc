@@ -0,0 +1,419 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "xex.h"
+
+#include <cstring>
+#include <immintrin.h>
+
+/*
+ * Every function that uses an instruction set extension says so, and the
+ * kernels that need more than AES-NI are only called once the CPU is known
+ * to have it - so the rest of this builds for any x86-64.
+ */
+#define AESNI __attribute__((target("aes,pclmul,ssse3")))
+#define VAES __attribute__((target("aes,pclmul,ssse3,avx2,avx512f,avx512bw,vaes,vpclmulqdq")))
+
+bool aesAvailable() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+namespace {
+
+AESNI inline __m128i expandA(__m128i key, __m128i assist) {
+	assist = _mm_shuffle_epi32(assist, 0xff);
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, assist);
+}
+
+AESNI inline __m128i expandB(__m128i key, __m128i prev) {
+	__m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0), 0xaa);
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, assist);
+}
+
+AESNI void expandKey(const uint8_t *key, uint8_t *enc, uint8_t *dec) {
+	__m128i k[15];
+	k[0] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key));
+	k[1] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key + 16));
+	// The round constant has to be an immediate.
+#define ROUND(i, rcon) \
+	k[i] = expandA(k[i - 2], _mm_aeskeygenassist_si128(k[i - 1], rcon)); \
+	if (i < 14) k[i + 1] = expandB(k[i - 1], k[i]);
+	ROUND(2, 0x01)
+	ROUND(4, 0x02)
+	ROUND(6, 0x04)
+	ROUND(8, 0x08)
+	ROUND(10, 0x10)
+	ROUND(12, 0x20)
+	ROUND(14, 0x40)
+#undef ROUND
+	for(int i = 0; i < 15; i++)
+		_mm_store_si128(reinterpret_cast<__m128i *>(enc) + i, k[i]);
+	// The equivalent inverse cipher's keys.
+	_mm_store_si128(reinterpret_cast<__m128i *>(dec), k[14]);
+	for(int i = 1; i < 14; i++)
+		_mm_store_si128(reinterpret_cast<__m128i *>(dec) + i, _mm_aesimc_si128(k[14 - i]));
+	_mm_store_si128(reinterpret_cast<__m128i *>(dec) + 14, k[0]);
+	for(int i = 0; i < 15; i++) k[i] = _mm_setzero_si128();
+}
+
+// The round loops here and the lane loops in the kernels are all unrolled
+// (-O2 won't on its own), or the lanes go through the stack every round.
+AESNI inline __m128i encryptBlock(const __m128i *k, __m128i b) {
+	b = _mm_xor_si128(b, _mm_load_si128(k));
+	#pragma GCC unroll 16
+	for(int i = 1; i < 14; i++)
+		b = _mm_aesenc_si128(b, _mm_load_si128(k + i));
+	return _mm_aesenclast_si128(b, _mm_load_si128(k + 14));
+}
+
+AESNI inline __m128i decryptBlock(const __m128i *k, __m128i b) {
+	b = _mm_xor_si128(b, _mm_load_si128(k));
+	#pragma GCC unroll 16
+	for(int i = 1; i < 14; i++)
+		b = _mm_aesdec_si128(b, _mm_load_si128(k + i));
+	return _mm_aesdeclast_si128(b, _mm_load_si128(k + 14));
+}
+
+/*
+ * Tweak arithmetic. A tweak is big-endian in memory, so in a register it's
+ * byte swapped first: then it's a 128 bit little-endian number, low half in
+ * the bottom 64 bit lane. Multiplying by x^K is a shift of each lane, with the
+ * bits out of the bottom lane carried into the top one, and the K bits out
+ * of the top carry-less multiplied by 0x87 and folded back into the bottom.
+ * That takes K up to 56, which is as far as any kernel here jumps at once.
+ */
+AESNI inline __m128i byteSwap(__m128i v) {
+	return _mm_shuffle_epi8(v, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+template<int K>
+AESNI inline __m128i mulX(__m128i v) {
+	const __m128i poly = _mm_set_epi64x(0, 0x87);
+	__m128i out = _mm_srli_epi64(v, 64 - K);
+	v = _mm_xor_si128(_mm_slli_epi64(v, K), _mm_slli_si128(out, 8));
+	return _mm_xor_si128(v, _mm_clmulepi64_si128(out, poly, 0x01));
+}
+
+template<bool DECRYPT>
+AESNI inline __m128i round(__m128i b, __m128i k) {
+	return DECRYPT ? _mm_aesdec_si128(b, k) : _mm_aesenc_si128(b, k);
+}
+
+// The last round is just an XOR with the last key, so the output tweak goes in with it.
+template<bool DECRYPT>
+AESNI inline __m128i lastRound(__m128i b, __m128i k) {
+	return DECRYPT ? _mm_aesdeclast_si128(b, k) : _mm_aesenclast_si128(b, k);
+}
+
+/*
+ * The kernels. Each one does one volume block, given its first tweak (the
+ * encrypted nonce). The length is a multiple of AES_BLOCK_SIZE.
+ */
+typedef void (*KernelFn)(const __m128i *keys, const uint8_t *tweak, const uint8_t *in, uint8_t *out, size_t length);
+
+// One AES block at a time, like OrthrusDecrypt.java. It's the yardstick for the others.
+template<bool DECRYPT>
+AESNI void xex1(const __m128i *keys, const uint8_t *tweak, const uint8_t *in, uint8_t *out, size_t length) {
+	__m128i t = byteSwap(_mm_loadu_si128(reinterpret_cast<const __m128i *>(tweak)));
+	for(size_t pos = 0; pos < length; pos += AES_BLOCK_SIZE) {
+		__m128i tw = byteSwap(t);
+		__m128i b = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + pos)), tw);
+		b = DECRYPT ? decryptBlock(keys, b) : encryptBlock(keys, b);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + pos), _mm_xor_si128(b, tw));
+		t = mulX<1>(t);
+	}
+}
+
+/*
+ * Eight AES blocks in flight. An AES round takes several cycles to come out
+ * but a new one can start every cycle or so, and eight independent blocks
+ * keep the unit busy. The eight tweaks step by x^8 each time around.
+ */
+template<bool DECRYPT>
+AESNI void xex8(const __m128i *keys, const uint8_t *tweak, const uint8_t *in, uint8_t *out, size_t length) {
+	const size_t LANES = 8;
+	__m128i t[LANES];
+	t[0] = byteSwap(_mm_loadu_si128(reinterpret_cast<const __m128i *>(tweak)));
+	#pragma GCC unroll 16
+	for(size_t i = 1; i < LANES; i++) t[i] = mulX<1>(t[i - 1]);
+	const __m128i k0 = _mm_load_si128(keys), k14 = _mm_load_si128(keys + 14);
+	size_t pos = 0;
+	for(; pos + LANES * AES_BLOCK_SIZE <= length; pos += LANES * AES_BLOCK_SIZE) {
+		__m128i tw[LANES], b[LANES];
+		#pragma GCC unroll 16
+		for(size_t i = 0; i < LANES; i++) {
+			tw[i] = byteSwap(t[i]);
+			b[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + pos) + i);
+			b[i] = _mm_xor_si128(b[i], _mm_xor_si128(tw[i], k0));
+			t[i] = mulX<LANES>(t[i]);
+		}
+		#pragma GCC unroll 16
+		for(int r = 1; r < 14; r++) {
+			__m128i k = _mm_load_si128(keys + r);
+			#pragma GCC unroll 16
+			for(size_t i = 0; i < LANES; i++) b[i] = round<DECRYPT>(b[i], k);
+		}
+		#pragma GCC unroll 16
+		for(size_t i = 0; i < LANES; i++) {
+			b[i] = lastRound<DECRYPT>(b[i], _mm_xor_si128(k14, tw[i]));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out + pos) + i, b[i]);
+		}
+	}
+	// Whatever doesn't make up a whole set (nothing, for the volume block sizes).
+	__m128i tail = t[0];
+	for(; pos < length; pos += AES_BLOCK_SIZE) {
+		__m128i tw = byteSwap(tail);
+		__m128i b = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + pos)), tw);
+		b = DECRYPT ? decryptBlock(keys, b) : encryptBlock(keys, b);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + pos), _mm_xor_si128(b, tw));
+		tail = mulX<1>(tail);
+	}
+}
+
+// The same as mulX(), four tweaks at a time.
+template<int K>
+VAES inline __m512i mulX4(__m512i v) {
+	const __m512i poly = _mm512_set_epi64(0, 0x87, 0, 0x87, 0, 0x87, 0, 0x87);
+	__m512i out = _mm512_maskz_srli_epi64(0xff, v, 64 - K);
+	v = _mm512_xor_si512(_mm512_maskz_slli_epi64(0xff, v, K), _mm512_bslli_epi128(out, 8));
+	return _mm512_xor_si512(v, _mm512_clmulepi64_epi128(out, poly, 0x01));
+}
+
+VAES inline __m512i byteSwap4(__m512i v) {
+	const __m512i swap = _mm512_maskz_broadcast_i32x4(0xffff, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+	return _mm512_shuffle_epi8(v, swap);
+}
+
+template<bool DECRYPT>
+VAES inline __m512i round4(__m512i b, __m512i k) {
+	return DECRYPT ? _mm512_aesdec_epi128(b, k) : _mm512_aesenc_epi128(b, k);
+}
+
+template<bool DECRYPT>
+VAES inline __m512i lastRound4(__m512i b, __m512i k) {
+	return DECRYPT ? _mm512_aesdeclast_epi128(b, k) : _mm512_aesenclast_epi128(b, k);
+}
+
+/*
+ * Sixteen AES blocks in flight, four to a 512 bit register. All the round
+ * keys stay in registers. The tweaks step by x^16 each time around.
+ */
+template<bool DECRYPT>
+VAES void xex16(const __m128i *keys, const uint8_t *tweak, const uint8_t *in, uint8_t *out, size_t length) {
+	const size_t REGS = 4, LANES = REGS * 4;
+	__m128i t0 = byteSwap(_mm_loadu_si128(reinterpret_cast<const __m128i *>(tweak)));
+	__m128i t1 = mulX<1>(t0), t2 = mulX<1>(t1), t3 = mulX<1>(t2);
+	__m512i t[REGS];
+	t[0] = _mm512_inserti32x4(_mm512_inserti32x4(_mm512_inserti32x4(_mm512_castsi128_si512(t0), t1, 1), t2, 2), t3, 3);
+	#pragma GCC unroll 16
+	for(size_t i = 1; i < REGS; i++) t[i] = mulX4<4>(t[i - 1]);
+	__m512i k[15];
+	#pragma GCC unroll 16
+	for(int r = 0; r < 15; r++) k[r] = _mm512_maskz_broadcast_i32x4(0xffff, _mm_load_si128(keys + r));
+	size_t pos = 0;
+	for(; pos + LANES * AES_BLOCK_SIZE <= length; pos += LANES * AES_BLOCK_SIZE) {
+		__m512i tw[REGS], b[REGS];
+		#pragma GCC unroll 16
+		for(size_t i = 0; i < REGS; i++) {
+			tw[i] = byteSwap4(t[i]);
+			b[i] = _mm512_loadu_si512(in + pos + i * 64);
+			b[i] = _mm512_ternarylogic_epi64(b[i], tw[i], k[0], 0x96); // three way XOR
+			t[i] = mulX4<LANES>(t[i]);
+		}
+		#pragma GCC unroll 16
+		for(int r = 1; r < 14; r++)
+			#pragma GCC unroll 16
+			for(size_t i = 0; i < REGS; i++) b[i] = round4<DECRYPT>(b[i], k[r]);
+		#pragma GCC unroll 16
+		for(size_t i = 0; i < REGS; i++) {
+			b[i] = lastRound4<DECRYPT>(b[i], _mm512_xor_si512(k[14], tw[i]));
+			_mm512_storeu_si512(out + pos + i * 64, b[i]);
+		}
+	}
+	if (pos < length) {
+		// The first lane has the next tweak.
+		alignas(64) uint8_t next[4 * AES_BLOCK_SIZE];
+		_mm512_store_si512(next, byteSwap4(t[0]));
+		xex8<DECRYPT>(keys, next, in + pos, out + pos, length - pos);
+	}
+}
+
+bool always() { return true; }
+
+bool vaesAvailable() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("vaes") && __builtin_cpu_supports("vpclmulqdq") &&
+		__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+struct Kernel {
+	const char *name;
+	bool (*available)();
+	KernelFn encrypt, decrypt;
+};
+
+// Slowest first.
+const Kernel KERNELS[] = {
+	{ "aesni-1", always, xex1<false>, xex1<true> },
+	{ "aesni-8", always, xex8<false>, xex8<true> },
+	{ "vaes-16", vaesAvailable, xex16<false>, xex16<true> },
+};
+const size_t KERNEL_COUNT = sizeof(KERNELS) / sizeof(KERNELS[0]);
+
+const Kernel *&selected() {
+	static const Kernel *kernel = nullptr;
+	if (kernel == nullptr) {
+		kernel = &KERNELS[0];
+		for(size_t i = 0; i < KERNEL_COUNT; i++)
+			if (KERNELS[i].available()) kernel = &KERNELS[i];
+	}
+	return kernel;
+}
+
+// Encrypt up to eight nonces at once, for the tweaks.
+AESNI void encryptNonces(const __m128i *keys, const uint8_t *nonces, uint8_t *tweaks, size_t count) {
+	__m128i b[8];
+	#pragma GCC unroll 16
+	for(size_t i = 0; i < 8; i++)
+		b[i] = i < count ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(nonces) + i) : _mm_setzero_si128();
+	#pragma GCC unroll 16
+	for(size_t i = 0; i < 8; i++) b[i] = _mm_xor_si128(b[i], _mm_load_si128(keys));
+	#pragma GCC unroll 16
+	for(int r = 1; r < 14; r++) {
+		__m128i k = _mm_load_si128(keys + r);
+		#pragma GCC unroll 16
+		for(size_t i = 0; i < 8; i++) b[i] = _mm_aesenc_si128(b[i], k);
+	}
+	#pragma GCC unroll 16
+	for(size_t i = 0; i < 8; i++) b[i] = _mm_aesenclast_si128(b[i], _mm_load_si128(keys + 14));
+	for(size_t i = 0; i < count; i++)
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(tweaks) + i, b[i]);
+}
+
+template<bool DECRYPT>
+void xexBlocks(const Aes256 &aes, const uint8_t *nonces, const uint8_t *const *in, uint8_t *out, size_t count, size_t length) {
+	KernelFn kernel = DECRYPT ? selected()->decrypt : selected()->encrypt;
+	const __m128i *keys = reinterpret_cast<const __m128i *>(DECRYPT ? aes.decryptKeys() : aes.encryptKeys());
+	const __m128i *tweakKeys = reinterpret_cast<const __m128i *>(aes.encryptKeys());
+	uint8_t tweaks[8 * AES_BLOCK_SIZE];
+	for(size_t i = 0; i < count; i += 8) {
+		size_t n = count - i < 8 ? count - i : 8;
+		encryptNonces(tweakKeys, nonces + i * AES_BLOCK_SIZE, tweaks, n);
+		for(size_t j = 0; j < n; j++)
+			kernel(keys, tweaks + j * AES_BLOCK_SIZE, in[i + j], out + (i + j) * length, length);
+	}
+	memset(tweaks, 0, sizeof(tweaks));
+}
+
+} // namespace
+
+std::vector<std::string> xexKernels() {
+	std::vector<std::string> names;
+	for(size_t i = 0; i < KERNEL_COUNT; i++)
+		if (KERNELS[i].available()) names.push_back(KERNELS[i].name);
+	return names;
+}
+
+const char *xexKernel() {
+	return selected()->name;
+}
+
+bool xexUseKernel(const std::string &name) {
+	for(size_t i = 0; i < KERNEL_COUNT; i++) {
+		if (name == KERNELS[i].name && KERNELS[i].available()) {
+			selected() = &KERNELS[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+Aes256::Aes256(const uint8_t *key) {
+	expandKey(key, enc, dec);
+}
+
+Aes256::~Aes256() {
+	memset(enc, 0, sizeof(enc));
+	memset(dec, 0, sizeof(dec));
+}
+
+AESNI void Aes256::encrypt(const uint8_t *in, uint8_t *out) const {
+	__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+	b = encryptBlock(reinterpret_cast<const __m128i *>(enc), b);
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(out), b);
+}
+
+AESNI void Aes256::decrypt(const uint8_t *in, uint8_t *out) const {
+	__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+	b = decryptBlock(reinterpret_cast<const __m128i *>(dec), b);
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(out), b);
+}
+
+void tweakDouble(uint8_t *tweak) {
+	uint8_t carry = 0;
+	for(int i = AES_BLOCK_SIZE - 1; i >= 0; i--) {
+		uint8_t next = tweak[i] >> 7;
+		tweak[i] = (uint8_t)((tweak[i] << 1) | carry);
+		carry = next;
+	}
+	if (carry) tweak[AES_BLOCK_SIZE - 1] ^= 0x87;
+}
+
+void cmac(const Aes256 &aes, const uint8_t *data, size_t length, uint8_t *mac) {
+	uint8_t kn[AES_BLOCK_SIZE] = { 0 };
+	aes.encrypt(kn, kn);
+	tweakDouble(kn); // K1
+	size_t last = length ? ((length - 1) / AES_BLOCK_SIZE) * AES_BLOCK_SIZE : 0;
+	if (length == 0 || length % AES_BLOCK_SIZE) tweakDouble(kn); // K2
+
+	uint8_t x[AES_BLOCK_SIZE] = { 0 };
+	for(size_t pos = 0; pos < last; pos += AES_BLOCK_SIZE) {
+		for(size_t i = 0; i < AES_BLOCK_SIZE; i++) x[i] ^= data[pos + i];
+		aes.encrypt(x, x);
+	}
+	for(size_t i = last; i < length; i++) x[i - last] ^= data[i];
+	if (length - last < AES_BLOCK_SIZE) x[length - last] ^= 0x80;
+	for(size_t i = 0; i < AES_BLOCK_SIZE; i++) x[i] ^= kn[i];
+	aes.encrypt(x, mac);
+	memset(kn, 0, sizeof(kn));
+	memset(x, 0, sizeof(x));
+}
+
+void xexDecryptBlocks(const Aes256 &aes, const uint8_t *nonces, const uint8_t *const *in, uint8_t *out, size_t count, size_t length) {
+	xexBlocks<true>(aes, nonces, in, out, count, length);
+}
+
+void xexEncryptBlocks(const Aes256 &aes, const uint8_t *nonces, const uint8_t *const *in, uint8_t *out, size_t count, size_t length) {
+	xexBlocks<false>(aes, nonces, in, out, count, length);
+}
+
+void xexDecrypt(const Aes256 &aes, const uint8_t *nonce, const uint8_t *in, uint8_t *out, size_t length) {
+	xexBlocks<true>(aes, nonce, &in, out, 1, length);
+}
+
+void xexEncrypt(const Aes256 &aes, const uint8_t *nonce, const uint8_t *in, uint8_t *out, size_t length) {
+	xexBlocks<false>(aes, nonce, &in, out, 1, length);
+}
@@ -0,0 +1,86 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// AES-256 and the XEX mode the firmware uses (see Crypto.c), with AES-NI -
+// and VAES on CPUs that have it.
+
+#ifndef ORTHRUS_XEX_H_
+#define ORTHRUS_XEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+static const size_t AES_BLOCK_SIZE = 16;
+static const size_t AES_KEY_SIZE = 32; // AES-256, like the firmware
+
+// Does this CPU have AES-NI (and PCLMULQDQ and SSSE3, which always come with
+// it)? Nothing else here works without them.
+bool aesAvailable();
+
+class Aes256 {
+public:
+	explicit Aes256(const uint8_t *key);
+	~Aes256();
+	Aes256(const Aes256 &) = delete;
+	Aes256 &operator=(const Aes256 &) = delete;
+
+	void encrypt(const uint8_t *in, uint8_t *out) const;
+	void decrypt(const uint8_t *in, uint8_t *out) const;
+
+	// The expanded keys, 15 round keys of 16 bytes each.
+	const uint8_t *encryptKeys() const { return enc; }
+	const uint8_t *decryptKeys() const { return dec; }
+
+private:
+	alignas(16) uint8_t enc[15 * 16];
+	alignas(16) uint8_t dec[15 * 16];
+};
+
+// AES-CMAC (RFC 4493) of a buffer.
+void cmac(const Aes256 &aes, const uint8_t *data, size_t length, uint8_t *mac);
+
+// Multiply a tweak by 2 in GF(2^128). Like the firmware, byte 0 is the most
+// significant and the reduction goes into the last byte.
+void tweakDouble(uint8_t *tweak);
+
+// XEX one volume block (a multiple of AES_BLOCK_SIZE bytes). The first tweak
+// is the encrypted nonce, and each 16 bytes doubles it. in and out may be the same.
+void xexDecrypt(const Aes256 &aes, const uint8_t *nonce, const uint8_t *in, uint8_t *out, size_t length);
+void xexEncrypt(const Aes256 &aes, const uint8_t *nonce, const uint8_t *in, uint8_t *out, size_t length);
+
+// XEX count volume blocks of length bytes: block i comes from in[i], with the
+// nonce at nonces + 16 * i, and goes to out + length * i. This saves waiting
+// on each nonce's encryption in turn.
+void xexDecryptBlocks(const Aes256 &aes, const uint8_t *nonces, const uint8_t *const *in, uint8_t *out, size_t count, size_t length);
+void xexEncryptBlocks(const Aes256 &aes, const uint8_t *nonces, const uint8_t *const *in, uint8_t *out, size_t count, size_t length);
+
+/*
+ * The XEX work is done by one of a few kernels: "aesni-1" (one AES block at a
+ * time, like OrthrusDecrypt.java), "aesni-8" (eight at a time) and "vaes-16"
+ * (sixteen, with VAES and AVX-512). The fastest this CPU can run is used
+ * unless xexUseKernel() picks another - which is for tests and benchmarks,
+ * and isn't safe while anything else is using XEX.
+ */
+std::vector<std::string> xexKernels(); // the ones this CPU can run, slowest first
+const char *xexKernel();
+bool xexUseKernel(const std::string &name);
+
+#endif
@@ -0,0 +1,293 @@
+/*
+
+ Copyright 2017 Nicholas W. Sayer
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// xextest - known answer tests for the AES, CMAC, key derivation and XEX
+// kernels ("make check"), and a benchmark of the kernels ("make bench").
+
+#include "volume.h"
+#include "xex.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// FIPS-197 appendix C.3.
+const uint8_t AES_KEY[] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+};
+const uint8_t AES_PLAINTEXT[] = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+};
+const uint8_t AES_CIPHERTEXT[] = {
+	0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89,
+};
+
+// NIST SP 800-38B appendix D.3 (CMAC-AES256).
+const uint8_t CMAC_KEY[] = {
+	0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+	0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4,
+};
+const uint8_t CMAC_MESSAGE[] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+const struct {
+	size_t length;
+	uint8_t mac[16];
+} CMAC_TESTS[] = {
+	{ 0, { 0x02, 0x89, 0x62, 0xf6, 0x1b, 0x7b, 0xf8, 0x9e, 0xfc, 0x6b, 0x55, 0x1f, 0x46, 0x67, 0xd9, 0x83 } },
+	{ 16, { 0x28, 0xa7, 0x02, 0x3f, 0x45, 0x2e, 0x8f, 0x82, 0xbd, 0x4b, 0xf2, 0x8d, 0x8c, 0x37, 0xc3, 0x5c } },
+	{ 40, { 0xaa, 0xf3, 0xd8, 0xf1, 0xde, 0x56, 0x40, 0xc2, 0x32, 0xf5, 0xb1, 0x69, 0xb9, 0xc9, 0x11, 0xe6 } },
+	{ 64, { 0xe1, 0x99, 0x21, 0x90, 0x54, 0x9f, 0x6e, 0xd5, 0x69, 0x6a, 0x2c, 0x05, 0x6c, 0x31, 0x54, 0x10 } },
+};
+
+/*
+ * A volume made of made-up keyblocks: card A's key data is 00..1f and its
+ * nonce a0..af, card B's key data is 80..9f and its nonce b0..bf, and the
+ * volume ID is 40..7f. The plaintext is (i * 7 + 3) for byte i. The answers
+ * come from OrthrusDecrypt.java's key derivation and XEX (run the other way
+ * for the ciphertext, as Crypto.c does on a write).
+ */
+const uint8_t VOLUME_KEY[] = {
+	0x98, 0xf2, 0xd8, 0x0d, 0xac, 0xe8, 0x46, 0x50, 0x5b, 0xe7, 0x30, 0x6b, 0x43, 0xf9, 0x7a, 0x85,
+	0x6f, 0x93, 0xd2, 0x2d, 0x7d, 0x2e, 0x37, 0xd2, 0x36, 0x9b, 0x9e, 0xf2, 0x05, 0x11, 0xda, 0x0f,
+};
+
+// Volume block 5, 512 byte blocks (so card B, with card A's nonce).
+const uint8_t XEX512_CIPHERTEXT[] = {
+	0x9c, 0x3d, 0x1d, 0x1f, 0xb0, 0x98, 0xc1, 0x9c, 0xbe, 0x85, 0xd8, 0x92, 0xb1, 0xd9, 0xbd, 0xcc,
+	0x0d, 0x8b, 0xee, 0xc0, 0x7a, 0xac, 0x46, 0xb9, 0xdf, 0xcd, 0x52, 0xb2, 0x2f, 0xfc, 0x95, 0x60,
+	0x9d, 0x20, 0xba, 0x49, 0x3e, 0xdc, 0x27, 0xd3, 0xbb, 0xc4, 0xd7, 0x37, 0x0b, 0x4f, 0x91, 0x8a,
+	0x29, 0x0a, 0x96, 0xfc, 0xf0, 0x17, 0x40, 0xbe, 0xaa, 0x5c, 0x33, 0xaf, 0x7e, 0xa6, 0xef, 0x4e,
+	0xf1, 0xdb, 0x86, 0xb0, 0x94, 0x03, 0x79, 0xe4, 0x41, 0x23, 0x78, 0xcd, 0x08, 0x3f, 0x96, 0x19,
+	0xf1, 0x96, 0x6e, 0x0f, 0xf0, 0x5a, 0x3d, 0x63, 0xd5, 0xb6, 0x04, 0x72, 0x70, 0x8e, 0x9f, 0xef,
+	0x38, 0x40, 0x65, 0xf1, 0xc9, 0x92, 0x5d, 0x27, 0xa8, 0x08, 0xea, 0x34, 0xb4, 0xbc, 0x7c, 0xaa,
+	0xe5, 0x1e, 0xe1, 0x0c, 0xaf, 0x48, 0x54, 0xf9, 0x9b, 0x5d, 0x7b, 0xdb, 0x1a, 0xc0, 0xfe, 0xd2,
+	0x8b, 0xa7, 0x71, 0x46, 0xc8, 0x61, 0x6b, 0xed, 0x91, 0x83, 0x03, 0xaf, 0xc0, 0x94, 0x50, 0xfd,
+	0x50, 0xe6, 0x3b, 0xbd, 0x07, 0x09, 0x29, 0x37, 0xd3, 0xae, 0xbd, 0xac, 0x23, 0xc1, 0xfc, 0x91,
+	0x82, 0xcc, 0xef, 0x46, 0x83, 0xe1, 0x87, 0xd2, 0x46, 0xb5, 0x24, 0xda, 0xde, 0x5c, 0x6b, 0x46,
+	0xf5, 0x0a, 0x68, 0x82, 0xe1, 0x99, 0x35, 0x8c, 0x1c, 0x7d, 0x46, 0x3b, 0xac, 0x8d, 0x51, 0xeb,
+	0x71, 0xc1, 0x59, 0xf6, 0xa1, 0xd0, 0x12, 0xb6, 0xe7, 0xd9, 0x2c, 0x5e, 0xd4, 0x13, 0x67, 0xd4,
+	0xe5, 0xf7, 0xdb, 0xf9, 0x8d, 0x86, 0xe6, 0x91, 0x81, 0x57, 0xce, 0x16, 0x99, 0xa1, 0x8e, 0xeb,
+	0xa9, 0xd6, 0x06, 0x82, 0x6c, 0x68, 0x18, 0xb1, 0xae, 0x8c, 0xc6, 0x56, 0x48, 0x42, 0xf4, 0x84,
+	0xbc, 0x1d, 0x70, 0x5b, 0x20, 0xa3, 0xa6, 0x50, 0x82, 0x89, 0x82, 0x92, 0xdd, 0xa6, 0xce, 0xa4,
+	0xc4, 0x87, 0x4b, 0x1b, 0x84, 0x6a, 0x15, 0x2e, 0x16, 0x66, 0xdc, 0x91, 0x09, 0xfc, 0x78, 0xaf,
+	0xb1, 0xa9, 0x5b, 0xa8, 0x34, 0x11, 0x53, 0x3c, 0x77, 0xc2, 0x94, 0xf6, 0x4d, 0xaf, 0x86, 0xc5,
+	0xe1, 0xe4, 0xd4, 0xaf, 0x97, 0x2d, 0xd5, 0x30, 0x08, 0xdf, 0x0c, 0xb3, 0x30, 0x25, 0x83, 0xbc,
+	0x69, 0x61, 0x7e, 0x29, 0xa7, 0x73, 0x12, 0x97, 0xd7, 0xd7, 0x83, 0xa5, 0xb2, 0x98, 0xee, 0x7b,
+	0x03, 0x35, 0xdf, 0x7e, 0x16, 0xf2, 0xc8, 0xe4, 0xf1, 0x7d, 0x53, 0xae, 0x4c, 0x2c, 0x99, 0x2c,
+	0x81, 0x58, 0xe7, 0xfb, 0xce, 0x1f, 0x46, 0xa9, 0x30, 0x75, 0x96, 0x5b, 0x79, 0x8e, 0xca, 0xb1,
+	0xe0, 0x6c, 0x0f, 0xa3, 0xc5, 0x9c, 0x37, 0xfd, 0xf0, 0x6d, 0xc6, 0x63, 0xdb, 0x25, 0x74, 0x88,
+	0x10, 0x91, 0x4f, 0xa8, 0xd6, 0x3c, 0xf8, 0x63, 0x6e, 0x6b, 0x52, 0xce, 0xc9, 0x30, 0xbe, 0x14,
+	0x93, 0xe0, 0x17, 0xc9, 0x29, 0x51, 0xef, 0xa4, 0xc6, 0x6b, 0x37, 0x94, 0x6a, 0xa5, 0x7b, 0x5b,
+	0xd9, 0xee, 0xae, 0xa0, 0x78, 0xeb, 0xa4, 0x0f, 0x8b, 0x22, 0x51, 0xac, 0x26, 0xdf, 0xc8, 0xc6,
+	0xdb, 0x18, 0x3f, 0xea, 0xa3, 0xce, 0xa2, 0x46, 0x6a, 0x1b, 0x90, 0x56, 0x10, 0x03, 0x6c, 0x9e,
+	0xbb, 0x53, 0x65, 0x26, 0x0c, 0x00, 0x43, 0xfa, 0x0d, 0xa6, 0x7e, 0x6b, 0x88, 0xe8, 0x5c, 0xae,
+	0xe0, 0x30, 0xa7, 0xc4, 0xd0, 0x0b, 0x28, 0x3d, 0x8b, 0xc9, 0xb7, 0x67, 0xf5, 0x37, 0xa7, 0x6a,
+	0x17, 0x3d, 0x64, 0x41, 0x00, 0x44, 0x78, 0xd2, 0x06, 0xa1, 0xa4, 0x58, 0xea, 0xc4, 0x20, 0x1a,
+	0xd4, 0x28, 0xa9, 0x1f, 0x86, 0xa4, 0xd2, 0xa9, 0xc2, 0x91, 0x47, 0xd9, 0xb2, 0x27, 0xbb, 0xe9,
+	0xb7, 0xb8, 0x9d, 0x53, 0xbf, 0xca, 0x1d, 0xbf, 0x36, 0x43, 0x70, 0x8e, 0xc6, 0x00, 0x68, 0xb5,
+};
+
+// Volume block 0x123456788, 4096 byte blocks (card A, with card B's nonce -
+// and the top half of the block number XORed into it): the first and last 64 bytes.
+const uint8_t XEX4K_CIPHERTEXT_HEAD[] = {
+	0x5f, 0x7b, 0x22, 0xda, 0xb2, 0xa5, 0xe5, 0x63, 0x98, 0xcc, 0x5d, 0x3e, 0x18, 0xbe, 0x80, 0x60,
+	0xa0, 0x33, 0x0a, 0x6c, 0xbb, 0xed, 0x22, 0xaa, 0x17, 0xeb, 0x90, 0x74, 0x60, 0x38, 0xab, 0xd5,
+	0xb5, 0x15, 0x57, 0x37, 0x8c, 0x73, 0x9a, 0xf1, 0x84, 0xee, 0xf2, 0xc2, 0x11, 0x75, 0xb2, 0x3f,
+	0xf2, 0x9f, 0x6c, 0x9e, 0x32, 0x0f, 0xe1, 0x1e, 0xa7, 0xa1, 0xce, 0x08, 0x36, 0x8d, 0x13, 0x71,
+};
+const uint8_t XEX4K_CIPHERTEXT_TAIL[] = {
+	0x6a, 0x65, 0xf7, 0xf6, 0x95, 0x10, 0x08, 0x45, 0x0d, 0x41, 0x27, 0xe3, 0xa6, 0xc8, 0xe7, 0xc6,
+	0x08, 0x6b, 0xac, 0xb8, 0x29, 0xca, 0xf2, 0x9c, 0xa5, 0x5a, 0x51, 0x7e, 0x0b, 0x65, 0xce, 0x06,
+	0xb5, 0x02, 0x68, 0x32, 0xb8, 0x02, 0xbd, 0x37, 0x86, 0xe9, 0xfa, 0x0d, 0x5e, 0x5b, 0x1c, 0xd3,
+	0xc5, 0xc5, 0x17, 0xf9, 0x5c, 0xbb, 0x03, 0xb7, 0xe9, 0x2c, 0x42, 0x55, 0x87, 0xde, 0xc7, 0x8b,
+};
+
+int failures;
+
+void check(bool ok, const std::string &what) {
+	if (ok) return;
+	fprintf(stderr, "FAIL: %s\n", what.c_str());
+	failures++;
+}
+
+void testKeyblocks(Keyblock &a, Keyblock &b) {
+	for(int i = 0; i < 64; i++) a.volid[i] = b.volid[i] = (uint8_t)(0x40 + i);
+	for(int i = 0; i < 32; i++) {
+		a.keydata[i] = (uint8_t)i;
+		b.keydata[i] = (uint8_t)(0x80 + i);
+	}
+	for(int i = 0; i < 16; i++) {
+		a.nonce[i] = (uint8_t)(0xa0 + i);
+		b.nonce[i] = (uint8_t)(0xb0 + i);
+	}
+}
+
+void testAes() {
+	Aes256 aes(AES_KEY);
+	uint8_t out[AES_BLOCK_SIZE];
+	aes.encrypt(AES_PLAINTEXT, out);
+	check(!memcmp(out, AES_CIPHERTEXT, sizeof(out)), "AES-256 encrypt");
+	aes.decrypt(AES_CIPHERTEXT, out);
+	check(!memcmp(out, AES_PLAINTEXT, sizeof(out)), "AES-256 decrypt");
+
+	Aes256 cmacKey(CMAC_KEY);
+	for(const auto &t : CMAC_TESTS) {
+		uint8_t mac[AES_BLOCK_SIZE];
+		cmac(cmacKey, CMAC_MESSAGE, t.length, mac);
+		check(!memcmp(mac, t.mac, sizeof(mac)), "CMAC of " + std::to_string(t.length) + " bytes");
+	}
+}
+
+void testKeyDerivation() {
+	Keyblock a, b;
+	testKeyblocks(a, b);
+	uint8_t key[AES_KEY_SIZE];
+	deriveVolumeKey(a, b, key);
+	check(!memcmp(key, VOLUME_KEY, sizeof(key)), "volume key derivation");
+}
+
+void testXex(const std::string &kernel) {
+	Keyblock a, b;
+	testKeyblocks(a, b);
+	Aes256 aes(VOLUME_KEY);
+	uint8_t plaintext[4096], buf[4096], nonce[AES_BLOCK_SIZE];
+	for(size_t i = 0; i < sizeof(plaintext); i++) plaintext[i] = (uint8_t)(i * 7 + 3);
+
+	blockNonce(a.nonce, 5, nonce);
+	xexEncrypt(aes, nonce, plaintext, buf, 512);
+	check(!memcmp(buf, XEX512_CIPHERTEXT, 512), kernel + ": XEX encrypt, 512 bytes");
+	xexDecrypt(aes, nonce, XEX512_CIPHERTEXT, buf, 512);
+	check(!memcmp(buf, plaintext, 512), kernel + ": XEX decrypt, 512 bytes");
+
+	blockNonce(b.nonce, 0x123456788ULL, nonce);
+	xexEncrypt(aes, nonce, plaintext, buf, 4096);
+	check(!memcmp(buf, XEX4K_CIPHERTEXT_HEAD, 64) && !memcmp(buf + 4096 - 64, XEX4K_CIPHERTEXT_TAIL, 64),
+		kernel + ": XEX encrypt, 4096 bytes");
+	xexDecrypt(aes, nonce, buf, buf, 4096); // in place
+	check(!memcmp(buf, plaintext, 4096), kernel + ": XEX decrypt, 4096 bytes");
+}
+
+// Every kernel has to agree with the one block at a time one, at every length.
+void testKernelsAgree() {
+	std::mt19937 rng(1);
+	uint8_t key[AES_KEY_SIZE];
+	for(auto &k : key) k = (uint8_t)rng();
+	Aes256 aes(key);
+	const size_t MAX = 4096 + 48, COUNT = 3;
+	std::vector<uint8_t> nonces(COUNT * AES_BLOCK_SIZE), in(COUNT * MAX);
+	for(auto &v : nonces) v = (uint8_t)rng();
+	for(auto &v : in) v = (uint8_t)rng();
+
+	std::vector<std::string> kernels = xexKernels();
+	for(size_t length = AES_BLOCK_SIZE; length <= MAX; length += AES_BLOCK_SIZE) {
+		const uint8_t *blocks[COUNT];
+		for(size_t i = 0; i < COUNT; i++) blocks[i] = in.data() + i * length;
+		std::vector<uint8_t> want(COUNT * length), got(COUNT * length), back(COUNT * length);
+		xexUseKernel(kernels[0]);
+		xexDecryptBlocks(aes, nonces.data(), blocks, want.data(), COUNT, length);
+		for(const auto &kernel : kernels) {
+			xexUseKernel(kernel);
+			xexDecryptBlocks(aes, nonces.data(), blocks, got.data(), COUNT, length);
+			check(got == want, kernel + ": decrypt " + std::to_string(length) + " bytes");
+			const uint8_t *plain[COUNT];
+			for(size_t i = 0; i < COUNT; i++) plain[i] = got.data() + i * length;
+			xexEncryptBlocks(aes, nonces.data(), plain, back.data(), COUNT, length);
+			check(!memcmp(back.data(), in.data(), COUNT * length), kernel + ": encrypt " + std::to_string(length) + " bytes");
+		}
+	}
+}
+
+// One thread, over a buffer that fits in the cache, so it's the kernel that's timed.
+void bench() {
+	const size_t BUFFER = 1024 * 1024, BATCH = 16;
+	std::vector<uint8_t> buf(BUFFER);
+	for(size_t i = 0; i < BUFFER; i++) buf[i] = (uint8_t)i;
+	uint8_t key[AES_KEY_SIZE] = { 0 };
+	Aes256 aes(key);
+	for(const auto &kernel : xexKernels()) {
+		xexUseKernel(kernel);
+		for(size_t blockSize : { (size_t)512, (size_t)4096 }) {
+			for(bool decrypt : { true, false }) {
+				size_t blocks = BUFFER / blockSize;
+				std::vector<uint8_t> nonces(BATCH * AES_BLOCK_SIZE);
+				uint64_t bytes = 0;
+				auto start = std::chrono::steady_clock::now();
+				double secs;
+				do {
+					for(size_t first = 0; first < blocks; first += BATCH) {
+						const uint8_t *in[BATCH];
+						for(size_t i = 0; i < BATCH; i++) {
+							blockNonce(key, first + i, nonces.data() + i * AES_BLOCK_SIZE);
+							in[i] = buf.data() + (first + i) * blockSize;
+						}
+						if (decrypt)
+							xexDecryptBlocks(aes, nonces.data(), in, buf.data() + first * blockSize, BATCH, blockSize);
+						else
+							xexEncryptBlocks(aes, nonces.data(), in, buf.data() + first * blockSize, BATCH, blockSize);
+					}
+					bytes += BUFFER;
+					secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				} while(secs < 1.0);
+				printf("%-8s %4u byte blocks, %s: %6.2f GB/s\n", kernel.c_str(), (unsigned)blockSize,
+					decrypt ? "decrypt" : "encrypt", bytes / secs / 1e9);
+			}
+		}
+	}
+}
+
+}
+
+int main(int argc, char **argv) {
+	if (!aesAvailable()) {
+		fprintf(stderr, "this CPU doesn't have AES-NI\n");
+		return 1;
+	}
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		bench();
+		return 0;
+	}
+	std::string best = xexKernel();
+	testAes();
+	testKeyDerivation();
+	for(const auto &kernel : xexKernels()) {
+		xexUseKernel(kernel);
+		testXex(kernel);
+	}
+	testKernelsAgree();
+	xexUseKernel(best);
+	if (failures) {
+		fprintf(stderr, "%d failed\n", failures);
+		return 1;
+	}
+	std::string kernels;
+	for(const auto &kernel : xexKernels())
+		kernels += " " + kernel + (kernel == best ? " (used)" : "");
+	printf("all passed, kernels:%s\n", kernels.c_str());
+	return 0;
+}
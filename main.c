@@ -21,10 +21,34 @@
 #include <AES.h>
 #include <MCI.h>
 #include <Crypto.h>
+#include <Cache.h>
+#include <Pin.h>
 #include <hpl_delay.h>
 #include <usb_start.h>
 #include <hpl_pmc_config.h>
+#include <Sched.h>
+#include <Profile.h>
+#include <Trace.h>
+#include <Stats.h>
+#include <Diag.h>
+#include <Settings.h>
+#include <Raw.h>
+#include <Cbt.h>
+#include <InfoDisk.h>
 
+// .data and .bss get the 128 KB ram region to themselves (the stack, the heap
+// and the hot variables are in the DTCM). These are the big buffers in it.
+// The USB stack, ASF and everybody's odds and ends need RAM_RESERVE of it.
+#define RAM_BYTES (128UL * 1024)
+#define RAM_RESERVE (8UL * 1024)
+#ifdef INFO_DISK
+#define RAM_INFO_DISK INFO_DISK_RAM_BYTES
+#else
+#define RAM_INFO_DISK 0
+#endif
+#if CACHE_BYTES + STAGING_BYTES + 2 * CBT_BYTES + RAM_INFO_DISK > RAM_BYTES - RAM_RESERVE
+#error The buffers are too big for the RAM
+#endif
 
 enum volume_states { NO_CARDS, ERROR, OK, UNINITIALIZED };
 enum button_states { UP, DOWN, IGNORING };
@@ -44,8 +68,16 @@ uint8_t usb_serial_string[32]; // 15 chars from unique ID, plus length & type.
 // Millisecond counter - used for dealing with the button
 volatile uint32_t millis;
 
+// How often the watchdog gets fed, and how often the disk task gets a look
+// at the write-back cache when nothing else is happening. Powers of 2.
+#define WATCHDOG_INTERVAL (128)
+#define DISK_POLL_INTERVAL (64)
+
 static void milli_timer_cb(const struct timer_task *const timer_task) {
 	millis++;
+	sched_post(EV_TICK);
+	if ((millis & (WATCHDOG_INTERVAL - 1)) == 0) sched_post(EV_WATCHDOG);
+	if ((millis & (DISK_POLL_INTERVAL - 1)) == 0) sched_post(EV_DISK);
 }
 
 __attribute__((noinline)) __attribute__((section(".itcm"))) static void fetch_unique_id() {
@@ -59,101 +91,147 @@ __attribute__((noinline)) __attribute__((section(".itcm"))) static void fetch_un
 
 }
 
-__attribute__((noinline)) __attribute__((section(".itcm"))) static void do_main_loop(void) {
-	while (1) {
-		// We're alive as long as we keep coming through the main loop.
-		wdt_feed(&WDT_0);
-		
-		bool cards_in = !gpio_get_pin_level(CARD_DETECT_A) && !gpio_get_pin_level(CARD_DETECT_B);
-		if (cards_in && state == NO_CARDS) {
-			// cards have just been inserted. Get to work!
-			if (!init_cards()) {
-				state = ERROR;
-				goto error;
-			}
-			if (!prepVolume()) {
-				state = UNINITIALIZED;
-				goto error;
-			}							
-			state = OK;
-			gpio_set_pin_level(LED_RDY, true);
-			gpio_set_pin_level(LED_ERR, false);
-			set_state(READY);
-			continue;
+// The card detect switches and the buttons interrupt on any change. The
+// tasks look at the pin levels, so bounces just mean an extra look.
+#define PIOB_EVENT_PINS (1UL << GPIO_PIN(BUTTON))
+#define PIOD_EVENT_PINS ((1UL << GPIO_PIN(CARD_DETECT_A)) | (1UL << GPIO_PIN(CARD_DETECT_B)) | (1UL << GPIO_PIN(BUTTON_ALT)))
+
+void PIOB_Handler(void) {
+	if (PIOB->PIO_ISR & PIOB_EVENT_PINS) sched_post(EV_BUTTON); // reading ISR clears it
+}
+
+void PIOD_Handler(void) {
+	uint32_t changed = PIOD->PIO_ISR; // reading ISR clears it
+	if (changed & ((1UL << GPIO_PIN(CARD_DETECT_A)) | (1UL << GPIO_PIN(CARD_DETECT_B)))) sched_post(EV_CARDS);
+	if (changed & (1UL << GPIO_PIN(BUTTON_ALT))) sched_post(EV_BUTTON);
+}
+
+static void pin_events_init(void) {
+	(void)PIOB->PIO_ISR; // clear anything stale
+	(void)PIOD->PIO_ISR;
+	PIOB->PIO_IER = PIOB_EVENT_PINS;
+	PIOD->PIO_IER = PIOD_EVENT_PINS;
+	NVIC_ClearPendingIRQ(PIOB_IRQn);
+	NVIC_ClearPendingIRQ(PIOD_IRQn);
+	NVIC_EnableIRQ(PIOB_IRQn);
+	NVIC_EnableIRQ(PIOD_IRQn);
+}
+
+static void watchdog_task(void) {
+	// This is the lowest priority task, so if we get here, everything else is getting
+	// its turn too.
+	wdt_feed(&WDT_0);
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) static void cards_task(void) {
+	bool cards_in = !gpio_get_pin_level(CARD_DETECT_A) && !gpio_get_pin_level(CARD_DETECT_B);
+	if (cards_in && state == NO_CARDS) {
+		// cards have just been inserted. Get to work!
+		if (!init_cards()) {
+			state = ERROR;
+			goto error;
+		}
+		if (!prepVolume()) {
+			state = UNINITIALIZED;
+			goto error;
+		}							
+		state = OK;
+		gpio_set_pin_level(LED_RDY, true);
+		gpio_set_pin_level(LED_ERR, false);
+		set_state(READY);
+		return;
 error:
-			gpio_set_pin_level(LED_ERR, true);
-			gpio_set_pin_level(LED_RDY, false);
-			continue;			
-		} else if (!cards_in && state != NO_CARDS) {
-			// cards have just been removed. Turn everything off.
-			shutdown_cards();
-			unmountVolume();
-			if (state == OK) {
-				set_state(NOT_READY);
-			}
-			state = NO_CARDS;
-			gpio_set_pin_level(LED_ERR, false);
-			gpio_set_pin_level(LED_RDY, false);
-			continue;	
+		gpio_set_pin_level(LED_ERR, true);
+		gpio_set_pin_level(LED_RDY, false);
+		return;
+	} else if (!cards_in && state != NO_CARDS) {
+		// cards have just been removed. Try to get anything still in the
+		// write-back cache (and the changed block record) onto them - the detect switches open before the
+		// contacts do, so there's a chance - and then turn everything off.
+		if (state == OK) {
+			flushVolume();
+			cbt_checkpoint();
 		}
-		
-		// Handle the button being held down.
-		if (button_state == DOWN) {
-			if (millis - button_start > 5000) { // 5 seconds
-				button_state = IGNORING;
-				gpio_set_pin_level(LED_ERR, false);
-				gpio_set_pin_level(LED_RDY, false);
-				if (initVolume()) {
-					gpio_set_pin_level(LED_ERR, false);
+		raw_revoke();
+		shutdown_cards();
+		unmountVolume();
+		if (state == OK) {
+			set_state(NOT_READY);
+		}
+		state = NO_CARDS;
+		gpio_set_pin_level(LED_ERR, false);
+		gpio_set_pin_level(LED_RDY, false);
+	}
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) static void button_task(void) {
+	bool button = !gpio_get_pin_level(BUTTON) || !gpio_get_pin_level(BUTTON_ALT);
+	
+	if (button) {
+		switch(button_state) {
+			case UP: // The button was *just* pushed.
+				if (raw_button()) {
+					// It was to allow a backup, not to start the countdown.
+					button_state = IGNORING;
 					gpio_set_pin_level(LED_RDY, true);
-					state = OK;
-					set_state(READY);
+				} else if (state == UNINITIALIZED || state == OK) {
+					// Initializing the card is only possible in those two states
+					button_state = DOWN;
+					button_start = millis;
 				} else {
-					gpio_set_pin_level(LED_ERR, true);
-					gpio_set_pin_level(LED_RDY, false);
-					state = ERROR;
-					set_state(NOT_READY);
+					// Wrong state. Ignore the button.
+					button_state = IGNORING;
 				}
-			} else {
-				// Make the ERROR LED blink as a warning
-				gpio_set_pin_level(LED_ERR, (((millis - button_start) / 250) % 2)?false:true);
-			}
+				break;
+			case IGNORING:
+			case DOWN:
+				// nothing has changed
+				break;
 		}
-		
-		bool button = !gpio_get_pin_level(BUTTON) || !gpio_get_pin_level(BUTTON_ALT);
-		
-		if (button) {
-			switch(button_state) {
-				case UP: // The button was *just* pushed.
-					if (state == UNINITIALIZED || state == OK) {
-						// Initializing the card is only possible in those two states
-						button_state = DOWN;
-						button_start = millis;
-					} else {
-						// Wrong state. Ignore the button.
-						button_state = IGNORING;
-					}
-					break;
-				case IGNORING:
-				case DOWN:
-					// nothing has changed
-					break;
+	} else {
+		if (button_state != UP) {
+			// The button was released before the time elapsed.
+			// Return everything to status quo ante.
+			if (state == OK) {
+				gpio_set_pin_level(LED_RDY, true);
+				gpio_set_pin_level(LED_ERR, false);
+			} else if (state == ERROR || state == UNINITIALIZED) {
+				gpio_set_pin_level(LED_RDY, false);
+				gpio_set_pin_level(LED_ERR, true);
 			}
+		}
+		button_state = UP;
+	}
+}
+
+__attribute__((noinline)) __attribute__((section(".itcm"))) static void tick_task(void) {
+	if (raw_waiting()) {
+		// Blink the ready LED to ask for the button.
+		gpio_set_pin_level(LED_RDY, ((millis / 125) % 2)?false:true);
+		raw_tick();
+		if (!raw_waiting()) gpio_set_pin_level(LED_RDY, state == OK);
+		return;
+	}
+	// Handle the button being held down.
+	if (button_state != DOWN) return;
+	if (millis - button_start > 5000) { // 5 seconds
+		button_state = IGNORING;
+		gpio_set_pin_level(LED_ERR, false);
+		gpio_set_pin_level(LED_RDY, false);
+		if (initVolume(INIT_VOLUME_FLAGS)) {
+			gpio_set_pin_level(LED_ERR, false);
+			gpio_set_pin_level(LED_RDY, true);
+			state = OK;
+			set_state(READY);
 		} else {
-			if (button_state != UP) {
-				// The button was released before the time elapsed.
-				// Return everything to status quo ante.
-				if (state == OK) {
-					gpio_set_pin_level(LED_RDY, true);
-					gpio_set_pin_level(LED_ERR, false);
-				} else if (state == ERROR || state == UNINITIALIZED) {
-					gpio_set_pin_level(LED_RDY, false);
-					gpio_set_pin_level(LED_ERR, true);
-				}
-			}
-			button_state = UP;
+			gpio_set_pin_level(LED_ERR, true);
+			gpio_set_pin_level(LED_RDY, false);
+			state = ERROR;
+			set_state(NOT_READY);
 		}
-		disk_task();
+	} else {
+		// Make the ERROR LED blink as a warning
+		gpio_set_pin_level(LED_ERR, (((millis - button_start) / 250) % 2)?false:true);
 	}
 }
 
@@ -197,6 +275,19 @@ int main(void)
 
 	rand_sync_enable(&RAND_0);
 
+	// Before anything can look at the cache - the stats take a baseline of its
+	// counters and the settings may flush it.
+	cache_init();
+	pin_reset(); // its state is in the DTCM too
+	stats_init();
+	settings_init();
+#ifdef PROFILE
+	profile_init();
+#endif
+#ifdef TRACE
+	trace_init();
+#endif
+
 	// The timer's job is to just keep a millisecond counter running for us.
 	// We use this for some timeout calculation in the MCI code and for
 	// timing button events.
@@ -210,7 +301,20 @@ int main(void)
 	button_state = UP;
 	set_state(NOT_READY);
 	
+	sched_register(EV_DISK, disk_task);
+	sched_register(EV_DIAG, diag_task);
+	sched_register(EV_SETTINGS, settings_task);
+	sched_register(EV_RAW, raw_task);
+	sched_register(EV_CARDS, cards_task);
+	sched_register(EV_BUTTON, button_task);
+	sched_register(EV_TICK, tick_task);
+	sched_register(EV_WATCHDOG, watchdog_task);
+	pin_events_init();
+	// Look at the pins once to start with - the cards may already be in.
+	sched_post(EV_CARDS);
+	sched_post(EV_BUTTON);
+
 	delay_ms(25); // Can't feed the watchdoog too soon after enabling it.
 	// The loop portion of main() is in a different method so it can go into ITCM.
-	do_main_loop();
+	sched_run();
 }
@@ -43,11 +43,25 @@
 
 #include "mscdf.h"
 #include <string.h>
+#include <Trace.h>
+#include <Stats.h>
 
 #define MSCDF_VERSION 0x00000001u
 
 #define ERR_RPT_ZLP 0 /* Uses ZLP on IN error case */
 
+/* spc_protocol.h doesn't have these */
+#define SCSI_ASC_DIAGNOSTIC_FAILURE 0x4000
+#ifndef SCSI_SK_MEDIUM_ERROR
+#define SCSI_SK_MEDIUM_ERROR 0x03
+#endif
+#ifndef SCSI_ASC_WRITE_ERROR
+#define SCSI_ASC_WRITE_ERROR 0x0C00
+#endif
+#ifndef SCSI_ASC_UNRECOVERED_READ_ERROR
+#define SCSI_ASC_UNRECOVERED_READ_ERROR 0x1100
+#endif
+
 /** MSC Class Transfer Stage Type */
 enum mscdf_xfer_stage_type { MSCDF_CMD_STAGE, MSCDF_DATA_STAGE, MSCDF_STATUS_STAGE };
 
@@ -63,8 +77,8 @@ struct mscdf_func_data {
 	uint8_t func_max_lun;
 	/** MSC Transfer Block Address */
 	uint8_t *xfer_blk_addr;
-	/** MSC Transfer Block Size */
-	uint32_t xfer_blk_size;
+	/** MSC Transfer Block Size, for each LUN (Bulk-Only allows up to 16) */
+	uint32_t xfer_blk_size[16];
 	/** MSC Transfer Total Bytes */
 	uint32_t xfer_tot_bytes;
 	/** MSC Transfer Stage */
@@ -84,11 +98,20 @@ static struct mscdf_func_data _mscdf_funcd;
  */
 static mscdf_inquiry_disk_t      mscdf_inquiry_disk      = NULL;
 static mscdf_get_disk_capacity_t mscdf_get_disk_capacity = NULL;
+static mscdf_get_disk_capacity16_t mscdf_get_disk_capacity16 = NULL;
 static mscdf_eject_disk_t        mscdf_eject_disk        = NULL;
 static mscdf_start_read_disk_t   mscdf_read_disk         = NULL;
 static mscdf_start_write_disk_t  mscdf_write_disk        = NULL;
 static mscdf_test_disk_ready_t   mscdf_test_disk_ready   = NULL;
 static mscdf_xfer_blocks_done_t  mscdf_xfer_blocks_done  = NULL;
+static mscdf_sync_cache_t        mscdf_sync_cache        = NULL;
+static mscdf_mode_sense_t        mscdf_mode_sense        = NULL;
+static mscdf_ext_cmd_t           mscdf_ext_cmd           = NULL;
+static mscdf_ext_data_out_t      mscdf_ext_data_out      = NULL;
+
+/** Where an extended command is up to */
+enum mscdf_ext_phase { MSCDF_EXT_NONE, MSCDF_EXT_WAIT_START, MSCDF_EXT_DATA_IN, MSCDF_EXT_DATA_OUT, MSCDF_EXT_WAIT_STATUS };
+static volatile enum mscdf_ext_phase mscdf_ext_phase = MSCDF_EXT_NONE;
 
 COMPILER_ALIGNED(4)
 static struct scsi_inquiry_data _inquiry_default = {
@@ -115,6 +138,22 @@ COMPILER_ALIGNED(4)
 static struct scsi_request_sense_data mscdf_sense_data
     = {SCSI_SENSE_CURRENT, 0x00, 0x00, {0x00, 0x00, 0x00, 0x00}, 0x0A};
 
+/**
+ * \brief Is this CDB a block read?
+ */
+static inline bool mscdf_is_read_cmd(uint8_t opcode)
+{
+	return opcode == SBC_READ10 || opcode == SBC_READ16;
+}
+
+/**
+ * \brief Is this CDB a block write?
+ */
+static inline bool mscdf_is_write_cmd(uint8_t opcode)
+{
+	return opcode == SBC_WRITE10 || opcode == SBC_WRITE16;
+}
+
 /**
  * \brief USB MSC wait Command Block
  */
@@ -129,6 +168,8 @@ static bool mscdf_wait_cbw(void)
  */
 static bool mscdf_send_csw(void)
 {
+	TRACE_EVENT(TR_CSW, mscdf_csw.bCSWStatus, 0);
+	stats_status();
 	_mscdf_funcd.xfer_stage = MSCDF_STATUS_STAGE;
 	return ERR_NONE == usbdc_xfer(_mscdf_funcd.func_ep_in, (uint8_t *)&mscdf_csw, sizeof(struct usb_msc_csw), false);
 }
@@ -178,6 +219,28 @@ static void mscdf_request_sense(int32_t err_codes)
 		mscdf_sense_data.sense_flag_key = SCSI_SK_DATA_PROTECT;
 		mscdf_sense_data.AddSense       = BE16(SCSI_ASC_WRITE_PROTECTED);
 		break;
+	case ERR_INVALID_ARG:
+		mscdf_sense_data.sense_flag_key = SCSI_SK_ILLEGAL_REQUEST;
+		mscdf_sense_data.AddSense       = BE16(SCSI_ASC_INVALID_FIELD_IN_CDB);
+		break;
+	case ERR_IO:
+		/* Whatever was going to the medium didn't get there, or what was coming off it didn't come */
+		mscdf_sense_data.sense_flag_key = SCSI_SK_MEDIUM_ERROR;
+		if (mscdf_is_write_cmd(mscdf_cbw.CDB[0]) || mscdf_cbw.CDB[0] == SBC_SYNCHRONIZE_CACHE10
+		    || mscdf_cbw.CDB[0] == SBC_SYNCHRONIZE_CACHE16 || !(mscdf_cbw.bmCBWFlags & USB_EP_DIR_IN)) {
+			mscdf_sense_data.AddSense = BE16(SCSI_ASC_WRITE_ERROR);
+		} else {
+			mscdf_sense_data.AddSense = BE16(SCSI_ASC_UNRECOVERED_READ_ERROR);
+		}
+		break;
+	case ERR_DIAG_FAILED:
+		mscdf_sense_data.sense_flag_key = SCSI_SK_HARDWARE_ERROR;
+		mscdf_sense_data.AddSense       = BE16(SCSI_ASC_DIAGNOSTIC_FAILURE);
+		break;
+	case ERR_BAD_ADDRESS:
+		mscdf_sense_data.sense_flag_key = SCSI_SK_ILLEGAL_REQUEST;
+		mscdf_sense_data.AddSense       = BE16(SCSI_ASC_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE);
+		break;
 
 	default:
 		mscdf_sense_data.sense_flag_key = SCSI_SK_ILLEGAL_REQUEST;
@@ -205,6 +268,68 @@ static bool mscdf_invalid_cmd(void)
 	}
 }
 
+/**
+ * \brief Send the status for an extended command, once any data stage is over
+ * \param[in] ret what the callback returned
+ */
+static bool mscdf_ext_status(int32_t ret)
+{
+	struct usb_msc_cbw *pcbw = &mscdf_cbw;
+	struct usb_msc_csw *pcsw = &mscdf_csw;
+
+	if (ERR_SUSPEND == ret) {
+		mscdf_ext_phase         = MSCDF_EXT_WAIT_STATUS;
+		_mscdf_funcd.xfer_stage = MSCDF_DATA_STAGE;
+		return false;
+	}
+	mscdf_ext_phase = MSCDF_EXT_NONE;
+	if (ERR_NONE == ret) {
+		pcsw->bCSWStatus = USB_CSW_STATUS_PASS;
+	} else {
+		pcsw->bCSWStatus = USB_CSW_STATUS_FAIL;
+		mscdf_request_sense(ret);
+	}
+	if ((pcbw->bmCBWFlags & USB_EP_DIR_IN) && pcsw->dCSWDataResidue) {
+		/* The host wanted more than it got */
+		return mscdf_terminate_in();
+	}
+	return mscdf_send_csw();
+}
+
+/**
+ * \brief Start the data stage of an extended command (or go straight to the status)
+ * \param[in] ret what the callback returned
+ * \param[in] buf the data buffer
+ * \param[in] len the data length
+ */
+static bool mscdf_ext_data(int32_t ret, uint8_t *buf, uint32_t len)
+{
+	struct usb_msc_cbw *pcbw = &mscdf_cbw;
+	struct usb_msc_csw *pcsw = &mscdf_csw;
+
+	if (ERR_SUSPEND == ret) {
+		mscdf_ext_phase         = MSCDF_EXT_WAIT_START;
+		_mscdf_funcd.xfer_stage = MSCDF_DATA_STAGE;
+		return false;
+	}
+	if (ERR_NONE != ret || 0 == len || NULL == buf) {
+		return mscdf_ext_status(ret);
+	}
+	if (len > pcbw->dCBWDataTransferLength) {
+		len = pcbw->dCBWDataTransferLength;
+	}
+	pcsw->dCSWDataResidue   = pcbw->dCBWDataTransferLength - len;
+	_mscdf_funcd.xfer_stage = MSCDF_DATA_STAGE;
+	if (pcbw->bmCBWFlags & USB_EP_DIR_IN) {
+		pcsw->bCSWStatus = USB_CSW_STATUS_PASS;
+		mscdf_ext_phase  = MSCDF_EXT_DATA_IN;
+		return ERR_NONE == usbdc_xfer(_mscdf_funcd.func_ep_in, buf, len, true);
+	} else {
+		mscdf_ext_phase = MSCDF_EXT_DATA_OUT;
+		return ERR_NONE == usbdc_xfer(_mscdf_funcd.func_ep_out, buf, len, false);
+	}
+}
+
 /**
  * \brief USB MSC Function Read / Write Data
  * \param[in] count the amount of bytes has been transferred
@@ -215,22 +340,32 @@ static bool mscdf_read_write(uint32_t count)
 	struct usb_msc_cbw *pcbw = &mscdf_cbw;
 	struct usb_msc_csw *pcsw = &mscdf_csw;
 	int32_t             ret  = ERR_UNSUPPORTED_OP;
-	uint32_t            address, nblocks;
+	uint64_t            address;
+	uint32_t            nblocks;
 	uint8_t             ep;
 
 	if (_mscdf_funcd.xfer_stage == MSCDF_CMD_STAGE) {
-		address = (uint32_t)(pcbw->CDB[2] << 24) + (uint32_t)(pcbw->CDB[3] << 16) + (uint32_t)(pcbw->CDB[4] << 8)
-		          + pcbw->CDB[5];
-		nblocks = (uint32_t)(pcbw->CDB[7] << 8) + pcbw->CDB[8];
-		if (pcbw->CDB[0] == SBC_READ10) {
+		if (pcbw->CDB[0] == SBC_READ16 || pcbw->CDB[0] == SBC_WRITE16) {
+			address = 0;
+			for (int i = 2; i < 10; i++) {
+				address = (address << 8) | pcbw->CDB[i];
+			}
+			nblocks = (uint32_t)(pcbw->CDB[10] << 24) + (uint32_t)(pcbw->CDB[11] << 16)
+			          + (uint32_t)(pcbw->CDB[12] << 8) + pcbw->CDB[13];
+		} else {
+			address = (uint32_t)(pcbw->CDB[2] << 24) + (uint32_t)(pcbw->CDB[3] << 16)
+			          + (uint32_t)(pcbw->CDB[4] << 8) + pcbw->CDB[5];
+			nblocks = (uint32_t)(pcbw->CDB[7] << 8) + pcbw->CDB[8];
+		}
+		if (mscdf_is_read_cmd(pcbw->CDB[0])) {
 			if (NULL != mscdf_read_disk) {
 				ret = mscdf_read_disk(pcbw->bCBWLUN, address, nblocks);
 			} else {
 				ret = ERR_NOT_FOUND;
 			}
-		} else if (pcbw->CDB[0] == SBC_WRITE10) {
+		} else if (mscdf_is_write_cmd(pcbw->CDB[0])) {
 			if (NULL != mscdf_write_disk) {
-				ret = mscdf_write_disk(pcbw->bCBWLUN, address, nblocks);
+				ret = mscdf_write_disk(pcbw->bCBWLUN, address, nblocks, (pcbw->CDB[1] & SBC_CDB1_FUA) != 0);
 			} else {
 				ret = ERR_NOT_FOUND;
 			}
@@ -259,7 +394,7 @@ static bool mscdf_read_write(uint32_t count)
 			if (NULL != mscdf_xfer_blocks_done) {
 				mscdf_xfer_blocks_done(pcbw->bCBWLUN);
 			}
-			if (pcsw->dCSWDataResidue == 0 && pcbw->CDB[0] == SBC_READ10) {
+			if (pcsw->dCSWDataResidue == 0 && mscdf_is_read_cmd(pcbw->CDB[0])) {
 				pcsw->bCSWStatus = USB_CSW_STATUS_PASS;
 				return mscdf_send_csw();
 			} else {
@@ -267,7 +402,7 @@ static bool mscdf_read_write(uint32_t count)
 			}
 		} else {
 			_mscdf_funcd.xfer_blk_addr += count;
-			if (pcbw->CDB[0] == SBC_READ10) {
+			if (mscdf_is_read_cmd(pcbw->CDB[0])) {
 				ep = _mscdf_funcd.func_ep_in;
 			} else {
 				ep = _mscdf_funcd.func_ep_out;
@@ -299,9 +434,10 @@ static bool mscdf_cb_ep_bulk_in(const uint8_t ep, const enum usb_xfer_code rc, c
 	}
 
 	if (_mscdf_funcd.xfer_stage == MSCDF_DATA_STAGE) {
-		if (pcbw->CDB[0] == SBC_READ10) {
+		if (mscdf_is_read_cmd(pcbw->CDB[0])) {
 			return mscdf_read_write(count);
 		} else {
+			mscdf_ext_phase = MSCDF_EXT_NONE;
 			return mscdf_send_csw();
 		}
 	} else if (_mscdf_funcd.xfer_stage == MSCDF_STATUS_STAGE) {
@@ -336,6 +472,9 @@ static bool mscdf_cb_ep_bulk_out(const uint8_t ep, const enum usb_xfer_code rc,
 		if (pcbw->dCBWSignature == USB_CBW_SIGNATURE) {
 			pcsw->dCSWTag         = pcbw->dCBWTag;
 			pcsw->dCSWDataResidue = pcbw->dCBWDataTransferLength;
+			mscdf_ext_phase       = MSCDF_EXT_NONE;
+			TRACE_EVENT(TR_CBW, pcbw->CDB[0], (uint16_t)pcbw->dCBWTag);
+			stats_command(pcbw->CDB[0]);
 
 			switch (pcbw->CDB[0]) {
 			case SPC_INQUIRY:
@@ -350,17 +489,51 @@ static bool mscdf_cb_ep_bulk_out(const uint8_t ep, const enum usb_xfer_code rc,
 				pcsw->dCSWDataResidue   = 0;
 				return ERR_NONE == usbdc_xfer(_mscdf_funcd.func_ep_in, pbuf, 36, false);
 			case SPC_MODE_SENSE6:
+				if (NULL != mscdf_mode_sense) {
+					pbuf = mscdf_mode_sense(pcbw->bCBWLUN, pcbw->CDB[2] & 0x3F);
+				}
+				if (NULL != pbuf) {
+					uint32_t len = pbuf[0] + 1;
+					if (len > pcbw->CDB[4]) {
+						len = pcbw->CDB[4];
+					}
+					if (len > pcbw->dCBWDataTransferLength) {
+						len = pcbw->dCBWDataTransferLength;
+					}
+					_mscdf_funcd.xfer_stage = MSCDF_DATA_STAGE;
+					pcsw->bCSWStatus = USB_CSW_STATUS_PASS;
+					pcsw->dCSWDataResidue = pcbw->dCBWDataTransferLength - len;
+					return ERR_NONE == usbdc_xfer(_mscdf_funcd.func_ep_in, pbuf, len, true);
+				}
 				_mscdf_funcd.xfer_stage = MSCDF_DATA_STAGE;
 				pcsw->bCSWStatus = USB_CSW_STATUS_PASS;
 				pcsw->dCSWDataResidue = pcbw->dCBWDataTransferLength - sizeof(ms6_buf);
 				return ERR_NONE == usbdc_xfer(_mscdf_funcd.func_ep_in, (uint8_t*)ms6_buf, sizeof(ms6_buf), true);
+
+			case SBC_SYNCHRONIZE_CACHE10:
+			case SBC_SYNCHRONIZE_CACHE16:
+				pcsw->dCSWDataResidue = 0;
+				if (NULL == mscdf_sync_cache) {
+					// Nothing is cached, so there's nothing to do.
+					pcsw->bCSWStatus = USB_CSW_STATUS_PASS;
+					return mscdf_send_csw();
+				}
+				ret = mscdf_sync_cache(pcbw->bCBWLUN);
+				if (ERR_NONE == ret) {
+					// The status stage comes once the flush is done.
+					_mscdf_funcd.xfer_stage = MSCDF_DATA_STAGE;
+					return false;
+				}
+				pcsw->bCSWStatus = USB_CSW_STATUS_FAIL;
+				mscdf_request_sense(ret);
+				return mscdf_send_csw();
 			case SBC_READ_CAPACITY10:
 				if (NULL != mscdf_get_disk_capacity) {
 					pbuf = mscdf_get_disk_capacity(pcbw->bCBWLUN);
 				}
 				if (NULL != pbuf) {
 					_mscdf_funcd.xfer_stage = MSCDF_DATA_STAGE;
-					_mscdf_funcd.xfer_blk_size
+					_mscdf_funcd.xfer_blk_size[pcbw->bCBWLUN & 0x0F]
 					    = (uint32_t)(pbuf[4] << 24) + (uint32_t)(pbuf[5] << 16) + (uint32_t)(pbuf[6] << 8) + pbuf[7];
 					pcsw->bCSWStatus      = USB_CSW_STATUS_PASS;
 					pcsw->dCSWDataResidue = 0;
@@ -372,8 +545,39 @@ static bool mscdf_cb_ep_bulk_out(const uint8_t ep, const enum usb_xfer_code rc,
 					return mscdf_terminate_in();
 				}
 
+			case SBC_SERVICE_ACTION_IN16:
+				if ((pcbw->CDB[1] & 0x1F) != SBC_SAI_READ_CAPACITY16) {
+					break;
+				}
+				if (NULL != mscdf_get_disk_capacity16) {
+					pbuf = mscdf_get_disk_capacity16(pcbw->bCBWLUN);
+				}
+				if (NULL != pbuf) {
+					uint32_t alloc_len = (uint32_t)(pcbw->CDB[10] << 24) + (uint32_t)(pcbw->CDB[11] << 16)
+					                     + (uint32_t)(pcbw->CDB[12] << 8) + pcbw->CDB[13];
+					if (alloc_len > 32) {
+						alloc_len = 32;
+					}
+					if (alloc_len > pcbw->dCBWDataTransferLength) {
+						alloc_len = pcbw->dCBWDataTransferLength;
+					}
+					_mscdf_funcd.xfer_stage = MSCDF_DATA_STAGE;
+					_mscdf_funcd.xfer_blk_size[pcbw->bCBWLUN & 0x0F]
+					    = (uint32_t)(pbuf[8] << 24) + (uint32_t)(pbuf[9] << 16) + (uint32_t)(pbuf[10] << 8) + pbuf[11];
+					pcsw->bCSWStatus      = USB_CSW_STATUS_PASS;
+					pcsw->dCSWDataResidue = pcbw->dCBWDataTransferLength - alloc_len;
+					return ERR_NONE == usbdc_xfer(_mscdf_funcd.func_ep_in, pbuf, alloc_len, false);
+				} else {
+					pcsw->bCSWStatus = USB_CSW_STATUS_FAIL;
+					mscdf_request_sense(ERR_NOT_FOUND);
+					pcsw->dCSWDataResidue = 0;
+					return mscdf_terminate_in();
+				}
+
 			case SBC_READ10:
 			case SBC_WRITE10:
+			case SBC_READ16:
+			case SBC_WRITE16:
 				return mscdf_read_write(count);
 
 			case SPC_PREVENT_ALLOW_MEDIUM_REMOVAL:
@@ -435,11 +639,25 @@ static bool mscdf_cb_ep_bulk_out(const uint8_t ep, const enum usb_xfer_code rc,
 			default:
 				break;
 			}
+			if (NULL != mscdf_ext_cmd) {
+				uint32_t len = 0;
+				ret = mscdf_ext_cmd(pcbw->bCBWLUN, pcbw->CDB, &pbuf, &len);
+				if (ERR_UNSUPPORTED_OP != ret) {
+					return mscdf_ext_data(ret, pbuf, len);
+				}
+			}
 			return mscdf_invalid_cmd();
 		} else {
 			return true;
 		}
 	} else if (_mscdf_funcd.xfer_stage == MSCDF_DATA_STAGE) {
+		if (MSCDF_EXT_DATA_OUT == mscdf_ext_phase) {
+			ret = ERR_NONE;
+			if (NULL != mscdf_ext_data_out) {
+				ret = mscdf_ext_data_out(pcbw->bCBWLUN, pcbw->CDB, count);
+			}
+			return mscdf_ext_status(ret);
+		}
 		return mscdf_read_write(count);
 	} else {
 		return true;
@@ -702,6 +920,21 @@ int32_t mscdf_register_callback(enum mscdf_cb_type cb_type, FUNC_PTR func)
 	case MSCDF_CB_XFER_BLOCKS_DONE:
 		mscdf_xfer_blocks_done = (mscdf_xfer_blocks_done_t)func;
 		break;
+	case MSCDF_CB_GET_DISK_CAPACITY16:
+		mscdf_get_disk_capacity16 = (mscdf_get_disk_capacity16_t)func;
+		break;
+	case MSCDF_CB_SYNC_CACHE:
+		mscdf_sync_cache = (mscdf_sync_cache_t)func;
+		break;
+	case MSCDF_CB_MODE_SENSE:
+		mscdf_mode_sense = (mscdf_mode_sense_t)func;
+		break;
+	case MSCDF_CB_EXT_CMD:
+		mscdf_ext_cmd = (mscdf_ext_cmd_t)func;
+		break;
+	case MSCDF_CB_EXT_DATA_OUT:
+		mscdf_ext_data_out = (mscdf_ext_data_out_t)func;
+		break;
 	default:
 		return ERR_INVALID_ARG;
 	}
@@ -731,7 +964,7 @@ int32_t mscdf_xfer_blocks(bool rd, uint8_t *blk_addr, uint32_t blk_cnt)
 		return ERR_BUSY;
 	} else {
 		_mscdf_funcd.xfer_blk_addr  = blk_addr;
-		_mscdf_funcd.xfer_tot_bytes = _mscdf_funcd.xfer_blk_size * blk_cnt;
+		_mscdf_funcd.xfer_tot_bytes = _mscdf_funcd.xfer_blk_size[mscdf_cbw.bCBWLUN & 0x0F] * blk_cnt;
 		if (0 == _mscdf_funcd.xfer_tot_bytes) {
 			if (false == rd) {
 				/* For write command, this means no need for more data to receive.
@@ -757,6 +990,54 @@ int32_t mscdf_xfer_blocks(bool rd, uint8_t *blk_addr, uint32_t blk_cnt)
 	}
 }
 
+/**
+ * \brief Fail a write or SYNCHRONIZE CACHE once its data is in.
+ *
+ * Routine called by the main loop in place of the final mscdf_xfer_blocks(false, buf, 0)
+ */
+int32_t mscdf_xfer_fail(int32_t err)
+{
+	if (false == mscdf_is_enabled()) {
+		return ERR_DENIED;
+	} else if (true == _mscdf_funcd.xfer_busy) {
+		return ERR_BUSY;
+	}
+	mscdf_csw.bCSWStatus = USB_CSW_STATUS_FAIL;
+	mscdf_request_sense(err);
+	return mscdf_send_csw()?ERR_NONE:ERR_FAILURE;
+}
+
+/**
+ * \brief Finish a suspended extended command.
+ *
+ * Routine called by the main loop
+ */
+int32_t mscdf_ext_complete(int32_t status, uint8_t *buf, uint32_t len)
+{
+	bool ok;
+
+	if (false == mscdf_is_enabled()) {
+		return ERR_DENIED;
+	}
+	if (MSCDF_EXT_WAIT_START == mscdf_ext_phase) {
+		ok = mscdf_ext_data(status, buf, len);
+	} else if (MSCDF_EXT_WAIT_STATUS == mscdf_ext_phase) {
+		ok = mscdf_ext_status(status);
+	} else {
+		return ERR_DENIED;
+	}
+	return ok ? ERR_NONE : ERR_FAILURE;
+}
+
+/**
+ * \brief Check whether an extended command's data is on its way to the host.
+ */
+bool mscdf_ext_sending(void)
+{
+	return _mscdf_funcd.enabled && MSCDF_EXT_DATA_IN == mscdf_ext_phase
+	       && MSCDF_DATA_STAGE == _mscdf_funcd.xfer_stage;
+}
+
 /**
  * \brief Return version
  */
@@ -0,0 +1,197 @@
+/**
+ * \file
+ *
+ * \brief USB Device Stack MSC Function Definition.
+ *
+ * Copyright (C) 2016 - 2017 Atmel Corporation. All rights reserved.
+ *
+ * \asf_license_start
+ *
+ * \page License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. The name of Atmel may not be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * 4. This software may only be redistributed and used in connection with an
+ *    Atmel micro controller product.
+ *
+ * THIS SOFTWARE IS PROVIDED BY ATMEL "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT ARE
+ * EXPRESSLY AND SPECIFICALLY DISCLAIMED. IN NO EVENT SHALL ATMEL BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * \asf_license_stop
+ *
+ */
+
+#ifndef USBDF_MSC_H_
+#define USBDF_MSC_H_
+
+#include "usbdc.h"
+#include "usb_protocol_msc.h"
+#include "spc_protocol.h"
+#include "sbc_protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The stock SBC header only knows about the 10 byte CDBs. */
+#ifndef SBC_READ16
+#define SBC_READ16 0x88
+#endif
+#ifndef SBC_WRITE16
+#define SBC_WRITE16 0x8A
+#endif
+#ifndef SBC_SERVICE_ACTION_IN16
+#define SBC_SERVICE_ACTION_IN16 0x9E
+#endif
+#ifndef SBC_SAI_READ_CAPACITY16
+#define SBC_SAI_READ_CAPACITY16 0x10
+#endif
+#ifndef SBC_SYNCHRONIZE_CACHE10
+#define SBC_SYNCHRONIZE_CACHE10 0x35
+#endif
+#ifndef SBC_SYNCHRONIZE_CACHE16
+#define SBC_SYNCHRONIZE_CACHE16 0x91
+#endif
+/* Force Unit Access bit in byte 1 of the READ/WRITE CDBs */
+#define SBC_CDB1_FUA 0x08
+/* MODE SENSE pages */
+#define SPC_MP_CACHING 0x08
+#define SPC_MP_ALL 0x3F
+
+/* Not an ASF error code: SEND DIAGNOSTIC ran, and a test failed. It's reported
+ * as HARDWARE ERROR / DIAGNOSTIC FAILURE. ERR_IO is a MEDIUM ERROR. */
+#define ERR_DIAG_FAILED (-100)
+
+/** MSC Class Callback Type */
+enum mscdf_cb_type {
+	MSCDF_CB_INQUIRY_DISK,
+	MSCDF_CB_GET_DISK_CAPACITY,
+	MSCDF_CB_START_READ_DISK,
+	MSCDF_CB_START_WRITE_DISK,
+	MSCDF_CB_EJECT_DISK,
+	MSCDF_CB_TEST_DISK_READY,
+	MSCDF_CB_XFER_BLOCKS_DONE,
+	MSCDF_CB_GET_DISK_CAPACITY16,
+	MSCDF_CB_SYNC_CACHE,
+	MSCDF_CB_MODE_SENSE,
+	MSCDF_CB_EXT_CMD,
+	MSCDF_CB_EXT_DATA_OUT
+};
+
+/** MSC Class Callback Function Type */
+typedef uint8_t *(*mscdf_inquiry_disk_t)(uint8_t);
+/* Returns the 8 byte READ CAPACITY(10) response */
+typedef uint8_t *(*mscdf_get_disk_capacity_t)(uint8_t);
+/* Returns the 32 byte READ CAPACITY(16) response */
+typedef uint8_t *(*mscdf_get_disk_capacity16_t)(uint8_t);
+typedef int32_t (*mscdf_eject_disk_t)(uint8_t);
+typedef int32_t (*mscdf_test_disk_ready_t)(uint8_t);
+/* Block addresses are 64 bits wide so that READ(16)/WRITE(16) can reach past 2^32 blocks */
+typedef int32_t (*mscdf_start_read_disk_t)(uint8_t, uint64_t, uint32_t);
+/* The last argument is the FUA bit - the data must be on the medium before the command completes */
+typedef int32_t (*mscdf_start_write_disk_t)(uint8_t, uint64_t, uint32_t, bool);
+typedef int32_t (*mscdf_xfer_blocks_done_t)(uint8_t);
+/* Returning ERR_NONE means the status will be sent by a later mscdf_xfer_blocks(false, buf, 0) */
+typedef int32_t (*mscdf_sync_cache_t)(uint8_t);
+/* Returns a MODE SENSE(6) response for the given page code (the first byte is the length - 1) */
+typedef uint8_t *(*mscdf_mode_sense_t)(uint8_t, uint8_t);
+/* Called for any command the driver doesn't handle itself, with the CDB.
+ * ERR_NONE: set the buffer and length for the data stage (the direction comes from the CBW).
+ *           A length of 0 means there's no data and the command passes.
+ * ERR_SUSPEND: the command completes later through mscdf_ext_complete().
+ * Anything else fails the command with sense data from the error code. */
+typedef int32_t (*mscdf_ext_cmd_t)(uint8_t, const uint8_t *, uint8_t **, uint32_t *);
+/* The data OUT stage of an extended command is done. Same return codes, but there's no more data. */
+typedef int32_t (*mscdf_ext_data_out_t)(uint8_t, const uint8_t *, uint32_t);
+
+/**
+ * \brief Initialize the USB MSC Function Driver
+ * \param[in] max_lun max logic unit number
+ * \return Operation status.
+ */
+int32_t mscdf_init(uint8_t max_lun);
+
+/**
+ * \brief Deinitialize the USB MSC Function Driver
+ * \return Operation status.
+ */
+int32_t mscdf_deinit(void);
+
+/**
+ * \brief USB MSC Function Register Callback
+ * \param[in] cb_type Callback type of MSC Function
+ * \param[in] func Pointer to callback function
+ * \return Operation status.
+ */
+int32_t mscdf_register_callback(enum mscdf_cb_type cb_type, FUNC_PTR func);
+
+/**
+ * \brief Check whether MSC Function is enabled
+ * \return Operation status.
+ * \return true MSC Function is enabled
+ * \return false MSC Function is disabled
+ */
+bool mscdf_is_enabled(void);
+
+/**
+ * \brief Process the transfer between USB and Memory
+ * \param[in] rd Read or write
+ * \param[in] blk_addr Pointer to memory buffer
+ * \param[in] blk_cnt Block count of this transfer
+ * \return Operation status.
+ */
+int32_t mscdf_xfer_blocks(bool rd, uint8_t *blk_addr, uint32_t blk_cnt);
+
+/**
+ * \brief Finish a write or sync with a failed status instead of mscdf_xfer_blocks(false, buf, 0)
+ * \param[in] err The error to report in the sense data
+ * \return Operation status.
+ */
+int32_t mscdf_xfer_fail(int32_t err);
+
+/**
+ * \brief Finish an extended command that was suspended
+ * \param[in] status ERR_NONE or the error to report
+ * \param[in] buf Data to send, if the command hadn't got to its data stage yet
+ * \param[in] len Length of that data
+ * \return Operation status.
+ */
+int32_t mscdf_ext_complete(int32_t status, uint8_t *buf, uint32_t len);
+
+/**
+ * \brief Check whether an extended command's data is on its way to the host
+ * \return true until the host has the last of it (or a reset ends the command),
+ * so the buffer passed to mscdf_ext_complete() can't be reused until it's false
+ */
+bool mscdf_ext_sending(void);
+
+/**
+ * \brief Return version
+ */
+uint32_t mscdf_get_version(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBDF_MSC_H_ */
@@ -21,18 +21,45 @@
 #include "usb_start.h"
 #include <Crypto.h>
 #include <MCI.h>
+#include <Cache.h>
+#include <Prefetch.h>
+#include <Sched.h>
+#include <Profile.h>
+#include <Trace.h>
+#include <Vendor.h>
+#include <InfoDisk.h>
+#include <Cbt.h>
+
+extern volatile uint32_t millis; // from main.
+
+#ifdef INFO_DISK
+#define MAX_LUN (INFO_LUN)
+#else
+#define MAX_LUN (0)
+#endif
+
+// If the host has left us alone for this long, write out the write-back cache.
+#define IDLE_FLUSH_TIME (250)
 
 static enum usb_volume_state vol_state;
 
-enum xfer_dirs { IDLE, READ, WRITE };
+enum xfer_dirs { IDLE, READ, WRITE, SYNC };
 
 volatile static enum xfer_dirs xfer_dir;
-volatile static uint32_t xfer_addr;
+volatile static uint8_t xfer_lun;
+volatile static uint64_t xfer_addr;
 volatile static uint32_t num_blocks;
 volatile static bool xfer_busy;
+volatile static bool xfer_fua;
+static bool xfer_failed; // a block of the current write didn't make it to the card
+static uint32_t last_io;
+static uint64_t read_next; // the block after the last one we sent the host
+#ifdef PROFILE
+static volatile uint32_t usb_cycles; // when the current USB data transfer started (0 if none)
+#endif
 
 COMPILER_ALIGNED(4)
-volatile static uint8_t __attribute__((section(".dtcm"))) blockbuf[SECTOR_SIZE];
+volatile static uint8_t __attribute__((section(".dtcm"))) blockbuf[MAX_VOLUME_BLOCK_SIZE];
 
 static uint8_t single_desc_bytes[] = {
     /* Device descriptors and Configuration descriptors list. */
@@ -53,14 +80,24 @@ static uint8_t ctrl_buffer[64];
 	}
 
 /* Inquiry Information */
-static uint8_t inquiry_info[CONF_USB_MSC_MAX_LUN + 1][36] = { DISK_INFORMATION(0) };
+static uint8_t inquiry_info[MAX_LUN + 1][36] = {
+	DISK_INFORMATION(0),
+#ifdef INFO_DISK
+	INFO_DISK_INQUIRY,
+#endif
+};
 
 static bool in_attention;
 
 void set_state(enum usb_volume_state st_in) {
 	vol_state = st_in;
+	prefetch_reset();
 	in_attention = true;
 }
+
+enum usb_volume_state get_state(void) {
+	return vol_state;
+}
 	
 /**
  * \brief Eject Disk
@@ -69,15 +106,19 @@ void set_state(enum usb_volume_state st_in) {
  */
 static int32_t disk_eject(uint8_t lun)
 {
-	if (lun > CONF_USB_MSC_MAX_LUN) {
+	if (lun > MAX_LUN) {
 		return ERR_NOT_FOUND;
 	}
 	// No, we can't just spit the cards out for you.
 	return ERR_UNSUPPORTED_OP;
 }
 
-static int32_t check_state() {
+static int32_t check_state(uint8_t lun) {
 	int32_t ret = ERR_NOT_FOUND;
+#ifdef INFO_DISK
+	// The info disk doesn't care what the volume is up to.
+	if (lun == INFO_LUN) return ERR_NONE;
+#endif
 	if (in_attention) {
 		ret = ERR_ABORTED;
 	} else if (vol_state == NOT_READY) {
@@ -95,12 +136,12 @@ static int32_t check_state() {
  */
 static int32_t disk_is_ready(uint8_t lun)
 {
-	if (lun > CONF_USB_MSC_MAX_LUN) {
+	if (lun > MAX_LUN) {
 		return ERR_NOT_FOUND;
 	}
-	int32_t ret = check_state();
+	int32_t ret = check_state(lun);
 	// Once we've been checked here, an ATTENTION state is cleared.
-	in_attention = false;
+	if (lun == 0) in_attention = false;
 	return ret;
 }
 
@@ -111,19 +152,25 @@ static int32_t disk_is_ready(uint8_t lun)
  * \param[in] nblocks block amount to be read
  * \return Operation status.
  */
-static int32_t msc_new_read(uint8_t lun, uint32_t addr, uint32_t nblocks)
+static int32_t msc_new_read(uint8_t lun, uint64_t addr, uint32_t nblocks)
 {
-	int32_t ret = check_state();
+	int32_t ret = check_state(lun);
 	if (ret != ERR_NONE) return ret;
 	
-	if (lun > CONF_USB_MSC_MAX_LUN) {
+	if (lun > MAX_LUN) {
 		return ERR_NOT_READY;
 	}
+#ifdef INFO_DISK
+	if (lun == INFO_LUN && addr + nblocks > INFO_DISK_SECTORS) return ERR_BAD_ADDRESS;
+#endif
 
 	xfer_dir  = READ;
+	xfer_lun = lun;
 	xfer_addr = addr;
 	num_blocks = nblocks;
 	xfer_busy = false;
+	if (lun == 0) prefetch_note_read(addr, nblocks);
+	sched_post(EV_DISK);
 	
 	return ERR_NONE;
 }
@@ -133,26 +180,56 @@ static int32_t msc_new_read(uint8_t lun, uint32_t addr, uint32_t nblocks)
  * \param[in] lun logic unit number
  * \param[in] addr start address of disk to be written
  * \param[in] nblocks block amount to be written
+ * \param[in] fua the blocks must be on the cards before the command completes
  * \return Operation status.
  */
-static int32_t msc_new_write(uint8_t lun, uint32_t addr, uint32_t nblocks)
+static int32_t msc_new_write(uint8_t lun, uint64_t addr, uint32_t nblocks, bool fua)
 {
-	int32_t ret = check_state();
+	int32_t ret = check_state(lun);
 	if (ret != ERR_NONE) return ret;
 
-	if (lun > CONF_USB_MSC_MAX_LUN) {
+	if (lun > MAX_LUN) {
 		return ERR_NOT_READY;
 	}
+#ifdef INFO_DISK
+	if (lun == INFO_LUN) return ERR_DENIED; // write protected
+#endif
 	xfer_dir  = WRITE;
+	xfer_lun = lun;
 	xfer_addr = addr;
 	num_blocks = nblocks;
+	xfer_fua = fua;
+	xfer_failed = false;
 	xfer_busy = true;
+	PROFILE_MARK(usb_cycles);
+	TRACE_EVENT(TR_USB_START, 0, 0);
 	int32_t res = mscdf_xfer_blocks(false, blockbuf, 1);
 	ASSERT(res == ERR_NONE);
 
 	return ERR_NONE;
 }
 
+/**
+ * \brief Callback invoked when a synchronize cache command received
+ * \param[in] lun logic unit number
+ * \return Operation status.
+ */
+static int32_t msc_sync_cache(uint8_t lun)
+{
+	int32_t ret = check_state(lun);
+	if (ret != ERR_NONE) return ret;
+
+	if (lun > MAX_LUN) {
+		return ERR_NOT_READY;
+	}
+	// The flush has to happen out in the main loop.
+	xfer_dir = SYNC;
+	xfer_busy = false;
+	sched_post(EV_DISK);
+
+	return ERR_NONE;
+}
+
 /**
  * \brief Callback invoked when a blocks transfer is done
  * \param[in] lun logic unit number
@@ -160,11 +237,19 @@ static int32_t msc_new_write(uint8_t lun, uint32_t addr, uint32_t nblocks)
  */
 static int32_t msc_xfer_done(uint8_t lun)
 {
-	if (lun > CONF_USB_MSC_MAX_LUN) {
+	if (lun > MAX_LUN) {
 		return ERR_DENIED;
 	}
 
 	xfer_busy = false;
+	TRACE_EVENT(TR_USB_DONE, 0, 0);
+#ifdef PROFILE
+	if (usb_cycles != 0) {
+		PROFILE_END(PROF_USB, usb_cycles);
+		usb_cycles = 0;
+	}
+#endif
+	sched_post(EV_DISK);
 	
 	return ERR_NONE;
 }
@@ -181,12 +266,47 @@ __attribute__((noinline)) __attribute__((section(".itcm"))) void disk_task(void)
 		xfer_busy = false;
 		return;
 	}
-	if (xfer_busy) return; // USB is busy
+	if (xfer_dir == IDLE) {
+		// A raw read goes out of the staging buffer, and all of what follows
+		// can use it. Leave it alone until the host has the data.
+		if (mscdf_ext_sending()) return;
+		// Don't leave writes sitting in the cache once the host is done with us.
+		// This doesn't touch blockbuf, so it doesn't matter if USB is busy.
+		if (vol_state == READY && millis - last_io > IDLE_FLUSH_TIME && cache_dirty_count() > 0) {
+			// Anything that didn't get written is still dirty. Back off and
+			// try again later rather than hammering a card that's failing.
+			if (!flushVolume()) last_io = millis;
+		} else if (vol_state == READY && millis - last_io > IDLE_FLUSH_TIME && cbt_needs_checkpoint()) {
+			// The data's out. Now the record of where it went. If this fails,
+			// it's tried again next time around.
+			cbt_checkpoint();
+		} else if (vol_state == READY && prefetch_task(read_next)) {
+			sched_post(EV_DISK); // keep going
+		}
+		return;
+	}
+	if (xfer_busy) {
+		// USB is busy. If it's sending a block to the host, the cards are free
+		// to read ahead. The transfer completion will bring us back either way.
+		if (xfer_dir == READ && xfer_lun == 0) prefetch_task(read_next);
+		return;
+	}
+	last_io = millis;
 	switch(xfer_dir) {
 		case READ:
-			res_b = readVolumeBlock(xfer_addr++, blockbuf);
-			ASSERT(res_b);
+#ifdef INFO_DISK
+			if (xfer_lun == INFO_LUN) {
+				info_disk_read(xfer_addr++, blockbuf);
+			} else
+#endif
+			{
+				res_b = readVolumeBlock(xfer_addr++, blockbuf);
+				ASSERT(res_b);
+				read_next = xfer_addr;
+			}
 			xfer_busy = true;
+			PROFILE_MARK(usb_cycles);
+			TRACE_EVENT(TR_USB_START, 1, 0);
 			res_i = mscdf_xfer_blocks(true, blockbuf, 1);
 			ASSERT(res_i == ERR_NONE);
 			if (--num_blocks == 0) {
@@ -196,22 +316,39 @@ __attribute__((noinline)) __attribute__((section(".itcm"))) void disk_task(void)
 			break;
 		case WRITE:
 			// We previously did a transfer into blockbuf
-			res_b = writeVolumeBlock(xfer_addr++, blockbuf);
-			ASSERT(res_b);
+			// Keep taking the data even if a block fails - the host is
+			// going to send it anyway. The failure goes in the status.
+			if (!writeVolumeBlock(xfer_addr++, blockbuf, xfer_fua)) xfer_failed = true;
 			if (--num_blocks > 0) {
 				// Fetch the next block in the background
 				xfer_busy = true;
+				PROFILE_MARK(usb_cycles);
+				TRACE_EVENT(TR_USB_START, 0, 0);
 				res_i = mscdf_xfer_blocks(false, blockbuf, 1);
 				ASSERT(res_i == ERR_NONE);
 			} else {
 				// This special call tells the MSC system that the write
 				// is committed and the ACK can be sent to the host.
 				xfer_busy = true;
-				res_i = mscdf_xfer_blocks(false, blockbuf, 0);
+				if (xfer_failed)
+					res_i = mscdf_xfer_fail(ERR_IO);
+				else
+					res_i = mscdf_xfer_blocks(false, blockbuf, 0);
 				ASSERT(res_i == ERR_NONE);
 				xfer_dir = IDLE;
 			}
 			break;
+		case SYNC:
+			res_b = flushVolume();
+			// Same special call as the end of a write - send the status.
+			xfer_busy = true;
+			if (res_b)
+				res_i = mscdf_xfer_blocks(false, blockbuf, 0);
+			else
+				res_i = mscdf_xfer_fail(ERR_IO);
+			ASSERT(res_i == ERR_NONE);
+			xfer_dir = IDLE;
+			break;
 		case IDLE:
 			// do nothing.
 			break;
@@ -225,7 +362,7 @@ __attribute__((noinline)) __attribute__((section(".itcm"))) void disk_task(void)
  */
 static uint8_t *msc_inquiry_info(uint8_t lun)
 {
-        if (lun > CONF_USB_MSC_MAX_LUN) {
+        if (lun > MAX_LUN) {
                 return NULL;
         } else {
                 num_blocks = -1;
@@ -235,6 +372,7 @@ static uint8_t *msc_inquiry_info(uint8_t lun)
 }
 
 static uint8_t cap_buffer[8];
+static uint8_t cap16_buffer[32];
 
 /**
  * \brief Callback invoked when read format capacities command received
@@ -243,21 +381,97 @@ static uint8_t cap_buffer[8];
  */
 static uint8_t *msc_get_capacity(uint8_t lun)
 {
-	if (lun > CONF_USB_MSC_MAX_LUN || vol_state != READY) {
+#ifdef INFO_DISK
+	if (lun == INFO_LUN) {
+		memset(cap_buffer, 0, sizeof(cap_buffer));
+		cap_buffer[2] = (uint8_t)((INFO_DISK_SECTORS - 1) >> 8);
+		cap_buffer[3] = (uint8_t)((INFO_DISK_SECTORS - 1) >> 0);
+		cap_buffer[6] = (uint8_t)(INFO_SECTOR_SIZE >> 8);
+		cap_buffer[7] = (uint8_t)(INFO_SECTOR_SIZE >> 0);
+		return cap_buffer;
+	}
+#endif
+	if (lun > MAX_LUN || vol_state != READY) {
 		return NULL;
 	} else {
-		cap_buffer[0] = (uint8_t)((volume_size - 1) >> 24);
-		cap_buffer[1] = (uint8_t)((volume_size - 1) >> 16);
-		cap_buffer[2] = (uint8_t)((volume_size - 1) >> 8);
-		cap_buffer[3] = (uint8_t)((volume_size - 1) >> 0);
-		cap_buffer[4] = (uint8_t)(SECTOR_SIZE >> 24);
-		cap_buffer[5] = (uint8_t)(SECTOR_SIZE >> 16);
-		cap_buffer[6] = (uint8_t)(SECTOR_SIZE >> 8);
-		cap_buffer[7] = (uint8_t)(SECTOR_SIZE >> 0);
+		// If the last block won't fit, report all ones, which tells the host
+		// to go ask with READ CAPACITY(16) instead.
+		uint32_t last_block = (volume_size - 1 > 0xffffffffULL)?0xffffffffUL:(uint32_t)(volume_size - 1);
+		cap_buffer[0] = (uint8_t)(last_block >> 24);
+		cap_buffer[1] = (uint8_t)(last_block >> 16);
+		cap_buffer[2] = (uint8_t)(last_block >> 8);
+		cap_buffer[3] = (uint8_t)(last_block >> 0);
+		cap_buffer[4] = (uint8_t)(volume_block_size >> 24);
+		cap_buffer[5] = (uint8_t)(volume_block_size >> 16);
+		cap_buffer[6] = (uint8_t)(volume_block_size >> 8);
+		cap_buffer[7] = (uint8_t)(volume_block_size >> 0);
 		return cap_buffer;
 	}
 }
 
+/**
+ * \brief Callback invoked when read capacity (16) command received
+ * \param[in] lun logic unit number
+ * \return Operation status.
+ */
+static uint8_t *msc_get_capacity16(uint8_t lun)
+{
+#ifdef INFO_DISK
+	if (lun == INFO_LUN) {
+		memset(cap16_buffer, 0, sizeof(cap16_buffer));
+		cap16_buffer[6] = (uint8_t)((INFO_DISK_SECTORS - 1) >> 8);
+		cap16_buffer[7] = (uint8_t)((INFO_DISK_SECTORS - 1) >> 0);
+		cap16_buffer[10] = (uint8_t)(INFO_SECTOR_SIZE >> 8);
+		cap16_buffer[11] = (uint8_t)(INFO_SECTOR_SIZE >> 0);
+		return cap16_buffer;
+	}
+#endif
+	if (lun > MAX_LUN || vol_state != READY) {
+		return NULL;
+	} else {
+		memset(cap16_buffer, 0, sizeof(cap16_buffer));
+		for(int i = 0; i < 8; i++)
+			cap16_buffer[i] = (uint8_t)((volume_size - 1) >> (56 - 8 * i));
+		cap16_buffer[8] = (uint8_t)(volume_block_size >> 24);
+		cap16_buffer[9] = (uint8_t)(volume_block_size >> 16);
+		cap16_buffer[10] = (uint8_t)(volume_block_size >> 8);
+		cap16_buffer[11] = (uint8_t)(volume_block_size >> 0);
+		return cap16_buffer;
+	}
+}
+
+static uint8_t mode_buffer[4 + 20];
+
+/**
+ * \brief Callback invoked when mode sense (6) command received
+ * \param[in] lun logic unit number
+ * \param[in] page the page code requested
+ * \return The mode parameter header followed by the requested page(s).
+ */
+static uint8_t *msc_mode_sense(uint8_t lun, uint8_t page)
+{
+	if (lun > MAX_LUN) {
+		return NULL;
+	}
+	memset(mode_buffer, 0, sizeof(mode_buffer));
+	mode_buffer[0] = 3; // mode data length (not counting itself)
+	mode_buffer[2] = 0x10; // DPOFUA - we honor FUA
+#ifdef INFO_DISK
+	if (lun == INFO_LUN) {
+		mode_buffer[2] = 0x80; // WP - and no caching page
+		return mode_buffer;
+	}
+#endif
+	if (page == SPC_MP_CACHING || page == SPC_MP_ALL) {
+		uint8_t *caching = mode_buffer + 4;
+		caching[0] = SPC_MP_CACHING;
+		caching[1] = 0x12; // page length
+		caching[2] = write_cache_enabled?0x04:0x00; // WCE
+		mode_buffer[0] += 20;
+	}
+	return mode_buffer;
+}
+
 /**
  * \brief USB MSC Init
  */
@@ -267,7 +481,7 @@ void usbd_msc_init(void)
 	usbdc_init(ctrl_buffer);
 
 	/* usbdc_register_funcion inside */
-	mscdf_init(CONF_USB_MSC_MAX_LUN);
+	mscdf_init(MAX_LUN);
 }
 
 void usb_init(void)
@@ -279,11 +493,16 @@ void usb_init(void)
 	usbd_msc_init();
 	mscdf_register_callback(MSCDF_CB_INQUIRY_DISK, (FUNC_PTR)msc_inquiry_info);
 	mscdf_register_callback(MSCDF_CB_GET_DISK_CAPACITY, (FUNC_PTR)msc_get_capacity);
+	mscdf_register_callback(MSCDF_CB_GET_DISK_CAPACITY16, (FUNC_PTR)msc_get_capacity16);
 	mscdf_register_callback(MSCDF_CB_START_READ_DISK, (FUNC_PTR)msc_new_read);
 	mscdf_register_callback(MSCDF_CB_START_WRITE_DISK, (FUNC_PTR)msc_new_write);
 	mscdf_register_callback(MSCDF_CB_EJECT_DISK, (FUNC_PTR)disk_eject);
 	mscdf_register_callback(MSCDF_CB_TEST_DISK_READY, (FUNC_PTR)disk_is_ready);
 	mscdf_register_callback(MSCDF_CB_XFER_BLOCKS_DONE, (FUNC_PTR)msc_xfer_done);
+	mscdf_register_callback(MSCDF_CB_SYNC_CACHE, (FUNC_PTR)msc_sync_cache);
+	mscdf_register_callback(MSCDF_CB_MODE_SENSE, (FUNC_PTR)msc_mode_sense);
+	mscdf_register_callback(MSCDF_CB_EXT_CMD, (FUNC_PTR)vendor_cmd);
+	mscdf_register_callback(MSCDF_CB_EXT_DATA_OUT, (FUNC_PTR)vendor_data_out);
 	usbdc_start(&single_desc);
 	usbdc_attach();
 }
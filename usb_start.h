@@ -29,7 +29,11 @@ enum usb_volume_state {NOT_READY, READY};
 // check is done, and then will take on the new state
 void set_state(enum usb_volume_state state);
 
-// call this from the main event loop
+// The state set_state() last set.
+enum usb_volume_state get_state(void);
+
+// This is the EV_DISK task. The USB callbacks post that event whenever
+// there's something for it to do.
 void disk_task(void);
 
 #ifdef __cplusplus